@@ -37,6 +37,11 @@ static inline uint64_t read_le64(const uint8_t *in) {
 	       (((uint64_t) in[7]) << 56);
 }
 
+static inline void write_le16(uint8_t *out, uint16_t in) {
+	out[0] = in & 0xff;
+	out[1] = (in >> 8) & 0xff;
+}
+
 static inline void write_le32(uint8_t *out, uint32_t in) {
 	out[0] = in & 0xff;
 	out[1] = (in >> 8) & 0xff;
@@ -55,4 +60,30 @@ static inline void write_le64(uint8_t *out, uint64_t in) {
 	out[7] = (in >> 56) & 0xff;
 }
 
+/* Variable length integers, 7 bits per byte with the low bits first and the
+ * top bit set on every byte but the last. Small values take one byte. */
+static inline size_t write_varint(uint8_t *out, uint64_t in) {
+	size_t len = 0;
+	
+	while (in >= 0x80) {
+		out[len++] = (in & 0x7f) | 0x80;
+		in >>= 7;
+	}
+	out[len++] = in;
+	return len;
+}
+
+/* Returns the number of bytes used, or 0 if @in ends too soon */
+static inline size_t read_varint(const uint8_t *in, size_t len, uint64_t *out) {
+	size_t i;
+	
+	*out = 0;
+	for (i = 0; i < len && i < 10; i++) {
+		*out |= ((uint64_t) (in[i] & 0x7f)) << (7 * i);
+		if (!(in[i] & 0x80))
+			return i + 1;
+	}
+	return 0;
+}
+
 #endif
@@ -0,0 +1,112 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "oggcrc.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Random data to checksum, with room for any offset and length tried */
+#define CRCTEST_BUFFER_SIZE (256 * 1024)
+
+/* The number of random offset, length and seed combinations to try */
+#define CRCTEST_ROUNDS 20000
+
+typedef uint32_t (*crc_kernel)(uint32_t crc, const uint8_t *data, size_t len);
+
+typedef struct crc_kernel_info {
+	const char *name;
+	crc_kernel update;
+} crc_kernel_info;
+
+/* Mostly short lengths, where the kernels handle their head and tail bytes,
+ * with some long enough for many blocks of the widest kernel */
+static size_t random_length(void) {
+	switch (rand() % 4) {
+	case 0:
+		return rand() % 64;
+	case 1:
+		return rand() % 1024;
+	case 2:
+		return rand() % 8192;
+	default:
+		return rand() % (CRCTEST_BUFFER_SIZE / 2);
+	}
+}
+
+static uint32_t random_seed(void) {
+	/* A new checksum starts from zero, so try that often */
+	if (rand() % 4 == 0)
+		return 0;
+	return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+int main(void) {
+	crc_kernel_info kernels[4];
+	size_t kernel_count = 0, i, k;
+	uint8_t *buffer, *zeros;
+	unsigned int failures = 0;
+	
+	kernels[kernel_count++] = (crc_kernel_info) { "slice-by-8", ogg_crc_update_slice8 };
+	kernels[kernel_count++] = (crc_kernel_info) { "slice-by-16", ogg_crc_update_slice16 };
+	if (ogg_crc_clmul_supported())
+		kernels[kernel_count++] = (crc_kernel_info) { "clmul", ogg_crc_update_clmul };
+	else
+		printf("clmul: not supported by this CPU, skipped\n");
+	kernels[kernel_count++] = (crc_kernel_info) { "dispatch", ogg_crc_update };
+	
+	srand(1);
+	buffer = malloc(CRCTEST_BUFFER_SIZE);
+	zeros = calloc(CRCTEST_BUFFER_SIZE, 1);
+	for (i = 0; i < CRCTEST_BUFFER_SIZE; i++)
+		buffer[i] = rand();
+	
+	for (i = 0; i < CRCTEST_ROUNDS; i++) {
+		size_t len = random_length();
+		size_t offset = rand() % (CRCTEST_BUFFER_SIZE - len + 1);
+		uint32_t seed = random_seed();
+		uint32_t expected = ogg_crc_update_bytewise(seed, &buffer[offset], len);
+		uint32_t crc;
+		
+		for (k = 0; k < kernel_count; k++) {
+			crc = kernels[k].update(seed, &buffer[offset], len);
+			if (crc == expected)
+				continue;
+			if (failures++ < 10)
+				fprintf(stderr, "%s: offset %zu length %zu seed %08x: got %08x, expected %08x\n",
+					kernels[k].name, offset, len, seed, crc, expected);
+		}
+		
+		/* Appending zeros is what ogg_crc_shift() calculates */
+		len = random_length();
+		crc = ogg_crc_shift(expected, len);
+		expected = ogg_crc_update_bytewise(expected, zeros, len);
+		if (crc != expected && failures++ < 10)
+			fprintf(stderr, "shift: length %zu: got %08x, expected %08x\n", len, crc, expected);
+	}
+	
+	free(buffer);
+	free(zeros);
+	
+	if (failures) {
+		fprintf(stderr, "%u mismatches\n", failures);
+		return 1;
+	}
+	printf("All CRC kernels agree over %d rounds\n", CRCTEST_ROUNDS);
+	return 0;
+}
@@ -13,6 +13,7 @@
   #define _USE_MATH_DEFINES
 #endif
 #include <math.h>
+#include <pthread.h>
 #ifndef M_PI
   #define M_PI 3.14159265358979323846
 #endif
@@ -96,6 +97,23 @@ static double relative_gate_factor;
 static double minus_twenty_decibels;
 static double histogram_energies[1000];
 static double histogram_energy_boundaries[1001];
+static pthread_once_t constants_once = PTHREAD_ONCE_INIT;
+
+/* Calculate the constants once, so that states can be created from several
+ * threads at once. */
+static void ebur128_init_constants(void) {
+  int i;
+
+  relative_gate_factor = pow(10.0, relative_gate / 10.0);
+  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
+  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
+  for (i = 0; i < 1000; ++i) {
+    histogram_energies[i] = pow(10.0, ((double) i / 10.0 - 69.95 + 0.691) / 10.0);
+  }
+  for (i = 1; i < 1001; ++i) {
+    histogram_energy_boundaries[i] = pow(10.0, ((double) i / 10.0 - 70.0 + 0.691) / 10.0);
+  }
+}
 
 static void ebur128_init_filter(ebur128_state* st) {
   int i, j;
@@ -231,7 +249,10 @@ static void ebur128_destroy_resampler(ebur128_state* st) {
 ebur128_state* ebur128_init(unsigned int channels,
                             unsigned long samplerate,
                             int mode) {
-  int errcode, result;
+  int errcode;
+#ifdef USE_SPEEX_RESAMPLER
+  int result;
+#endif
   ebur128_state* st;
   unsigned int i;
 
@@ -304,22 +325,14 @@ ebur128_state* ebur128_init(unsigned int channels,
   st->d->audio_data_index = 0;
 
   /* initialize static constants */
-  relative_gate_factor = pow(10.0, relative_gate / 10.0);
-  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
-  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
-  if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      histogram_energies[i] = pow(10.0, ((double) i / 10.0 - 69.95 + 0.691) / 10.0);
-    }
-    for (i = 1; i < 1001; ++i) {
-      histogram_energy_boundaries[i] = pow(10.0, ((double) i / 10.0 - 70.0 + 0.691) / 10.0);
-    }
-  }
+  pthread_once(&constants_once, ebur128_init_constants);
 
   return st;
 
+#ifdef USE_SPEEX_RESAMPLER
 free_short_term_block_energy_histogram:
   free(st->d->short_term_block_energy_histogram);
+#endif
 free_block_energy_histogram:
   free(st->d->block_energy_histogram);
 free_audio_data:
@@ -780,6 +793,44 @@ int ebur128_loudness_global_multiple(ebur128_state** sts, size_t size,
   return ebur128_gated_loudness(sts, size, out);
 }
 
+int ebur128_merge_histogram(ebur128_state* dst, const ebur128_state* src) {
+  size_t i;
+
+  if (!dst->d->use_histogram || !src->d->use_histogram) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  for (i = 0; i < 1000; ++i) {
+    dst->d->block_energy_histogram[i] += src->d->block_energy_histogram[i];
+    dst->d->short_term_block_energy_histogram[i] +=
+        src->d->short_term_block_energy_histogram[i];
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_get_histogram(const ebur128_state* st, unsigned long* histogram) {
+  size_t i;
+
+  if (!st->d->use_histogram) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  for (i = 0; i < 1000; ++i) {
+    histogram[i] = st->d->block_energy_histogram[i];
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_add_histogram(ebur128_state* st, const unsigned long* histogram) {
+  size_t i;
+
+  if (!st->d->use_histogram) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  for (i = 0; i < 1000; ++i) {
+    st->d->block_energy_histogram[i] += histogram[i];
+  }
+  return EBUR128_SUCCESS;
+}
+
 static int ebur128_energy_in_interval(ebur128_state* st,
                                       size_t interval_frames,
                                       double* out) {
@@ -177,6 +177,43 @@ int ebur128_loudness_global(ebur128_state* st, double* out);
 int ebur128_loudness_global_multiple(ebur128_state** sts,
                                      size_t size,
                                      double* out);
+/** \brief Add the gating block histograms of one state to another.
+ *
+ *  The blocks are independent of each other, so a stream can be split into
+ *  parts that are analysed separately and merged afterwards. Blocks that
+ *  would have spanned the split points are lost.
+ *
+ *  @param dst library state to add the blocks to.
+ *  @param src library state to take the blocks from.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if either state does not use
+ *      "EBUR128_MODE_HISTOGRAM".
+ */
+int ebur128_merge_histogram(ebur128_state* dst, const ebur128_state* src);
+/** \brief Copy the gating block histogram of a state.
+ *
+ *  Together with ebur128_add_histogram() this lets the blocks of a stream be
+ *  stored and the integrated loudness recalculated later without the audio.
+ *
+ *  @param st library state.
+ *  @param histogram array of 1000 counts to copy the histogram into.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if "EBUR128_MODE_HISTOGRAM" has not been
+ *      set.
+ */
+int ebur128_get_histogram(const ebur128_state* st, unsigned long* histogram);
+/** \brief Add stored gating block counts to the histogram of a state.
+ *
+ *  @param st library state.
+ *  @param histogram array of 1000 counts, from ebur128_get_histogram().
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if "EBUR128_MODE_HISTOGRAM" has not been
+ *      set.
+ */
+int ebur128_add_histogram(ebur128_state* st, const unsigned long* histogram);
 
 /** \brief Get momentary loudness (last 400ms) in LUFS.
  *
@@ -0,0 +1,338 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "gaincache.h"
+#include "oggcrc.h"
+#include "bits.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * A cache file is a header, a table of fixed size slots, and the results of
+ * each entry. All numbers are little endian.
+ *
+ * Header:
+ *   0  magic
+ *   8  number of slots, a power of two
+ *  16  number of entries
+ *  24  reserved, 0
+ *
+ * Slot:
+ *   0  device
+ *   8  inode
+ *  16  size
+ *  24  modification time, in nanoseconds
+ *  32  offset of the results from the start of the file, or 0 if unused
+ *  40  length of the results
+ *  44  Ogg CRC32 of the results
+ *
+ * Slots are found by hashing the device and inode, and probing linearly from
+ * there to the first unused slot. The table is never more than half full.
+ */
+static const uint8_t GAIN_CACHE_MAGIC[] = {
+	'O', 'p', 'u', 's', 'G', 'C', 0, 1
+};
+
+#define GAIN_CACHE_HEADER_SIZE 32
+#define GAIN_CACHE_SLOT_SIZE 48
+
+/* The smallest table written, so that a few new files don't need a rehash */
+#define GAIN_CACHE_MIN_SLOTS 64
+
+struct gain_cache_entry {
+	gain_cache_key key;
+	uint8_t *data;
+	size_t len;
+};
+
+void gain_cache_key_init(gain_cache_key *key, const struct stat *st) {
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Only the device and inode are hashed, so that the slots of older versions
+ * of a file are on the probe sequence of the new one */
+static uint64_t gain_cache_hash(const gain_cache_key *key) {
+	uint64_t hash = (key->ino ^ (key->dev << 32 | key->dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+	
+	return hash ^ (hash >> 29);
+}
+
+static void gain_cache_read_key(gain_cache_key *key, const uint8_t *slot) {
+	key->dev = read_le64(&slot[0]);
+	key->ino = read_le64(&slot[8]);
+	key->size = read_le64(&slot[16]);
+	key->mtime_ns = read_le64(&slot[24]);
+}
+
+int gain_cache_open(gain_cache *cache, const char *filename) {
+	struct stat st;
+	uint64_t slots;
+	void *map;
+	int fd;
+	
+	memset(cache, 0, sizeof (gain_cache));
+	cache->filename = strdup(filename);
+	
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return OGG_SUCCESS;
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	if (fstat(fd, &st) < 0) {
+		ogg_error = strerror(errno);
+		close(fd);
+		return OGG_INVALID;
+	}
+	if (st.st_size < GAIN_CACHE_HEADER_SIZE) {
+		ogg_error = "Not a cache file";
+		close(fd);
+		return OGG_INVALID;
+	}
+	
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	
+	/* Don't trust the slot count further than the file size */
+	slots = read_le64((const uint8_t *) map + 8);
+	if (memcmp(map, GAIN_CACHE_MAGIC, sizeof (GAIN_CACHE_MAGIC)) ||
+	    slots == 0 || (slots & (slots - 1)) ||
+	    slots > (st.st_size - GAIN_CACHE_HEADER_SIZE) / GAIN_CACHE_SLOT_SIZE) {
+		ogg_error = "Not a cache file";
+		munmap(map, st.st_size);
+		return OGG_INVALID;
+	}
+	
+	cache->map = map;
+	cache->map_size = st.st_size;
+	cache->slots = slots;
+	return OGG_SUCCESS;
+}
+
+/* Get the results of a used slot, if they are inside the file and intact */
+static bool gain_cache_slot_data(const gain_cache *cache, const uint8_t *slot, const uint8_t **data, size_t *len) {
+	uint64_t offset = read_le64(&slot[32]);
+	uint32_t length = read_le32(&slot[40]);
+	
+	if (offset < GAIN_CACHE_HEADER_SIZE + cache->slots * GAIN_CACHE_SLOT_SIZE ||
+	    offset > cache->map_size || length > cache->map_size - offset ||
+	    ogg_crc_update(0, cache->map + offset, length) != read_le32(&slot[44]))
+		return false;
+	*data = cache->map + offset;
+	*len = length;
+	return true;
+}
+
+bool gain_cache_lookup(const gain_cache *cache, const gain_cache_key *key, const uint8_t **data, size_t *len) {
+	uint64_t mask = cache->slots - 1, i, n;
+	
+	if (!cache->map)
+		return false;
+	
+	for (i = gain_cache_hash(key) & mask, n = 0; n < cache->slots; i = (i + 1) & mask, n++) {
+		const uint8_t *slot = cache->map + GAIN_CACHE_HEADER_SIZE + i * GAIN_CACHE_SLOT_SIZE;
+		gain_cache_key found;
+		
+		if (read_le64(&slot[32]) == 0)
+			break;
+		gain_cache_read_key(&found, slot);
+		if (!memcmp(&found, key, sizeof (gain_cache_key)))
+			return gain_cache_slot_data(cache, slot, data, len);
+	}
+	
+	return false;
+}
+
+void gain_cache_add(gain_cache *cache, const gain_cache_key *key, const uint8_t *data, size_t len) {
+	gain_cache_entry *entry;
+	
+	if (cache->count == cache->allocated) {
+		cache->allocated = cache->allocated ? cache->allocated * 2 : 64;
+		cache->added = realloc(cache->added, cache->allocated * sizeof (gain_cache_entry));
+	}
+	entry = &cache->added[cache->count++];
+	entry->key = *key;
+	entry->data = malloc(len);
+	memcpy(entry->data, data, len);
+	entry->len = len;
+}
+
+/* Put an entry in the new table, unless a newer version of the same file is
+ * already there or the table is full. Returns the slot to fill in, or %NULL. */
+static uint8_t *gain_cache_insert(uint8_t *table, uint64_t slots, const gain_cache_key *key) {
+	uint64_t mask = slots - 1, i, n;
+	
+	for (i = gain_cache_hash(key) & mask, n = 0; ; i = (i + 1) & mask, n++) {
+		uint8_t *slot = &table[i * GAIN_CACHE_SLOT_SIZE];
+		
+		if (n == slots)
+			return NULL;
+		if (read_le64(&slot[32]) == 0)
+			break;
+		if (read_le64(&slot[0]) == key->dev && read_le64(&slot[8]) == key->ino)
+			return NULL;
+	}
+	
+	write_le64(&table[i * GAIN_CACHE_SLOT_SIZE + 0], key->dev);
+	write_le64(&table[i * GAIN_CACHE_SLOT_SIZE + 8], key->ino);
+	write_le64(&table[i * GAIN_CACHE_SLOT_SIZE + 16], key->size);
+	write_le64(&table[i * GAIN_CACHE_SLOT_SIZE + 24], key->mtime_ns);
+	return &table[i * GAIN_CACHE_SLOT_SIZE];
+}
+
+/* Add an entry to the new file, appending its results */
+static void gain_cache_write_entry(uint8_t *table, uint64_t slots, const gain_cache_key *key, const uint8_t *data, size_t len, FILE *file, uint64_t *offset, uint64_t *count) {
+	uint8_t *slot = gain_cache_insert(table, slots, key);
+	
+	if (!slot)
+		return;
+	write_le64(&slot[32], *offset);
+	write_le32(&slot[40], len);
+	write_le32(&slot[44], ogg_crc_update(0, data, len));
+	fwrite(data, 1, len, file);
+	*offset += len;
+	(*count)++;
+}
+
+int gain_cache_commit(gain_cache *cache) {
+	uint8_t header[GAIN_CACHE_HEADER_SIZE] = { 0 };
+	uint64_t slots = GAIN_CACHE_MIN_SLOTS, old = 0, count = 0, offset, i;
+	uint8_t *table = NULL;
+	struct stat st;
+	mode_t mask;
+	char *tmpname;
+	FILE *file;
+	int fd;
+	
+	if (cache->count == 0)
+		return OGG_SUCCESS;
+	
+	/* The entry count in the header isn't checksummed, so count the used
+	 * slots instead; no more than these are copied */
+	for (i = 0; cache->map && i < cache->slots; i++) {
+		if (read_le64(cache->map + GAIN_CACHE_HEADER_SIZE + i * GAIN_CACHE_SLOT_SIZE + 32))
+			old++;
+	}
+	while (slots < 2 * (old + cache->count))
+		slots *= 2;
+	
+	/* The new file has to be in the same directory for the rename */
+	tmpname = malloc(strlen(cache->filename) + sizeof (".XXXXXX"));
+	strcpy(tmpname, cache->filename);
+	strcat(tmpname, ".XXXXXX");
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		ogg_error = strerror(errno);
+		free(tmpname);
+		return OGG_INVALID;
+	}
+	
+	/* mkstemp() makes the file private, so give it the mode of the cache
+	 * it replaces, or what a new file would have had */
+	if (stat(cache->filename, &st) < 0) {
+		mask = umask(0);
+		umask(mask);
+		st.st_mode = 0666 & ~mask;
+	}
+	if (fchmod(fd, st.st_mode & 07777) < 0) {
+		ogg_error = strerror(errno);
+		close(fd);
+		goto error;
+	}
+	
+	file = fdopen(fd, "wb");
+	if (!file) {
+		ogg_error = strerror(errno);
+		close(fd);
+		goto error;
+	}
+	
+	/* The results go after the table, which is written once it is full */
+	table = calloc(slots, GAIN_CACHE_SLOT_SIZE);
+	offset = GAIN_CACHE_HEADER_SIZE + slots * GAIN_CACHE_SLOT_SIZE;
+	fseeko(file, offset, SEEK_SET);
+	
+	/* Newest first, so that they replace older versions of the same file */
+	for (i = cache->count; i > 0; i--) {
+		const gain_cache_entry *entry = &cache->added[i - 1];
+		
+		gain_cache_write_entry(table, slots, &entry->key, entry->data, entry->len,
+			file, &offset, &count);
+	}
+	for (i = 0; cache->map && i < cache->slots; i++) {
+		const uint8_t *slot = cache->map + GAIN_CACHE_HEADER_SIZE + i * GAIN_CACHE_SLOT_SIZE;
+		const uint8_t *data;
+		gain_cache_key key;
+		size_t len;
+		
+		if (read_le64(&slot[32]) == 0 || !gain_cache_slot_data(cache, slot, &data, &len))
+			continue;
+		gain_cache_read_key(&key, slot);
+		gain_cache_write_entry(table, slots, &key, data, len, file, &offset, &count);
+	}
+	
+	memcpy(header, GAIN_CACHE_MAGIC, sizeof (GAIN_CACHE_MAGIC));
+	write_le64(&header[8], slots);
+	write_le64(&header[16], count);
+	fseeko(file, 0, SEEK_SET);
+	fwrite(header, 1, sizeof (header), file);
+	fwrite(table, GAIN_CACHE_SLOT_SIZE, slots, file);
+	
+	/* The new file has to be on disk before it replaces the old one */
+	if (fflush(file) | fsync(fileno(file)) | ferror(file) | fclose(file)) {
+		ogg_error = "Error writing cache file";
+		goto error;
+	}
+	if (rename(tmpname, cache->filename) < 0) {
+		ogg_error = strerror(errno);
+		goto error;
+	}
+	
+	free(table);
+	free(tmpname);
+	return OGG_SUCCESS;
+
+error:
+	unlink(tmpname);
+	free(table);
+	free(tmpname);
+	return OGG_INVALID;
+}
+
+void gain_cache_clear(gain_cache *cache) {
+	size_t i;
+	
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+	for (i = 0; i < cache->count; i++)
+		free(cache->added[i].data);
+	free(cache->added);
+	free(cache->filename);
+	memset(cache, 0, sizeof (gain_cache));
+}
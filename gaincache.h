@@ -0,0 +1,153 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:gaincache
+ * @short_description: Cache of analysis results
+ * @title: Gain cache
+ *
+ * A single file holding the analysis results of many media files, so that
+ * files that haven't changed since the last run don't have to be decoded
+ * again. A media file is identified by its device, inode, size and
+ * modification time; the results themselves are opaque bytes.
+ *
+ * The cache file is an open addressing hash table that is memory mapped and
+ * searched in place, so opening it doesn't read any more of it than the
+ * lookups touch. Results added during a run are kept in memory, and written
+ * out together with the old entries as a new file that replaces the old one
+ * in a single rename. Concurrent readers always see a complete cache; of two
+ * runs committing at once, the last one wins.
+ */
+
+#ifndef GAINCACHE_H
+#define GAINCACHE_H
+
+#include "ogg.h"
+
+#include <sys/stat.h>
+
+/**
+ * gain_cache_key:
+ * @dev: The device the file is on
+ * @ino: The inode of the file
+ * @size: The size of the file in bytes
+ * @mtime_ns: The modification time of the file, in nanoseconds
+ *
+ * The identity of a media file. Any change to the file gives it a new key.
+ */
+typedef struct gain_cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+} gain_cache_key;
+
+typedef struct gain_cache_entry gain_cache_entry;
+
+/**
+ * gain_cache:
+ * @filename: The path of the cache file
+ * @map: The mapped cache file, or %NULL if there was none
+ * @map_size: The number of bytes in @map
+ * @slots: The number of slots in the hash table of @map
+ * @added: Entries added since the cache was opened, not yet committed
+ * @count: The number of entries in @added
+ * @allocated: The number of entries allocated for @added
+ *
+ * An open cache file
+ */
+typedef struct gain_cache {
+	char *filename;
+	uint8_t *map;
+	size_t map_size;
+	uint64_t slots;
+	gain_cache_entry *added;
+	size_t count;
+	size_t allocated;
+} gain_cache;
+
+/**
+ * gain_cache_key_init:
+ * @key: The key to fill in
+ * @st: The status of the media file, from stat()
+ *
+ * Set up the key of a media file
+ */
+void gain_cache_key_init(gain_cache_key *key, const struct stat *st);
+
+/**
+ * gain_cache_open:
+ * @cache: An uninitialized #gain_cache structure
+ * @filename: The path of the cache file
+ *
+ * Map a cache file for lookups. A missing file is an empty cache. If the file
+ * can't be read or isn't a cache file, the cache is still usable but empty,
+ * and committing it replaces the file.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message saying why the existing file wasn't used
+ */
+int gain_cache_open(gain_cache *cache, const char *filename);
+
+/**
+ * gain_cache_lookup:
+ * @cache: An open cache
+ * @key: The key of the media file
+ * @data: Set to the stored results, which point into the mapped file and are
+ *   valid until the cache is cleared
+ * @len: Set to the number of bytes in @data
+ *
+ * Look up the results stored for a media file by an earlier run. Entries added
+ * since the cache was opened, and results that fail their checksum, are not
+ * found.
+ *
+ * Returns: %true if results for exactly this key were found
+ */
+bool gain_cache_lookup(const gain_cache *cache, const gain_cache_key *key, const uint8_t **data, size_t *len);
+
+/**
+ * gain_cache_add:
+ * @cache: An open cache
+ * @key: The key of the media file
+ * @data: The results to store, which are copied
+ * @len: The number of bytes in @data
+ *
+ * Add the results of a media file, to be written by gain_cache_commit().
+ * These replace any entry for an older version of the same file.
+ */
+void gain_cache_add(gain_cache *cache, const gain_cache_key *key, const uint8_t *data, size_t len);
+
+/**
+ * gain_cache_commit:
+ * @cache: An open cache
+ *
+ * Write the added entries and the entries of the old file that they don't
+ * replace to a new cache file, and move it into place. Nothing is written if
+ * no entries were added. The cache keeps using the old mapping for lookups.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int gain_cache_commit(gain_cache *cache);
+
+/**
+ * gain_cache_clear:
+ * @cache: A previously-opened #gain_cache structure
+ *
+ * Unmap the cache file and free the added entries, without writing them
+ */
+void gain_cache_clear(gain_cache *cache);
+
+#endif
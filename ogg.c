@@ -14,146 +14,232 @@
  */
 
 #include "ogg.h"
+#include "oggcrc.h"
 #include "bits.h"
 
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-/* Size of an Ogg page header, minus the segment table */
-#define OGG_PAGE_HEADER_SIZE 27
+/* How far to step backwards at a time when looking for the last page */
+#define OGG_TAIL_CHUNK_SIZE 65536
 
-/* Maximum number of segments that can be in an Ogg page */
-#define OGG_PAGE_MAX_SEGMENTS 255
+/* How much to read at a time when looking for the next capture pattern */
+#define OGG_SYNC_CHUNK_SIZE 4096
 
-#define OGG_GRANULE_POS_NO_PACKET 0xffffffffffffffff
+/* Size of the streaming backend ring buffer; must be a power of two */
+#define OGG_PIPE_BUFFER_SIZE (1 << 18)
+
+/* How much already-read data the streaming backend keeps, so that it can seek
+ * back to the start of a corrupt page */
+#define OGG_PIPE_HISTORY_SIZE OGG_PAGE_MAX_SIZE
 
 /* The 'OggS' sync indicator for Ogg pages */
 static const uint8_t OGG_PAGE_MAGIC[] = {
 	0x4f, 0x67, 0x67, 0x53
 };
 
-/* Lookup table for the Ogg page CRC32 verification */
-static const uint32_t crc_lookup[256]={
-	0x00000000,0x04c11db7,0x09823b6e,0x0d4326d9,
-	0x130476dc,0x17c56b6b,0x1a864db2,0x1e475005,
-	0x2608edb8,0x22c9f00f,0x2f8ad6d6,0x2b4bcb61,
-	0x350c9b64,0x31cd86d3,0x3c8ea00a,0x384fbdbd,
-	0x4c11db70,0x48d0c6c7,0x4593e01e,0x4152fda9,
-	0x5f15adac,0x5bd4b01b,0x569796c2,0x52568b75,
-	0x6a1936c8,0x6ed82b7f,0x639b0da6,0x675a1011,
-	0x791d4014,0x7ddc5da3,0x709f7b7a,0x745e66cd,
-	0x9823b6e0,0x9ce2ab57,0x91a18d8e,0x95609039,
-	0x8b27c03c,0x8fe6dd8b,0x82a5fb52,0x8664e6e5,
-	0xbe2b5b58,0xbaea46ef,0xb7a96036,0xb3687d81,
-	0xad2f2d84,0xa9ee3033,0xa4ad16ea,0xa06c0b5d,
-	0xd4326d90,0xd0f37027,0xddb056fe,0xd9714b49,
-	0xc7361b4c,0xc3f706fb,0xceb42022,0xca753d95,
-	0xf23a8028,0xf6fb9d9f,0xfbb8bb46,0xff79a6f1,
-	0xe13ef6f4,0xe5ffeb43,0xe8bccd9a,0xec7dd02d,
-	0x34867077,0x30476dc0,0x3d044b19,0x39c556ae,
-	0x278206ab,0x23431b1c,0x2e003dc5,0x2ac12072,
-	0x128e9dcf,0x164f8078,0x1b0ca6a1,0x1fcdbb16,
-	0x018aeb13,0x054bf6a4,0x0808d07d,0x0cc9cdca,
-	0x7897ab07,0x7c56b6b0,0x71159069,0x75d48dde,
-	0x6b93dddb,0x6f52c06c,0x6211e6b5,0x66d0fb02,
-	0x5e9f46bf,0x5a5e5b08,0x571d7dd1,0x53dc6066,
-	0x4d9b3063,0x495a2dd4,0x44190b0d,0x40d816ba,
-	0xaca5c697,0xa864db20,0xa527fdf9,0xa1e6e04e,
-	0xbfa1b04b,0xbb60adfc,0xb6238b25,0xb2e29692,
-	0x8aad2b2f,0x8e6c3698,0x832f1041,0x87ee0df6,
-	0x99a95df3,0x9d684044,0x902b669d,0x94ea7b2a,
-	0xe0b41de7,0xe4750050,0xe9362689,0xedf73b3e,
-	0xf3b06b3b,0xf771768c,0xfa325055,0xfef34de2,
-	0xc6bcf05f,0xc27dede8,0xcf3ecb31,0xcbffd686,
-	0xd5b88683,0xd1799b34,0xdc3abded,0xd8fba05a,
-	0x690ce0ee,0x6dcdfd59,0x608edb80,0x644fc637,
-	0x7a089632,0x7ec98b85,0x738aad5c,0x774bb0eb,
-	0x4f040d56,0x4bc510e1,0x46863638,0x42472b8f,
-	0x5c007b8a,0x58c1663d,0x558240e4,0x51435d53,
-	0x251d3b9e,0x21dc2629,0x2c9f00f0,0x285e1d47,
-	0x36194d42,0x32d850f5,0x3f9b762c,0x3b5a6b9b,
-	0x0315d626,0x07d4cb91,0x0a97ed48,0x0e56f0ff,
-	0x1011a0fa,0x14d0bd4d,0x19939b94,0x1d528623,
-	0xf12f560e,0xf5ee4bb9,0xf8ad6d60,0xfc6c70d7,
-	0xe22b20d2,0xe6ea3d65,0xeba91bbc,0xef68060b,
-	0xd727bbb6,0xd3e6a601,0xdea580d8,0xda649d6f,
-	0xc423cd6a,0xc0e2d0dd,0xcda1f604,0xc960ebb3,
-	0xbd3e8d7e,0xb9ff90c9,0xb4bcb610,0xb07daba7,
-	0xae3afba2,0xaafbe615,0xa7b8c0cc,0xa379dd7b,
-	0x9b3660c6,0x9ff77d71,0x92b45ba8,0x9675461f,
-	0x8832161a,0x8cf30bad,0x81b02d74,0x857130c3,
-	0x5d8a9099,0x594b8d2e,0x5408abf7,0x50c9b640,
-	0x4e8ee645,0x4a4ffbf2,0x470cdd2b,0x43cdc09c,
-	0x7b827d21,0x7f436096,0x7200464f,0x76c15bf8,
-	0x68860bfd,0x6c47164a,0x61043093,0x65c52d24,
-	0x119b4be9,0x155a565e,0x18197087,0x1cd86d30,
-	0x029f3d35,0x065e2082,0x0b1d065b,0x0fdc1bec,
-	0x3793a651,0x3352bbe6,0x3e119d3f,0x3ad08088,
-	0x2497d08d,0x2056cd3a,0x2d15ebe3,0x29d4f654,
-	0xc5a92679,0xc1683bce,0xcc2b1d17,0xc8ea00a0,
-	0xd6ad50a5,0xd26c4d12,0xdf2f6bcb,0xdbee767c,
-	0xe3a1cbc1,0xe760d676,0xea23f0af,0xeee2ed18,
-	0xf0a5bd1d,0xf464a0aa,0xf9278673,0xfde69bc4,
-	0x89b8fd09,0x8d79e0be,0x803ac667,0x84fbdbd0,
-	0x9abc8bd5,0x9e7d9662,0x933eb0bb,0x97ffad0c,
-	0xafb010b1,0xab710d06,0xa6322bdf,0xa2f33668,
-	0xbcb4666d,0xb8757bda,0xb5365d03,0xb1f740b4
-};
-
-const char *ogg_error;
+__thread const char *ogg_error;
 
 static uint32_t ogg_page_checksum(
 	const uint8_t *page_header,
 	uint8_t segments,
 	const ogg_page *page
 ) {
-	uint32_t crc_reg = 0;
-	size_t i;
+	uint32_t crc_reg;
 	
-	for (i = 0; i < OGG_PAGE_HEADER_SIZE + segments; i++)
-		crc_reg = (crc_reg<<8)^crc_lookup[((crc_reg>>24)&0xff)^page_header[i]];
-	for (i = 0; i < page->data_len; i++)
-		crc_reg = (crc_reg<<8)^crc_lookup[((crc_reg>>24)&0xff)^page->data[i]];
+	crc_reg = ogg_crc_update(0, page_header, OGG_PAGE_HEADER_SIZE + segments);
+	crc_reg = ogg_crc_update(crc_reg, page->data, page->data_len);
 	
 	return crc_reg;
 }
 
+/* A freed buffer in an ogg_page_pool holds the link to the next one */
+typedef struct ogg_page_pool_buffer {
+	struct ogg_page_pool_buffer *next;
+} ogg_page_pool_buffer;
+
+struct ogg_page_pool {
+	pthread_mutex_t lock;
+	ogg_page_pool_buffer *free;
+	size_t free_count;
+	size_t max_free;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+ogg_page_pool *ogg_page_pool_new(size_t max_free) {
+	ogg_page_pool *pool = calloc(1, sizeof (ogg_page_pool));
+	
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->max_free = max_free;
+	
+	return pool;
+}
+
+void ogg_page_pool_free(ogg_page_pool *pool) {
+	ogg_page_pool_buffer *current = pool->free;
+	
+	while (current) {
+		ogg_page_pool_buffer *next = current->next;
+		free(current);
+		current = next;
+	}
+	
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+uint8_t *ogg_page_pool_acquire(ogg_page_pool *pool) {
+	ogg_page_pool_buffer *buffer;
+	
+	pthread_mutex_lock(&pool->lock);
+	buffer = pool->free;
+	if (buffer) {
+		pool->free = buffer->next;
+		pool->free_count--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	
+	if (!buffer)
+		buffer = malloc(OGG_PAGE_MAX_SIZE);
+	
+	return (uint8_t *) buffer;
+}
+
+void ogg_page_pool_release(ogg_page_pool *pool, uint8_t *data) {
+	ogg_page_pool_buffer *buffer = (ogg_page_pool_buffer *) data;
+	
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_count < pool->max_free) {
+		buffer->next = pool->free;
+		pool->free = buffer;
+		pool->free_count++;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	
+	free(buffer);
+}
+
+void ogg_page_pool_get_stats(ogg_page_pool *pool, ogg_page_pool_stats *stats) {
+	pthread_mutex_lock(&pool->lock);
+	stats->hits = pool->hits;
+	stats->misses = pool->misses;
+	stats->free_buffers = pool->free_count;
+	pthread_mutex_unlock(&pool->lock);
+}
+
 void ogg_page_init(ogg_page *page) {
 	memset(page, 0, sizeof (ogg_page));
 	page->offset = -1;
 }
 
-void ogg_page_clear(ogg_page *page) {
-	if (page->data)
+/* Give back the page data to wherever it came from */
+static void ogg_page_data_release(ogg_page *page) {
+	if (!page->data)
+		return;
+	
+	switch (page->storage) {
+	case OGG_PAGE_STORAGE_OWNED:
 		free(page->data);
+		break;
+	case OGG_PAGE_STORAGE_POOLED:
+		ogg_page_pool_release(page->pool, page->data);
+		break;
+	}
+	page->data = NULL;
+}
+
+void ogg_page_clear(ogg_page *page) {
+	ogg_page_data_release(page);
 	ogg_page_init(page);
 }
 
-int ogg_page_read(ogg_page *page, ogg_stream *stream) {
+/* Read the page header and segment table at the current stream position
+ * into page_header, which must have room for the maximum size header */
+static int ogg_page_header_read(uint8_t *page_header, ogg_stream *stream) {
 	size_t read;
-	int i, err;
-	uint32_t crc32;
-	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
 	uint8_t segments;
 	
-	/* Save the current file offset (for in-place rewrites) */
-	page->offset = stream->io->tell(stream);
-	
 	/* Read the first (fixed) part of the page header */
 	read = stream->io->read(stream, page_header, OGG_PAGE_HEADER_SIZE);
+	if (read == 0) {
+		ogg_error = "End of stream";
+		return OGG_END_OF_STREAM;
+	}
 	if (read < OGG_PAGE_HEADER_SIZE) {
 		ogg_error = "Error reading page header";
-		err = OGG_INVALID;
-		goto error;
+		return OGG_INVALID;
 	}
 	
 	/* Check synchronization */
 	if (memcmp(page_header, OGG_PAGE_MAGIC, 4)) {
 		ogg_error = "Page signature does not match";
-		err = OGG_INVALID;
-		goto error;
+		return OGG_INVALID;
+	}
+	
+	/* Read in the segment table */
+	segments = page_header[26];
+	read = stream->io->read(stream, &page_header[OGG_PAGE_HEADER_SIZE], segments);
+	if (read < segments) {
+		ogg_error = "Error reading segment table";
+		return OGG_INVALID;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+/* Parse data length from the segment table */
+static uint16_t ogg_page_header_data_len(const uint8_t *page_header) {
+	uint16_t data_len = 0;
+	int i;
+	
+	for (i = 0; i < page_header[26]; i++)
+		data_len += page_header[OGG_PAGE_HEADER_SIZE + i];
+	
+	return data_len;
+}
+
+/* Allocate a buffer for the page data, from the stream's pool if it has one */
+static void ogg_page_data_alloc(ogg_page *page, ogg_stream *stream) {
+	if (stream->pool) {
+		page->data = ogg_page_pool_acquire(stream->pool);
+		page->storage = OGG_PAGE_STORAGE_POOLED;
+		page->pool = stream->pool;
+	} else {
+		page->data = malloc(page->data_len);
+		page->storage = OGG_PAGE_STORAGE_OWNED;
 	}
+}
+
+/* Read a page, optionally saving its segment table into lacing */
+static int ogg_page_read_once(
+	ogg_page *page,
+	ogg_stream *stream,
+	uint8_t *lacing,
+	uint8_t *lacing_len
+) {
+	size_t read;
+	int err;
+	uint32_t crc32;
+	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
+	uint8_t segments;
+	
+	/* Save the current file offset (for in-place rewrites) */
+	page->offset = stream->io->tell(stream);
+	
+	err = ogg_page_header_read(page_header, stream);
+	if (err != OGG_SUCCESS)
+		goto error;
 	
 	/* Parse fixed header data fields */
 	page->version = page_header[4];
@@ -163,69 +249,362 @@ int ogg_page_read(ogg_page *page, ogg_stream *stream) {
 	page->seq = read_le32(&page_header[18]);
 	crc32 = read_le32(&page_header[22]);
 	segments = page_header[26];
+	page->data_len = ogg_page_header_data_len(page_header);
 	
-	/* Read in the segment table */
-	read = stream->io->read(stream, &page_header[OGG_PAGE_HEADER_SIZE], segments);
-	if (read < segments) {
-		ogg_error = "Error reading segment table";
+	/* Read in the packet data, borrowing it from the stream if possible */
+	if (stream->io->map) {
+		page->data = (uint8_t *) stream->io->map(stream, page->data_len);
+		page->storage = OGG_PAGE_STORAGE_BORROWED;
+		if (!page->data) {
+			ogg_error = "Error reading page data";
+			err = OGG_INVALID;
+			goto error;
+		}
+	} else {
+		ogg_page_data_alloc(page, stream);
+		read = stream->io->read(stream, page->data, page->data_len);
+		if (read < page->data_len) {
+			ogg_error = "Error reading page data";
+			err = OGG_INVALID;
+			goto error;
+		}
+	}
+	
+	/* Verify the page checksum */
+	write_le32(&page_header[22], 0); /* CRC32 field must be blank */
+	if (crc32 != ogg_page_checksum(page_header, segments, page)) {
+		ogg_error = "Checksum mismatch";
 		err = OGG_INVALID;
 		goto error;
 	}
 	
-	/* Parse data length from the segment table */
-	page->data_len = 0;
-	for (i = 0; i < segments; i++) {
-		page->data_len += page_header[OGG_PAGE_HEADER_SIZE + i];
+	if (lacing) {
+		memcpy(lacing, &page_header[OGG_PAGE_HEADER_SIZE], segments);
+		*lacing_len = segments;
+	}
+	
+	return OGG_SUCCESS;
+
+error:
+	ogg_page_data_release(page);
+	
+	return err;
+}
+
+/* Read a page, skipping over corrupt data if the stream allows it */
+int ogg_page_read_lacing(ogg_page *page, ogg_stream *stream, uint8_t *lacing, uint8_t *lacing_len) {
+	int err, sync_err;
+	
+	for (;;) {
+		err = ogg_page_read_once(page, stream, lacing, lacing_len);
+		if (err != OGG_INVALID || !stream->resync)
+			return err;
+		
+		/* Look for the next page after the start of the corrupt one */
+		if (stream->io->seek(stream, page->offset + 1))
+			return err;
+		sync_err = ogg_stream_resync(stream);
+		if (sync_err != OGG_SUCCESS)
+			return sync_err;
+	}
+}
+
+int ogg_page_read(ogg_page *page, ogg_stream *stream) {
+	return ogg_page_read_lacing(page, stream, NULL, NULL);
+}
+
+int ogg_page_read_at(ogg_page *page, ogg_stream *stream, off_t offset) {
+	size_t read;
+	int err;
+	uint32_t crc32;
+	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
+	uint8_t segments;
+	
+	if (!stream->io->pread) {
+		ogg_error = "Stream does not support positional reads";
+		return OGG_INVALID;
+	}
+	
+	page->offset = offset;
+	
+	/* Read the fixed part of the header and the segment table */
+	read = stream->io->pread(stream, page_header, OGG_PAGE_HEADER_SIZE, offset);
+	if (read == 0) {
+		ogg_error = "End of stream";
+		return OGG_END_OF_STREAM;
+	}
+	if (read < OGG_PAGE_HEADER_SIZE) {
+		ogg_error = "Error reading page header";
+		return OGG_INVALID;
+	}
+	if (memcmp(page_header, OGG_PAGE_MAGIC, 4)) {
+		ogg_error = "Page signature does not match";
+		return OGG_INVALID;
+	}
+	segments = page_header[26];
+	read = stream->io->pread(stream, &page_header[OGG_PAGE_HEADER_SIZE],
+		segments, offset + OGG_PAGE_HEADER_SIZE);
+	if (read < segments) {
+		ogg_error = "Error reading segment table";
+		return OGG_INVALID;
 	}
 	
-	/* Read in the packet data */
-	page->data = malloc(page->data_len);
-	read = stream->io->read(stream, page->data, page->data_len);
+	page->version = page_header[4];
+	page->type = page_header[5];
+	page->granule_pos = read_le64(&page_header[6]);
+	page->serial = read_le32(&page_header[14]);
+	page->seq = read_le32(&page_header[18]);
+	crc32 = read_le32(&page_header[22]);
+	page->data_len = ogg_page_header_data_len(page_header);
+	
+	ogg_page_data_alloc(page, stream);
+	read = stream->io->pread(stream, page->data, page->data_len,
+		offset + OGG_PAGE_HEADER_SIZE + segments);
 	if (read < page->data_len) {
 		ogg_error = "Error reading page data";
 		err = OGG_INVALID;
 		goto error;
 	}
 	
-	/* Verify the page checksum */
 	write_le32(&page_header[22], 0); /* CRC32 field must be blank */
 	if (crc32 != ogg_page_checksum(page_header, segments, page)) {
 		ogg_error = "Checksum mismatch";
 		err = OGG_INVALID;
 		goto error;
 	}
-
+	
 	return OGG_SUCCESS;
 
 error:
-	if (page->data) {
-		free(page->data);
-		page->data = NULL;
-	}
-
+	ogg_page_data_release(page);
+	
 	return err;
 }
 
-int ogg_page_write(const ogg_page *page, ogg_stream *stream)
-{
+int ogg_page_read_info(ogg_page_info *info, ogg_stream *stream) {
 	int err;
 	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
+	
+	info->offset = stream->io->tell(stream);
+	
+	err = ogg_page_header_read(page_header, stream);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	info->version = page_header[4];
+	info->type = page_header[5];
+	info->granule_pos = read_le64(&page_header[6]);
+	info->serial = read_le32(&page_header[14]);
+	info->seq = read_le32(&page_header[18]);
+	info->crc = read_le32(&page_header[22]);
+	info->data_len = ogg_page_header_data_len(page_header);
+	info->size = OGG_PAGE_HEADER_SIZE + page_header[26] + info->data_len;
+	
+	/* Skip over the payload without reading it */
+	if (stream->io->seek(stream, info->offset + info->size)) {
+		ogg_error = "Error seeking past page data";
+		return OGG_INVALID;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+/* Parse the header of a page starting at buffer[0], returning false unless
+ * it is a complete page within len bytes */
+static bool ogg_page_info_parse(ogg_page_info *info, const uint8_t *buffer, size_t len) {
+	if (len < OGG_PAGE_HEADER_SIZE || memcmp(buffer, OGG_PAGE_MAGIC, 4))
+		return false;
+	if (len < OGG_PAGE_HEADER_SIZE + buffer[26])
+		return false;
+	
+	info->version = buffer[4];
+	info->type = buffer[5];
+	info->granule_pos = read_le64(&buffer[6]);
+	info->serial = read_le32(&buffer[14]);
+	info->seq = read_le32(&buffer[18]);
+	info->crc = read_le32(&buffer[22]);
+	info->data_len = ogg_page_header_data_len(buffer);
+	info->size = OGG_PAGE_HEADER_SIZE + buffer[26] + info->data_len;
+	
+	return len >= info->size;
+}
+
+/* Compute the checksum of a complete page held in a buffer */
+static uint32_t ogg_page_buffer_checksum(const uint8_t *buffer, size_t size) {
+	static const uint8_t blank_crc[4] = { 0, 0, 0, 0 };
+	uint32_t crc32;
+	
+	crc32 = ogg_crc_update(0, buffer, 22);
+	crc32 = ogg_crc_update(crc32, blank_crc, 4);
+	crc32 = ogg_crc_update(crc32, &buffer[26], size - 26);
+	
+	return crc32;
+}
+
+/* Check whether a complete, valid page starts at buffer[0] */
+static bool ogg_page_validate(ogg_page_info *info, const uint8_t *buffer, size_t len) {
+	if (!ogg_page_info_parse(info, buffer, len))
+		return false;
+	
+	return ogg_page_buffer_checksum(buffer, info->size) == info->crc;
+}
+
+int ogg_page_find_last(ogg_page_info *info, ogg_stream *stream, uint32_t serial) {
+	uint8_t *buffer;
+	off_t saved, size, start;
+	size_t len, i;
+	int err = OGG_INVALID;
+	
+	if (!stream->io->size) {
+		ogg_error = "Stream size is not known";
+		return OGG_INVALID;
+	}
+	
+	saved = stream->io->tell(stream);
+	size = stream->io->size(stream);
+	if (size < 0) {
+		ogg_error = "Error getting stream size";
+		return OGG_INVALID;
+	}
+	
+	/* Each window overlaps the previous one by a full page, so that any page
+	 * starting in the new part of the window can be checked completely */
+	buffer = malloc(OGG_TAIL_CHUNK_SIZE + OGG_PAGE_MAX_SIZE);
+	ogg_error = "No page found for stream";
+	
+	for (start = size; start > 0;) {
+		off_t end;
+		size_t scan;
+		
+		end = start + OGG_PAGE_MAX_SIZE < size ? start + OGG_PAGE_MAX_SIZE : size;
+		start = start > OGG_TAIL_CHUNK_SIZE ? start - OGG_TAIL_CHUNK_SIZE : 0;
+		scan = (end - start) - (end == size ? 0 : OGG_PAGE_MAX_SIZE);
+		
+		if (stream->io->seek(stream, start)) {
+			ogg_error = "Error seeking to end of stream";
+			break;
+		}
+		len = stream->io->read(stream, buffer, end - start);
+		if (len < (size_t) (end - start)) {
+			ogg_error = "Error reading end of stream";
+			break;
+		}
+		
+		/* Scan backwards for the capture pattern */
+		for (i = scan; i-- > 0;) {
+			if (buffer[i] != OGG_PAGE_MAGIC[0])
+				continue;
+			if (!ogg_page_validate(info, &buffer[i], len - i))
+				continue;
+			if (info->serial != serial ||
+			    info->granule_pos == OGG_GRANULE_POS_NO_PACKET)
+				continue;
+			
+			info->offset = start + i;
+			err = OGG_SUCCESS;
+			goto done;
+		}
+	}
+
+done:
+	free(buffer);
+	stream->io->seek(stream, saved);
+	
+	return err;
+}
+
+void ogg_page_batch_init(ogg_page_batch *batch, size_t capacity) {
+	batch->capacity = capacity;
+	batch->count = 0;
+	batch->offset = malloc(capacity * sizeof (off_t));
+	batch->granule_pos = malloc(capacity * sizeof (uint64_t));
+	batch->serial = malloc(capacity * sizeof (uint32_t));
+	batch->seq = malloc(capacity * sizeof (uint32_t));
+	batch->size = malloc(capacity * sizeof (uint32_t));
+	batch->data_len = malloc(capacity * sizeof (uint16_t));
+	batch->type = malloc(capacity * sizeof (uint8_t));
+	batch->crc_ok = malloc(capacity * sizeof (bool));
+}
+
+void ogg_page_batch_clear(ogg_page_batch *batch) {
+	free(batch->offset);
+	free(batch->granule_pos);
+	free(batch->serial);
+	free(batch->seq);
+	free(batch->size);
+	free(batch->data_len);
+	free(batch->type);
+	free(batch->crc_ok);
+	memset(batch, 0, sizeof (ogg_page_batch));
+}
+
+size_t ogg_page_batch_parse(
+	ogg_page_batch *batch,
+	const uint8_t *buffer,
+	size_t len,
+	off_t base_offset
+) {
+	size_t pos = 0;
+	
+	batch->count = 0;
+	
+	while (batch->count < batch->capacity && pos < len) {
+		ogg_page_info info;
+		size_t n = batch->count;
+		
+		if (!ogg_page_info_parse(&info, &buffer[pos], len - pos)) {
+			const uint8_t *next;
+			
+			/* A partial page at the end is left for the next call */
+			if (len - pos < OGG_PAGE_HEADER_SIZE ||
+			    !memcmp(&buffer[pos], OGG_PAGE_MAGIC, 4))
+				break;
+			
+			/* Otherwise skip ahead to the next capture pattern */
+			next = memchr(&buffer[pos + 1], OGG_PAGE_MAGIC[0], len - pos - 1);
+			while (next && (size_t) (&buffer[len] - next) >= 4 &&
+			       memcmp(next, OGG_PAGE_MAGIC, 4))
+				next = memchr(next + 1, OGG_PAGE_MAGIC[0], &buffer[len] - next - 1);
+			if (!next) {
+				pos = len - 3;
+				break;
+			}
+			pos = next - buffer;
+			continue;
+		}
+		
+		batch->offset[n] = base_offset + pos;
+		batch->granule_pos[n] = info.granule_pos;
+		batch->serial[n] = info.serial;
+		batch->seq[n] = info.seq;
+		batch->size[n] = info.size;
+		batch->data_len[n] = info.data_len;
+		batch->type[n] = info.type;
+		batch->crc_ok[n] = ogg_page_buffer_checksum(&buffer[pos], info.size) == info.crc;
+		batch->count++;
+		
+		pos += info.size;
+	}
+	
+	return pos;
+}
+
+/* Fill in the page header and segment table for a page, leaving the checksum
+ * field zero */
+static int ogg_page_header_fill(const ogg_page *page, uint8_t *page_header) {
 	uint8_t segments = 0;
 	uint16_t data_len;
-	uint32_t crc32;
 	
 	/* Do some basic sanity checks on the data size */
 	if (page->granule_pos == OGG_GRANULE_POS_NO_PACKET) {
 		if (page->data_len > 255*255) {
 			ogg_error = "Continuing Ogg page can hold max 255*255 bytes";
-			err = OGG_BAD_SIZE;
-			goto error;
+			return OGG_BAD_SIZE;
 		}
 	} else {
 		if (page->data_len > 255*255 - 1) {
 			ogg_error = "Non-continuing Ogg page can hold max 255*255 - 1 bytes";
-			err = OGG_BAD_SIZE;
-			goto error;
+			return OGG_BAD_SIZE;
 		}
 	}
 	
@@ -248,8 +627,7 @@ int ogg_page_write(const ogg_page *page, ogg_stream *stream)
 	if (page->granule_pos == OGG_GRANULE_POS_NO_PACKET) {
 		if (data_len > 0) {
 			ogg_error = "Continuing Ogg page must contain a multiple of 255 bytes";
-			err = OGG_BAD_SIZE;
-			goto error;
+			return OGG_BAD_SIZE;
 		}
 	} else {
 		page_header[OGG_PAGE_HEADER_SIZE + segments] = data_len;
@@ -257,60 +635,566 @@ int ogg_page_write(const ogg_page *page, ogg_stream *stream)
 	}
 	page_header[26] = segments;
 	
-	/* Compute the final checksum */
-	crc32 = ogg_page_checksum(page_header, segments, page);
-	write_le32(&page_header[22], crc32);
+	return OGG_SUCCESS;
+}
+
+/* Fill in the page header and segment table for a page, with its checksum */
+static int ogg_page_header_build(const ogg_page *page, uint8_t *page_header) {
+	uint32_t crc32;
+	int err;
 	
-	/* Write the page header and data */
-	stream->io->write(stream, page_header, OGG_PAGE_HEADER_SIZE + segments);
-	stream->io->write(stream, page->data, page->data_len);
+	err = ogg_page_header_fill(page, page_header);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	crc32 = ogg_page_checksum(page_header, page_header[26], page);
+	write_le32(&page_header[22], crc32);
 	
 	return OGG_SUCCESS;
-
-error:
-	return err;
 }
 
-void ogg_packet_init(ogg_packet *packet) {
-	packet->data_len = 0;
-	ogg_page_init(&packet->first.page);
-	packet->first.offset = 0;
-	packet->first.length = 0;
-	packet->first.next = NULL;
+int ogg_page_write(const ogg_page *page, ogg_stream *stream)
+{
+	int err;
+	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
+	size_t header_len;
+	
+	err = ogg_page_header_build(page, page_header);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	/* Write the page header and data */
+	header_len = OGG_PAGE_HEADER_SIZE + page_header[26];
+	if (stream->io->write(stream, page_header, header_len) < header_len ||
+	    stream->io->write(stream, page->data, page->data_len) < page->data_len) {
+		ogg_error = "Error writing page";
+		return OGG_INVALID;
+	}
+	
+	return OGG_SUCCESS;
 }
 
-void ogg_packet_clear(ogg_packet *packet) {
-	/* Need to clear the entire page chain if there are multiple pages */
-	if (packet->first.next) {
-		ogg_packet_page *current = packet->first.next;
-		do {
-			ogg_packet_page *next = current->next;
-			
-			ogg_page_clear(&current->page);
-			free(current);
-			
-			current = next;
-		} while (current);
+int ogg_page_write_at(const ogg_page *page, ogg_stream *stream, off_t offset)
+{
+	int err;
+	uint8_t *buffer;
+	size_t header_len;
+	
+	if (!stream->io->pwrite) {
+		ogg_error = "Stream does not support positional writes";
+		return OGG_INVALID;
 	}
 	
-	packet->data_len = 0;
-	ogg_page_clear(&packet->first.page);
-	packet->first.next = NULL;
+	/* One write, so a reader never sees the new header with the old data */
+	buffer = malloc(OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS + page->data_len);
+	err = ogg_page_header_build(page, buffer);
+	if (err != OGG_SUCCESS)
+		goto error;
+	
+	header_len = OGG_PAGE_HEADER_SIZE + buffer[26];
+	memcpy(&buffer[header_len], page->data, page->data_len);
+	if (stream->io->pwrite(stream, buffer, header_len + page->data_len, offset) <
+	    header_len + page->data_len) {
+		ogg_error = "Error writing page";
+		err = OGG_INVALID;
+	}
+
+error:
+	free(buffer);
+	return err;
 }
 
-int ogg_packet_read(ogg_packet *packet) {
+void ogg_page_writer_init(ogg_page_writer *writer, ogg_stream *stream, size_t size) {
+	if (size < OGG_PAGE_MAX_SIZE)
+		size = OGG_PAGE_WRITER_DEFAULT_SIZE;
+	
+	writer->stream = stream;
+	writer->buffer = malloc(size);
+	writer->size = size;
+	writer->used = 0;
 }
 
-static ogg_stream *ogg_stream_new(void) {
-	ogg_stream *stream = calloc(1, sizeof (ogg_stream));
-	return stream;
+void ogg_page_writer_clear(ogg_page_writer *writer) {
+	free(writer->buffer);
+	writer->stream = NULL;
+	writer->buffer = NULL;
+	writer->size = 0;
+	writer->used = 0;
 }
 
-static void ogg_stream_free(ogg_stream *stream) {
-	free(stream);
+int ogg_page_writer_flush(ogg_page_writer *writer) {
+	size_t written;
+	
+	if (writer->used == 0)
+		return OGG_SUCCESS;
+	
+	written = writer->stream->io->write(writer->stream, writer->buffer, writer->used);
+	if (written < writer->used) {
+		ogg_error = "Error writing pages";
+		return OGG_INVALID;
+	}
+	writer->used = 0;
+	
+	return OGG_SUCCESS;
 }
 
-static size_t ogg_stream_file_read(ogg_stream *stream, uint8_t *buffer, size_t len) {
+int ogg_page_writer_add(ogg_page_writer *writer, const ogg_page *page) {
+	uint8_t *page_header;
+	size_t header_len;
+	uint32_t crc32;
+	int err;
+	
+	if (writer->size - writer->used < OGG_PAGE_MAX_SIZE) {
+		err = ogg_page_writer_flush(writer);
+		if (err != OGG_SUCCESS)
+			return err;
+	}
+	
+	page_header = &writer->buffer[writer->used];
+	err = ogg_page_header_fill(page, page_header);
+	if (err != OGG_SUCCESS)
+		return err;
+	header_len = OGG_PAGE_HEADER_SIZE + page_header[26];
+	memcpy(&page_header[header_len], page->data, page->data_len);
+	
+	/* Checksum the page while it is still in cache from the copy */
+	crc32 = ogg_crc_update(0, page_header, header_len + page->data_len);
+	write_le32(&page_header[22], crc32);
+	
+	writer->used += header_len + page->data_len;
+	return OGG_SUCCESS;
+}
+
+int ogg_page_writer_add_raw(
+	ogg_page_writer *writer,
+	const uint8_t *page_header,
+	size_t header_len,
+	const uint8_t *data,
+	size_t data_len
+) {
+	int err;
+	
+	if (writer->size - writer->used < header_len + data_len) {
+		err = ogg_page_writer_flush(writer);
+		if (err != OGG_SUCCESS)
+			return err;
+	}
+	
+	memcpy(&writer->buffer[writer->used], page_header, header_len);
+	memcpy(&writer->buffer[writer->used + header_len], data, data_len);
+	writer->used += header_len + data_len;
+	
+	return OGG_SUCCESS;
+}
+
+void ogg_page_header_set_seq(uint8_t *page_header, size_t page_size, uint32_t seq) {
+	uint8_t delta[4];
+	uint32_t crc32;
+	
+	/* The checksum of the page changes by the checksum of the difference,
+	 * which is zero apart from the four bytes of the page counter */
+	write_le32(delta, read_le32(&page_header[18]) ^ seq);
+	crc32 = read_le32(&page_header[22]);
+	crc32 ^= ogg_crc_shift(ogg_crc_update(0, delta, 4), page_size - 22);
+	
+	write_le32(&page_header[18], seq);
+	write_le32(&page_header[22], crc32);
+}
+
+size_t ogg_packet_paginate(
+	const uint8_t *data,
+	size_t len,
+	uint64_t granule_pos,
+	uint32_t serial,
+	uint32_t seq,
+	ogg_page *pages,
+	size_t count
+) {
+	/* Every page but the last is full; the last holds the rest, even if
+	 * that is nothing, to end the packet with a short segment */
+	size_t needed = len / (255*255) + 1;
+	size_t i;
+	
+	for (i = 0; i < needed && i < count; i++) {
+		ogg_page *page = &pages[i];
+		bool last = i + 1 == needed;
+		
+		ogg_page_init(page);
+		page->data = (uint8_t *) data + i * 255*255;
+		page->storage = OGG_PAGE_STORAGE_BORROWED;
+		page->data_len = last ? len - i * 255*255 : 255*255;
+		page->granule_pos = last ? granule_pos : OGG_GRANULE_POS_NO_PACKET;
+		page->type = i > 0 ? OGG_PAGE_TYPE_CONTINUED : 0;
+		page->serial = serial;
+		page->seq = seq + i;
+	}
+	
+	return needed;
+}
+
+int ogg_packet_write(
+	const uint8_t *data,
+	size_t len,
+	uint64_t granule_pos,
+	uint32_t serial,
+	uint32_t *seq,
+	ogg_stream *stream
+) {
+	ogg_page *pages;
+	size_t count, i;
+	int err = OGG_SUCCESS;
+	
+	count = ogg_packet_paginate(data, len, granule_pos, serial, *seq, NULL, 0);
+	pages = malloc(count * sizeof (ogg_page));
+	ogg_packet_paginate(data, len, granule_pos, serial, *seq, pages, count);
+	
+	/* Each page's data is written straight from the packet; only the
+	 * headers are built */
+	for (i = 0; i < count && err == OGG_SUCCESS; i++)
+		err = ogg_page_write(&pages[i], stream);
+	if (err == OGG_SUCCESS)
+		*seq += count;
+	
+	free(pages);
+	return err;
+}
+
+void ogg_packet_init(ogg_packet *packet) {
+	packet->data_len = 0;
+	packet->granule_pos = OGG_GRANULE_POS_NO_PACKET;
+	ogg_page_init(&packet->first.page);
+	packet->first.offset = 0;
+	packet->first.length = 0;
+	packet->first.next = NULL;
+	packet->spare = NULL;
+}
+
+/* Release the pages held by a packet, keeping the chain nodes for reuse */
+static void ogg_packet_reset(ogg_packet *packet) {
+	ogg_packet_page *current = packet->first.next;
+	
+	while (current) {
+		ogg_packet_page *next = current->next;
+		
+		ogg_page_clear(&current->page);
+		current->next = packet->spare;
+		packet->spare = current;
+		
+		current = next;
+	}
+	
+	packet->data_len = 0;
+	packet->granule_pos = OGG_GRANULE_POS_NO_PACKET;
+	ogg_page_clear(&packet->first.page);
+	packet->first.offset = 0;
+	packet->first.length = 0;
+	packet->first.next = NULL;
+}
+
+void ogg_packet_clear(ogg_packet *packet) {
+	ogg_packet_page *current;
+	
+	/* Put the entire page chain on the spare list, then free that */
+	ogg_packet_reset(packet);
+	
+	current = packet->spare;
+	while (current) {
+		ogg_packet_page *next = current->next;
+		free(current);
+		current = next;
+	}
+	packet->spare = NULL;
+}
+
+static ogg_packet_page *ogg_packet_page_new(ogg_packet *packet) {
+	ogg_packet_page *node = packet->spare;
+	
+	if (node)
+		packet->spare = node->next;
+	else
+		node = malloc(sizeof (ogg_packet_page));
+	
+	ogg_page_init(&node->page);
+	node->offset = 0;
+	node->length = 0;
+	node->next = NULL;
+	
+	return node;
+}
+
+void ogg_packet_reader_init(ogg_packet_reader *reader) {
+	ogg_page_init(&reader->page);
+	reader->segments = 0;
+	reader->segment = 0;
+	reader->offset = 0;
+}
+
+void ogg_packet_reader_clear(ogg_packet_reader *reader) {
+	ogg_page_clear(&reader->page);
+	ogg_packet_reader_init(reader);
+}
+
+int ogg_packet_read_pages(ogg_packet *packet, ogg_packet_reader *reader, ogg_page_source_func source, void *user) {
+	ogg_packet_page *tail = NULL;
+	bool tail_borrowed = false;
+	bool complete = false;
+	int i, err;
+	
+	ogg_packet_reset(packet);
+	
+	while (!complete) {
+		size_t start;
+		bool continued;
+		
+		/* Move on to the next page once this one has been used up */
+		if (reader->segment == reader->segments) {
+			if (tail_borrowed) {
+				/* The packet keeps the page it is continued from */
+				tail->page.storage = reader->page.storage;
+				ogg_page_init(&reader->page);
+				tail_borrowed = false;
+			} else {
+				ogg_page_clear(&reader->page);
+			}
+			reader->segment = reader->segments = 0;
+			reader->offset = 0;
+			
+			err = source(user, &reader->page, reader->lacing, &reader->segments);
+			if (err != OGG_SUCCESS)
+				goto error;
+			
+			continued = reader->page.type & OGG_PAGE_TYPE_CONTINUED;
+			if (tail && !continued) {
+				ogg_error = "Packet is not continued on the following page";
+				err = OGG_INVALID;
+				goto error;
+			}
+			
+			/* Drop the tail of a packet whose start we didn't see */
+			if (!tail && continued) {
+				while (reader->segment < reader->segments) {
+					uint8_t lacing = reader->lacing[reader->segment++];
+					reader->offset += lacing;
+					if (lacing < 255)
+						break;
+				}
+			}
+			continue;
+		}
+		
+		/* Gather segments until the packet ends or the page runs out */
+		start = reader->offset;
+		while (reader->segment < reader->segments) {
+			uint8_t lacing = reader->lacing[reader->segment++];
+			reader->offset += lacing;
+			if (lacing < 255) {
+				complete = true;
+				break;
+			}
+		}
+		
+		/* Add a slice of the page to the packet, borrowed from the reader */
+		if (!tail)
+			tail = &packet->first;
+		else
+			tail = tail->next = ogg_packet_page_new(packet);
+		tail->page = reader->page;
+		tail->page.storage = OGG_PAGE_STORAGE_BORROWED;
+		tail->offset = start;
+		tail->length = reader->offset - start;
+		tail_borrowed = true;
+		packet->data_len += tail->length;
+	}
+	
+	/* The granule position belongs to the last packet that ends on a page */
+	packet->granule_pos = reader->page.granule_pos;
+	for (i = reader->segment; i < reader->segments; i++) {
+		if (reader->lacing[i] < 255) {
+			packet->granule_pos = OGG_GRANULE_POS_NO_PACKET;
+			break;
+		}
+	}
+	
+	return OGG_SUCCESS;
+
+error:
+	ogg_packet_reset(packet);
+	return err;
+}
+
+/* Pages for ogg_packet_read(), straight from the stream */
+static int ogg_packet_stream_source(void *user, ogg_page *page, uint8_t *lacing, uint8_t *segments) {
+	return ogg_page_read_lacing(page, user, lacing, segments);
+}
+
+int ogg_packet_read(ogg_packet *packet, ogg_stream *stream) {
+	return ogg_packet_read_pages(packet, &stream->reader, ogg_packet_stream_source, stream);
+}
+
+size_t ogg_packet_iovec(const ogg_packet *packet, struct iovec *iov, size_t iovcnt) {
+	const ogg_packet_page *current;
+	size_t count = 0;
+	
+	for (current = &packet->first; current; current = current->next) {
+		if (count < iovcnt) {
+			iov[count].iov_base = current->page.data + current->offset;
+			iov[count].iov_len = current->length;
+		}
+		count++;
+	}
+	
+	return count;
+}
+
+void ogg_packet_flatten(const ogg_packet *packet, uint8_t *buffer) {
+	const ogg_packet_page *current;
+	
+	for (current = &packet->first; current; current = current->next) {
+		memcpy(buffer, current->page.data + current->offset, current->length);
+		buffer += current->length;
+	}
+}
+
+int ogg_packet_rewrite_pages(
+	const ogg_page *pages,
+	size_t count,
+	const uint8_t *data,
+	size_t len,
+	ogg_stream *stream
+) {
+	uint8_t *buffer = NULL;
+	size_t *page_sizes = NULL;
+	size_t i, total = 0, used = 0, pos = 0;
+	bool contiguous = true;
+	int err;
+	
+	if (!stream->io->pread || !stream->io->pwrite) {
+		ogg_error = "Stream does not support positional reads and writes";
+		return OGG_INVALID;
+	}
+	
+	for (i = 0; i < count; i++)
+		total += pages[i].data_len;
+	if (count == 0 || total != len) {
+		ogg_error = "Packet does not fit in the existing pages";
+		return OGG_BAD_SIZE;
+	}
+	
+	/* Build every page before writing any, so a failure leaves no trace */
+	buffer = malloc(count * (OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS) + len);
+	page_sizes = malloc(count * sizeof (size_t));
+	for (i = 0; i < count; i++) {
+		ogg_page page = pages[i];
+		uint8_t segments;
+		size_t header_len;
+		
+		page.data = (uint8_t *) data + pos;
+		page.storage = OGG_PAGE_STORAGE_BORROWED;
+		
+		err = ogg_page_header_build(&page, &buffer[used]);
+		if (err != OGG_SUCCESS)
+			goto error;
+		header_len = OGG_PAGE_HEADER_SIZE + buffer[used + 26];
+		
+		/* The old page must have been laced the same way */
+		if (stream->io->pread(stream, &segments, 1, pages[i].offset + 26) != 1 ||
+		    segments != buffer[used + 26]) {
+			ogg_error = "Packet does not fit in the existing pages";
+			err = OGG_BAD_SIZE;
+			goto error;
+		}
+		if (pages[i].offset != pages[0].offset + (off_t) used)
+			contiguous = false;
+		
+		memcpy(&buffer[used + header_len], page.data, page.data_len);
+		page_sizes[i] = header_len + page.data_len;
+		used += page_sizes[i];
+		pos += page.data_len;
+	}
+	
+	if (contiguous) {
+		if (stream->io->pwrite(stream, buffer, used, pages[0].offset) != used)
+			goto write_error;
+	} else {
+		for (i = 0, used = 0; i < count; used += page_sizes[i++]) {
+			if (stream->io->pwrite(stream, &buffer[used], page_sizes[i],
+					pages[i].offset) != page_sizes[i])
+				goto write_error;
+		}
+	}
+	
+	free(page_sizes);
+	free(buffer);
+	return OGG_SUCCESS;
+
+write_error:
+	ogg_error = "Error writing page";
+	err = OGG_INVALID;
+error:
+	free(page_sizes);
+	free(buffer);
+	return err;
+}
+
+int ogg_stream_copy_pages(ogg_stream *from, ogg_stream *to, uint32_t serial, int32_t seq_delta) {
+	uint8_t page_header[OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS];
+	uint8_t *buffer = NULL;
+	ogg_page_writer writer;
+	int err;
+	
+	if (!from->io->map)
+		buffer = malloc(255*255);
+	ogg_page_writer_init(&writer, to, 0);
+	
+	while ((err = ogg_page_header_read(page_header, from)) == OGG_SUCCESS) {
+		size_t header_len = OGG_PAGE_HEADER_SIZE + page_header[26];
+		size_t data_len = ogg_page_header_data_len(page_header);
+		const uint8_t *data;
+		
+		/* Take the payload straight from the mapping where possible */
+		if (buffer) {
+			data = buffer;
+			if (from->io->read(from, buffer, data_len) < data_len)
+				data = NULL;
+		} else {
+			data = from->io->map(from, data_len);
+		}
+		if (!data) {
+			ogg_error = "Error reading page data";
+			err = OGG_INVALID;
+			goto error;
+		}
+		
+		if (seq_delta != 0 && read_le32(&page_header[14]) == serial)
+			ogg_page_header_set_seq(page_header, header_len + data_len,
+				read_le32(&page_header[18]) + seq_delta);
+		
+		err = ogg_page_writer_add_raw(&writer, page_header, header_len, data, data_len);
+		if (err != OGG_SUCCESS)
+			goto error;
+	}
+	
+	if (err == OGG_END_OF_STREAM)
+		err = ogg_page_writer_flush(&writer);
+
+error:
+	ogg_page_writer_clear(&writer);
+	free(buffer);
+	return err;
+}
+
+ogg_stream *ogg_stream_new(void) {
+	ogg_stream *stream = calloc(1, sizeof (ogg_stream));
+	ogg_packet_reader_init(&stream->reader);
+	return stream;
+}
+
+void ogg_stream_free(ogg_stream *stream) {
+	ogg_packet_reader_clear(&stream->reader);
+	free(stream);
+}
+
+static size_t ogg_stream_file_read(ogg_stream *stream, uint8_t *buffer, size_t len) {
 	FILE *file = stream->priv;
 	return fread(buffer, sizeof (uint8_t), len, file);
 }
@@ -330,11 +1214,34 @@ static int ogg_stream_file_seek(ogg_stream *stream, off_t offset) {
 	return fseeko(file, offset, SEEK_SET);
 }
 
+static off_t ogg_stream_file_size(ogg_stream *stream) {
+	FILE *file = stream->priv;
+	struct stat st;
+	
+	if (fstat(fileno(file), &st) < 0)
+		return -1;
+	
+	return st.st_size;
+}
+
+static void ogg_stream_file_close_io(ogg_stream *stream) {
+	FILE *file = stream->priv;
+	
+	fclose(file);
+	
+	ogg_stream_free(stream);
+}
+
 static ogg_stream_io_functions ogg_stream_file_functions = {
 	ogg_stream_file_read,
 	ogg_stream_file_write,
 	ogg_stream_file_tell,
-	ogg_stream_file_seek
+	ogg_stream_file_seek,
+	ogg_stream_file_size,
+	NULL,
+	NULL,
+	NULL,
+	ogg_stream_file_close_io
 };
 
 ogg_stream *ogg_stream_file_open_read(const char *filename) {
@@ -371,10 +1278,458 @@ ogg_stream *ogg_stream_file_open(const char *filename) {
 	return stream;
 }
 
+ogg_stream *ogg_stream_file_create(const char *filename) {
+	ogg_stream *stream;
+	FILE *file;
+	
+	file = fopen(filename, "wb+");
+	if (!file) {
+		ogg_error = strerror(errno);
+		return NULL;
+	}
+	
+	stream = ogg_stream_new();
+	stream->io = &ogg_stream_file_functions;
+	stream->priv = file;
+	
+	return stream;
+}
+
 void ogg_stream_file_close(ogg_stream *stream) {
-	FILE *file = stream->priv;
+	ogg_stream_close(stream);
+}
+
+/* Raw file descriptor backend: all access goes through pread/pwrite, so the
+ * positional functions don't touch the stream position and can be used by
+ * several threads at once */
+typedef struct ogg_stream_fd {
+	int fd;
+	off_t pos;
+} ogg_stream_fd;
+
+static size_t ogg_stream_fd_pread(ogg_stream *stream, uint8_t *buffer, size_t len, off_t offset) {
+	ogg_stream_fd *file = stream->priv;
+	size_t done = 0;
 	
-	fclose(file);
+	while (done < len) {
+		ssize_t ret = pread(file->fd, buffer + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	
+	return done;
+}
+
+static size_t ogg_stream_fd_pwrite(ogg_stream *stream, const uint8_t *buffer, size_t len, off_t offset) {
+	ogg_stream_fd *file = stream->priv;
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t ret = pwrite(file->fd, buffer + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	
+	return done;
+}
+
+static size_t ogg_stream_fd_read(ogg_stream *stream, uint8_t *buffer, size_t len) {
+	ogg_stream_fd *file = stream->priv;
+	size_t done = ogg_stream_fd_pread(stream, buffer, len, file->pos);
+	
+	file->pos += done;
+	return done;
+}
+
+static size_t ogg_stream_fd_write(ogg_stream *stream, const uint8_t *buffer, size_t len) {
+	ogg_stream_fd *file = stream->priv;
+	size_t done = ogg_stream_fd_pwrite(stream, buffer, len, file->pos);
+	
+	file->pos += done;
+	return done;
+}
+
+static off_t ogg_stream_fd_tell(ogg_stream *stream) {
+	ogg_stream_fd *file = stream->priv;
+	return file->pos;
+}
+
+static int ogg_stream_fd_seek(ogg_stream *stream, off_t offset) {
+	ogg_stream_fd *file = stream->priv;
+	
+	if (offset < 0)
+		return -1;
+	file->pos = offset;
+	
+	return 0;
+}
+
+static off_t ogg_stream_fd_size(ogg_stream *stream) {
+	ogg_stream_fd *file = stream->priv;
+	struct stat st;
+	
+	if (fstat(file->fd, &st) < 0)
+		return -1;
+	
+	return st.st_size;
+}
+
+static void ogg_stream_fd_close(ogg_stream *stream) {
+	ogg_stream_fd *file = stream->priv;
+	
+	close(file->fd);
+	free(file);
 	
 	ogg_stream_free(stream);
 }
+
+static ogg_stream_io_functions ogg_stream_fd_functions = {
+	ogg_stream_fd_read,
+	ogg_stream_fd_write,
+	ogg_stream_fd_tell,
+	ogg_stream_fd_seek,
+	ogg_stream_fd_size,
+	ogg_stream_fd_pread,
+	ogg_stream_fd_pwrite,
+	NULL,
+	ogg_stream_fd_close
+};
+
+ogg_stream *ogg_stream_fd_new(int fd) {
+	ogg_stream *stream;
+	ogg_stream_fd *file;
+	
+	file = calloc(1, sizeof (ogg_stream_fd));
+	file->fd = fd;
+	
+	stream = ogg_stream_new();
+	stream->io = &ogg_stream_fd_functions;
+	stream->priv = file;
+	
+	return stream;
+}
+
+ogg_stream *ogg_stream_fd_open(const char *filename, bool writable) {
+	int fd;
+	
+	fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		ogg_error = strerror(errno);
+		return NULL;
+	}
+	
+	return ogg_stream_fd_new(fd);
+}
+
+/* Memory-mapped backend: the whole file is mapped read-only, and pages
+ * borrow their data straight from the mapping */
+typedef struct ogg_stream_mmap {
+	uint8_t *base;
+	size_t size;
+	size_t pos;
+} ogg_stream_mmap;
+
+static size_t ogg_stream_mmap_read(ogg_stream *stream, uint8_t *buffer, size_t len) {
+	ogg_stream_mmap *map = stream->priv;
+	
+	if (len > map->size - map->pos)
+		len = map->size - map->pos;
+	memcpy(buffer, map->base + map->pos, len);
+	map->pos += len;
+	
+	return len;
+}
+
+static size_t ogg_stream_mmap_write(ogg_stream *stream, const uint8_t *buffer, size_t len) {
+	/* The mapping is read-only */
+	return 0;
+}
+
+static off_t ogg_stream_mmap_tell(ogg_stream *stream) {
+	ogg_stream_mmap *map = stream->priv;
+	return map->pos;
+}
+
+static int ogg_stream_mmap_seek(ogg_stream *stream, off_t offset) {
+	ogg_stream_mmap *map = stream->priv;
+	
+	if (offset < 0 || (size_t) offset > map->size)
+		return -1;
+	map->pos = offset;
+	
+	return 0;
+}
+
+static off_t ogg_stream_mmap_size(ogg_stream *stream) {
+	ogg_stream_mmap *map = stream->priv;
+	return map->size;
+}
+
+static size_t ogg_stream_mmap_pread(ogg_stream *stream, uint8_t *buffer, size_t len, off_t offset) {
+	ogg_stream_mmap *map = stream->priv;
+	
+	if (offset < 0 || (size_t) offset > map->size)
+		return 0;
+	if (len > map->size - offset)
+		len = map->size - offset;
+	memcpy(buffer, map->base + offset, len);
+	
+	return len;
+}
+
+static const uint8_t *ogg_stream_mmap_map(ogg_stream *stream, size_t len) {
+	ogg_stream_mmap *map = stream->priv;
+	const uint8_t *data;
+	
+	if (len > map->size - map->pos)
+		return NULL;
+	data = map->base + map->pos;
+	map->pos += len;
+	
+	return data;
+}
+
+static void ogg_stream_mmap_close(ogg_stream *stream) {
+	ogg_stream_mmap *map = stream->priv;
+	
+	if (map->base)
+		munmap(map->base, map->size);
+	free(map);
+	
+	ogg_stream_free(stream);
+}
+
+static ogg_stream_io_functions ogg_stream_mmap_functions = {
+	ogg_stream_mmap_read,
+	ogg_stream_mmap_write,
+	ogg_stream_mmap_tell,
+	ogg_stream_mmap_seek,
+	ogg_stream_mmap_size,
+	ogg_stream_mmap_pread,
+	NULL,
+	ogg_stream_mmap_map,
+	ogg_stream_mmap_close
+};
+
+ogg_stream *ogg_stream_mmap_open_read(const char *filename) {
+	ogg_stream *stream;
+	ogg_stream_mmap *map;
+	struct stat st;
+	void *base = NULL;
+	int fd;
+	
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ogg_error = strerror(errno);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		ogg_error = strerror(errno);
+		close(fd);
+		return NULL;
+	}
+	
+	/* Zero-length files can't be mapped, but are valid (empty) streams */
+	if (st.st_size > 0) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED) {
+			ogg_error = strerror(errno);
+			close(fd);
+			return NULL;
+		}
+		madvise(base, st.st_size, MADV_SEQUENTIAL);
+	}
+	
+	/* The mapping holds its own reference to the file */
+	close(fd);
+	
+	map = calloc(1, sizeof (ogg_stream_mmap));
+	map->base = base;
+	map->size = st.st_size;
+	
+	stream = ogg_stream_new();
+	stream->io = &ogg_stream_mmap_functions;
+	stream->priv = map;
+	
+	return stream;
+}
+
+/* Streaming backend: reads from a pipe or other non-seekable descriptor
+ * through a ring buffer. Offsets are counted from the start of the data read
+ * from the descriptor, and seeking is possible backwards within the recent
+ * history in the buffer, or forwards by discarding data. */
+typedef struct ogg_stream_pipe {
+	int fd;
+	bool eof;
+	uint8_t *buffer;
+	off_t head;
+	off_t pos;
+} ogg_stream_pipe;
+
+/* Read more data from the descriptor into the ring buffer */
+static ssize_t ogg_stream_pipe_fill(ogg_stream_pipe *pipe) {
+	off_t low;
+	size_t room, index;
+	ssize_t len;
+	
+	if (pipe->eof)
+		return 0;
+	
+	/* Don't overwrite unread data, or the history behind it */
+	low = pipe->pos > OGG_PIPE_HISTORY_SIZE ? pipe->pos - OGG_PIPE_HISTORY_SIZE : 0;
+	room = OGG_PIPE_BUFFER_SIZE - (pipe->head - low);
+	index = pipe->head & (OGG_PIPE_BUFFER_SIZE - 1);
+	if (room > OGG_PIPE_BUFFER_SIZE - index)
+		room = OGG_PIPE_BUFFER_SIZE - index;
+	if (room == 0)
+		return 0;
+	
+	do {
+		len = read(pipe->fd, pipe->buffer + index, room);
+	} while (len < 0 && errno == EINTR);
+	
+	if (len <= 0)
+		pipe->eof = true;
+	else
+		pipe->head += len;
+	
+	return len;
+}
+
+static size_t ogg_stream_pipe_read(ogg_stream *stream, uint8_t *buffer, size_t len) {
+	ogg_stream_pipe *pipe = stream->priv;
+	size_t done = 0;
+	
+	while (done < len) {
+		size_t index, chunk;
+		
+		if (pipe->pos == pipe->head && ogg_stream_pipe_fill(pipe) <= 0)
+			break;
+		
+		index = pipe->pos & (OGG_PIPE_BUFFER_SIZE - 1);
+		chunk = pipe->head - pipe->pos;
+		if (chunk > OGG_PIPE_BUFFER_SIZE - index)
+			chunk = OGG_PIPE_BUFFER_SIZE - index;
+		if (chunk > len - done)
+			chunk = len - done;
+		
+		memcpy(buffer + done, pipe->buffer + index, chunk);
+		pipe->pos += chunk;
+		done += chunk;
+	}
+	
+	return done;
+}
+
+static size_t ogg_stream_pipe_write(ogg_stream *stream, const uint8_t *buffer, size_t len) {
+	/* Streaming input only */
+	return 0;
+}
+
+static off_t ogg_stream_pipe_tell(ogg_stream *stream) {
+	ogg_stream_pipe *pipe = stream->priv;
+	return pipe->pos;
+}
+
+static int ogg_stream_pipe_seek(ogg_stream *stream, off_t offset) {
+	ogg_stream_pipe *pipe = stream->priv;
+	off_t low;
+	
+	low = pipe->head > OGG_PIPE_BUFFER_SIZE ? pipe->head - OGG_PIPE_BUFFER_SIZE : 0;
+	if (offset < low)
+		return -1;
+	
+	/* Skip forward by reading and discarding */
+	while (pipe->head < offset) {
+		pipe->pos = pipe->head;
+		if (ogg_stream_pipe_fill(pipe) <= 0)
+			return -1;
+	}
+	pipe->pos = offset;
+	
+	return 0;
+}
+
+static void ogg_stream_pipe_close(ogg_stream *stream) {
+	ogg_stream_pipe *pipe = stream->priv;
+	
+	free(pipe->buffer);
+	free(pipe);
+	
+	ogg_stream_free(stream);
+}
+
+static ogg_stream_io_functions ogg_stream_pipe_functions = {
+	ogg_stream_pipe_read,
+	ogg_stream_pipe_write,
+	ogg_stream_pipe_tell,
+	ogg_stream_pipe_seek,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	ogg_stream_pipe_close
+};
+
+ogg_stream *ogg_stream_pipe_open(int fd) {
+	ogg_stream *stream;
+	ogg_stream_pipe *pipe;
+	
+	pipe = calloc(1, sizeof (ogg_stream_pipe));
+	pipe->fd = fd;
+	pipe->buffer = malloc(OGG_PIPE_BUFFER_SIZE);
+	
+	stream = ogg_stream_new();
+	stream->io = &ogg_stream_pipe_functions;
+	stream->priv = pipe;
+	stream->resync = true;
+	
+	return stream;
+}
+
+int ogg_stream_resync(ogg_stream *stream) {
+	uint8_t buffer[OGG_SYNC_CHUNK_SIZE];
+	off_t offset;
+	size_t len, i;
+	
+	offset = stream->io->tell(stream);
+	
+	for (;;) {
+		len = stream->io->read(stream, buffer, sizeof (buffer));
+		if (len < sizeof (OGG_PAGE_MAGIC)) {
+			ogg_error = "End of stream";
+			return OGG_END_OF_STREAM;
+		}
+		
+		for (i = 0; i + sizeof (OGG_PAGE_MAGIC) <= len; i++) {
+			if (!memcmp(&buffer[i], OGG_PAGE_MAGIC, sizeof (OGG_PAGE_MAGIC))) {
+				if (stream->io->seek(stream, offset + i)) {
+					ogg_error = "Error seeking to capture pattern";
+					return OGG_INVALID;
+				}
+				return OGG_SUCCESS;
+			}
+		}
+		
+		/* The capture pattern could straddle the end of this chunk */
+		offset += i;
+		if (stream->io->seek(stream, offset)) {
+			ogg_error = "Error seeking to capture pattern";
+			return OGG_INVALID;
+		}
+	}
+}
+
+void ogg_stream_set_pool(ogg_stream *stream, ogg_page_pool *pool) {
+	stream->pool = pool;
+}
+
+void ogg_stream_close(ogg_stream *stream) {
+	stream->io->close(stream);
+}
@@ -33,6 +33,19 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+
+/* Maximum number of segments that can be in an Ogg page */
+#define OGG_PAGE_MAX_SEGMENTS 255
+
+/* Size of an Ogg page header, minus the segment table */
+#define OGG_PAGE_HEADER_SIZE 27
+
+/* Maximum size of an Ogg page, including the header */
+#define OGG_PAGE_MAX_SIZE (OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS + 255*255)
+
+/* Granule position of a page on which no packet ends */
+#define OGG_GRANULE_POS_NO_PACKET 0xffffffffffffffff
 
 /**
  * ogg_error_codes:
@@ -40,12 +53,14 @@
  * @OGG_INVALID: An incoming Ogg stream contains invalid data
  * @OGG_MULTI_STREAM: The Ogg container contains multiple streams
  * @OGG_BAD_SIZE: An #ogg_page contains a data amount that isn't allowed by spec
+ * @OGG_END_OF_STREAM: There are no more pages in the stream
  */
 typedef enum {
 	OGG_SUCCESS = 0,
 	OGG_INVALID,
 	OGG_MULTI_STREAM,
 	OGG_BAD_SIZE,
+	OGG_END_OF_STREAM,
 } ogg_error_codes;
 
 /**
@@ -62,6 +77,45 @@ typedef enum {
 	OGG_PAGE_TYPE_EOS = 0x04,
 } ogg_page_type;
 
+/**
+ * ogg_page_storage:
+ * @OGG_PAGE_STORAGE_OWNED: The page data was allocated by ogg_page_read() and
+ *   is freed by ogg_page_clear()
+ * @OGG_PAGE_STORAGE_BORROWED: The page data points into memory owned by
+ *   someone else (such as a memory-mapped #ogg_stream), and must not be freed
+ * @OGG_PAGE_STORAGE_POOLED: The page data is a buffer from #ogg_page.pool,
+ *   and is returned to it by ogg_page_clear()
+ *
+ * Values for the #ogg_page.storage field
+ */
+typedef enum {
+	OGG_PAGE_STORAGE_OWNED = 0,
+	OGG_PAGE_STORAGE_BORROWED,
+	OGG_PAGE_STORAGE_POOLED,
+} ogg_page_storage;
+
+/**
+ * ogg_page_pool:
+ *
+ * A thread-safe pool of reusable page data buffers, each large enough to hold
+ * the biggest possible Ogg page
+ */
+typedef struct ogg_page_pool ogg_page_pool;
+
+/**
+ * ogg_page_pool_stats:
+ * @hits: The number of buffers handed out from the pool
+ * @misses: The number of buffers that had to be newly allocated
+ * @free_buffers: The number of buffers currently waiting for reuse
+ *
+ * Counters describing how well an #ogg_page_pool is working
+ */
+typedef struct ogg_page_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	size_t free_buffers;
+} ogg_page_pool_stats;
+
 /**
  * ogg_page:
  * @version: Ogg stream structure revision
@@ -72,6 +126,9 @@ typedef enum {
  * @data: The data contained within this page
  * @data_len: The number of bytes of data
  * @offset: The offset of this page from the start of the file
+ * @storage: Who owns the memory at @data (See #ogg_page_storage)
+ * @pool: The pool that @data came from, if @storage is
+ *   %OGG_PAGE_STORAGE_POOLED
  *
  * Structure representing a page in an Ogg stream
  */
@@ -82,10 +139,103 @@ typedef struct ogg_page {
 	uint16_t data_len;
 	uint8_t version;
 	uint8_t type;
+	uint8_t storage;
 	uint8_t *data;
 	off_t offset;
+	ogg_page_pool *pool;
 } ogg_page;
 
+/**
+ * ogg_page_info:
+ * @version: Ogg stream structure revision
+ * @type: Flag indicating page's context in the bitstream (See #ogg_page_type)
+ * @granule_pos: Position indicator for data contained in the page
+ * @serial: Logical bitstream identification serial number
+ * @seq: Page counter
+ * @crc: The page checksum, as stored in the header (not verified)
+ * @data_len: The number of bytes of data
+ * @size: The total size of the page, including the header
+ * @offset: The offset of this page from the start of the file
+ *
+ * Structure describing the layout of a page in an Ogg stream, without its
+ * data
+ */
+typedef struct ogg_page_info {
+	uint64_t granule_pos;
+	uint32_t serial;
+	uint32_t seq;
+	uint32_t crc;
+	uint32_t size;
+	uint16_t data_len;
+	uint8_t version;
+	uint8_t type;
+	off_t offset;
+} ogg_page_info;
+
+/**
+ * ogg_page_batch:
+ * @capacity: The number of entries allocated in each array
+ * @count: The number of pages found by the last ogg_page_batch_parse()
+ * @offset: The offset of each page from the start of the stream
+ * @granule_pos: The granule position of each page
+ * @serial: The serial number of each page
+ * @seq: The page counter of each page
+ * @size: The total size of each page, including the header
+ * @data_len: The number of bytes of data in each page
+ * @type: The #ogg_page_type flags of each page
+ * @crc_ok: Whether the checksum of each page is correct
+ *
+ * Descriptions of many pages in a buffer, stored as parallel arrays
+ */
+typedef struct ogg_page_batch {
+	size_t capacity;
+	size_t count;
+	off_t *offset;
+	uint64_t *granule_pos;
+	uint32_t *serial;
+	uint32_t *seq;
+	uint32_t *size;
+	uint16_t *data_len;
+	uint8_t *type;
+	bool *crc_ok;
+} ogg_page_batch;
+
+/**
+ * OGG_PAGE_WRITER_DEFAULT_SIZE:
+ *
+ * The default buffer size of an #ogg_page_writer
+ */
+#define OGG_PAGE_WRITER_DEFAULT_SIZE (1024 * 1024)
+
+typedef struct ogg_stream ogg_stream;
+
+/**
+ * ogg_page_writer:
+ * @stream: The #ogg_stream that pages are written to
+ * @buffer: Complete pages waiting to be written
+ * @size: The size of @buffer
+ * @used: The number of bytes of @buffer in use
+ *
+ * Gathers pages into a large buffer so that they reach the stream in a few
+ * big writes, instead of two small writes per page
+ */
+typedef struct ogg_page_writer {
+	ogg_stream *stream;
+	uint8_t *buffer;
+	size_t size;
+	size_t used;
+} ogg_page_writer;
+
+/**
+ * ogg_packet_page:
+ * @page: The page containing this part of the packet
+ * @offset: The offset of this part of the packet within @page's data
+ * @length: The number of bytes of the packet in this page
+ * @next: The page containing the next part of the packet, or %NULL
+ *
+ * One slice of an #ogg_packet. The slices are not copied out of the pages
+ * they were read from.
+ */
 typedef struct ogg_packet_page {
 	ogg_page page;
 	size_t offset;
@@ -93,33 +243,164 @@ typedef struct ogg_packet_page {
 	struct ogg_packet_page *next;
 } ogg_packet_page;
 
+/**
+ * ogg_packet:
+ * @data_len: The total number of bytes in the packet
+ * @granule_pos: The granule position of the page the packet ends on, if it
+ *   is the last packet to end on that page, otherwise
+ *   %OGG_GRANULE_POS_NO_PACKET
+ * @first: The first slice of the packet
+ * @spare: Chain nodes kept for reuse by the next ogg_packet_read()
+ *
+ * Structure representing a packet in an Ogg stream, as a list of slices of
+ * the pages that it spans
+ */
 typedef struct ogg_packet {
 	uint64_t data_len;
+	uint64_t granule_pos;
 	ogg_packet_page first;
+	ogg_packet_page *spare;
 } ogg_packet;
 
-typedef struct ogg_stream ogg_stream;
+/**
+ * ogg_packet_reader:
+ * @page: The page currently being split into packets
+ * @lacing: The segment table of @page
+ * @segments: The number of entries in @lacing
+ * @segment: The next entry in @lacing to be read
+ * @offset: The offset of the next segment in @page's data
+ *
+ * The state of splitting the pages of one logical bitstream into packets
+ */
+typedef struct ogg_packet_reader {
+	ogg_page page;
+	uint8_t lacing[OGG_PAGE_MAX_SEGMENTS];
+	uint8_t segments;
+	uint8_t segment;
+	size_t offset;
+} ogg_packet_reader;
+
+/**
+ * ogg_page_source_func:
+ * @user: The data passed to ogg_packet_read_pages()
+ * @page: An initialized #ogg_page to save the next page into
+ * @lacing: Location to store the segment table of the page
+ * @segments: Location to store the number of entries in @lacing
+ *
+ * Get the next page of a logical bitstream, with its segment table
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM if there are no more pages,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+typedef int (*ogg_page_source_func)(void *user, ogg_page *page, uint8_t *lacing, uint8_t *segments);
 
+/**
+ * ogg_stream_io_functions:
+ * @read: Copy up to @len bytes from the current position into @buffer
+ * @write: Write @len bytes from @buffer at the current position
+ * @tell: Return the current position from the start of the stream
+ * @seek: Move the current position to an absolute offset
+ * @size: Optional; return the total size of the stream
+ * @pread: Optional; copy up to @len bytes at an absolute offset into
+ *   @buffer, without using or changing the current position
+ * @pwrite: Optional; write @len bytes at an absolute offset, without using
+ *   or changing the current position
+ * @map: Optional; return a pointer to the next @len bytes of the stream and
+ *   advance past them, or %NULL if they are not available. The memory stays
+ *   valid until the stream is closed, and must not be modified.
+ * @close: Release the backend resources and free the #ogg_stream
+ *
+ * Backend implementation of an #ogg_stream. The positional functions must
+ * be safe to call from several threads at once.
+ */
 typedef struct ogg_stream_io_functions {
 	size_t (*read)(ogg_stream *stream, uint8_t *buffer, size_t len);
 	size_t (*write)(ogg_stream *stream, const uint8_t *buffer, size_t len);
 	off_t (*tell)(ogg_stream *stream);
 	int (*seek)(ogg_stream *stream, off_t offset);
+	off_t (*size)(ogg_stream *stream);
+	size_t (*pread)(ogg_stream *stream, uint8_t *buffer, size_t len, off_t offset);
+	size_t (*pwrite)(ogg_stream *stream, const uint8_t *buffer, size_t len, off_t offset);
+	const uint8_t *(*map)(ogg_stream *stream, size_t len);
+	void (*close)(ogg_stream *stream);
 } ogg_stream_io_functions;
 
+/**
+ * ogg_stream:
+ * @io: The backend implementation
+ * @priv: Backend private data
+ * @reader: The state of ogg_packet_read() splitting the pages into packets
+ * @pool: Optional pool to take page data buffers from
+ * @resync: Whether to skip over corrupt data to the next capture pattern
+ *   instead of failing to read a page
+ *
+ * A source or destination of Ogg pages
+ */
 struct ogg_stream {
 	ogg_stream_io_functions *io;
 	void *priv;
-	ogg_packet *current;
-	size_t offset;
+	ogg_page_pool *pool;
+	bool resync;
+	ogg_packet_reader reader;
 };
 
 /**
  * ogg_error:
  * 
- * A human-readable string error from the last failed Ogg function
+ * A human-readable string error from the last failed Ogg function in the
+ * calling thread
+ */
+extern __thread const char *ogg_error;
+
+/**
+ * ogg_page_pool_new:
+ * @max_free: The maximum number of unused buffers to keep for reuse
+ *
+ * Create a pool of page data buffers. A pool may be shared between streams
+ * in different threads, and must outlive every page read using it.
+ *
+ * Returns: A newly allocated #ogg_page_pool, which must be freed with
+ * ogg_page_pool_free()
+ */
+ogg_page_pool *ogg_page_pool_new(size_t max_free);
+
+/**
+ * ogg_page_pool_free:
+ * @pool: The #ogg_page_pool to free
+ *
+ * Free a page pool and all of the unused buffers in it
  */
-extern const char *ogg_error;
+void ogg_page_pool_free(ogg_page_pool *pool);
+
+/**
+ * ogg_page_pool_acquire:
+ * @pool: An #ogg_page_pool
+ *
+ * Take a buffer of %OGG_PAGE_MAX_SIZE bytes from the pool, allocating a new
+ * one if the pool is empty
+ *
+ * Returns: A buffer, to be given back with ogg_page_pool_release()
+ */
+uint8_t *ogg_page_pool_acquire(ogg_page_pool *pool);
+
+/**
+ * ogg_page_pool_release:
+ * @pool: The #ogg_page_pool that @data was acquired from
+ * @data: The buffer to give back
+ *
+ * Return a buffer to the pool for reuse, or free it if the pool is full
+ */
+void ogg_page_pool_release(ogg_page_pool *pool, uint8_t *data);
+
+/**
+ * ogg_page_pool_get_stats:
+ * @pool: An #ogg_page_pool
+ * @stats: Location to store the counters
+ *
+ * Get the hit and miss counters of a page pool
+ */
+void ogg_page_pool_get_stats(ogg_page_pool *pool, ogg_page_pool_stats *stats);
 
 /**
  * ogg_page_init:
@@ -144,11 +425,113 @@ void ogg_page_clear(ogg_page *page);
  * 
  * Read the contents of an Ogg page from a file
  *
+ * If the stream supports mapping, the page data is borrowed from the stream
+ * without being copied, and remains valid until the stream is closed.
+ *
  * Returns: 0 on success, otherwise a value from #ogg_error_codes and #ogg_error
  * will contain a message
  */
 int ogg_page_read(ogg_page *page, ogg_stream *stream);
 
+/**
+ * ogg_page_read_lacing:
+ * @page: #ogg_page structure to save the read data into
+ * @stream: #ogg_stream to read the Ogg page from
+ * @lacing: Location to store the segment table of the page, or %NULL
+ * @segments: Location to store the number of entries in @lacing
+ *
+ * Read the contents of an Ogg page from a file like ogg_page_read(), also
+ * keeping its segment table so that it can be split into packets
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and #ogg_error
+ * will contain a message
+ */
+int ogg_page_read_lacing(ogg_page *page, ogg_stream *stream, uint8_t *lacing, uint8_t *segments);
+
+/**
+ * ogg_page_read_at:
+ * @page: #ogg_page structure to save the read data into
+ * @stream: #ogg_stream supporting positional reads to read the page from
+ * @offset: The offset of the page from the start of the stream
+ *
+ * Read the Ogg page at a given offset, without using or changing the stream
+ * position. Several threads may read pages from the same stream at once.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_read_at(ogg_page *page, ogg_stream *stream, off_t offset);
+
+/**
+ * ogg_page_read_info:
+ * @info: #ogg_page_info structure to save the page layout into
+ * @stream: #ogg_stream to read the Ogg page from
+ *
+ * Read only the header and segment table of an Ogg page, then seek past its
+ * data. The data is neither read nor checksummed, which makes this suitable
+ * for quickly walking the page structure of a stream.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM if there are no more pages,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+int ogg_page_read_info(ogg_page_info *info, ogg_stream *stream);
+
+/**
+ * ogg_page_find_last:
+ * @info: #ogg_page_info structure to save the page layout into
+ * @stream: #ogg_stream to search, which must support seeking and have a size
+ * @serial: The logical bitstream to find the last page of
+ *
+ * Find the last page of a logical bitstream that has a granule position, by
+ * scanning backwards from the end of the stream for the capture pattern.
+ * Usually only the last few kilobytes of the stream need to be read. The
+ * stream position is restored afterwards.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_find_last(ogg_page_info *info, ogg_stream *stream, uint32_t serial);
+
+/**
+ * ogg_page_batch_init:
+ * @batch: An uninitialized #ogg_page_batch structure
+ * @capacity: The maximum number of pages to describe at once
+ *
+ * Allocate the arrays of a page batch
+ */
+void ogg_page_batch_init(ogg_page_batch *batch, size_t capacity);
+
+/**
+ * ogg_page_batch_clear:
+ * @batch: A previously-used #ogg_page_batch structure
+ *
+ * Free the arrays of a page batch
+ */
+void ogg_page_batch_clear(ogg_page_batch *batch);
+
+/**
+ * ogg_page_batch_parse:
+ * @batch: An initialized #ogg_page_batch to fill in
+ * @buffer: A buffer holding a section of an Ogg stream
+ * @len: The number of bytes in @buffer
+ * @base_offset: The offset of @buffer[0] from the start of the stream
+ *
+ * Describe every complete page in a buffer in one call, up to the capacity
+ * of @batch. Data that doesn't start with the capture pattern is skipped.
+ * Checksums are verified, with the result recorded in #ogg_page_batch.crc_ok
+ * rather than stopping the parse.
+ *
+ * Returns: The number of bytes of @buffer that were used up. Anything after
+ * that (such as a page cut off by the end of the buffer) should be passed
+ * again at the start of the next buffer.
+ */
+size_t ogg_page_batch_parse(
+	ogg_page_batch *batch,
+	const uint8_t *buffer,
+	size_t len,
+	off_t base_offset);
+
 /**
  * ogg_page_write:
  * @page: An #ogg_page structure to write to a file
@@ -161,6 +544,95 @@ int ogg_page_read(ogg_page *page, ogg_stream *stream);
  */
 int ogg_page_write(const ogg_page *page, ogg_stream *stream);
 
+/**
+ * ogg_page_write_at:
+ * @page: An #ogg_page structure to write
+ * @stream: #ogg_stream supporting positional writes to write the page to
+ * @offset: The offset to write the page at
+ *
+ * Write an Ogg page at a given offset, without using or changing the stream
+ * position
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_write_at(const ogg_page *page, ogg_stream *stream, off_t offset);
+
+/**
+ * ogg_page_writer_init:
+ * @writer: An uninitialized #ogg_page_writer structure
+ * @stream: #ogg_stream to write pages to
+ * @size: The buffer size, or 0 for %OGG_PAGE_WRITER_DEFAULT_SIZE
+ *
+ * Initialize a page writer. The buffer is never smaller than
+ * %OGG_PAGE_MAX_SIZE.
+ */
+void ogg_page_writer_init(ogg_page_writer *writer, ogg_stream *stream, size_t size);
+
+/**
+ * ogg_page_writer_clear:
+ * @writer: A previously-used #ogg_page_writer structure
+ *
+ * Free the buffer of a page writer. Pages that weren't flushed are lost.
+ */
+void ogg_page_writer_clear(ogg_page_writer *writer);
+
+/**
+ * ogg_page_writer_add:
+ * @writer: An #ogg_page_writer
+ * @page: An #ogg_page to write
+ *
+ * Add a page to the buffer, computing its checksum as it is copied in. The
+ * buffer is flushed first if the page might not fit.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_writer_add(ogg_page_writer *writer, const ogg_page *page);
+
+/**
+ * ogg_page_writer_add_raw:
+ * @writer: An #ogg_page_writer
+ * @page_header: A complete page header, with its segment table and checksum
+ * @header_len: The number of bytes in @page_header
+ * @data: The page data
+ * @data_len: The number of bytes in @data
+ *
+ * Add an already built page to the buffer, as is
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_writer_add_raw(
+	ogg_page_writer *writer,
+	const uint8_t *page_header,
+	size_t header_len,
+	const uint8_t *data,
+	size_t data_len);
+
+/**
+ * ogg_page_writer_flush:
+ * @writer: An #ogg_page_writer
+ *
+ * Write every buffered page to the stream with a single write
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_page_writer_flush(ogg_page_writer *writer);
+
+/**
+ * ogg_page_header_set_seq:
+ * @page_header: The header of a complete page, with its segment table
+ * @page_size: The total size of the page, including the header
+ * @seq: The new page counter
+ *
+ * Change the page counter in a page header, updating the checksum to match
+ * without needing the page data. A page with a bad checksum keeps a bad
+ * checksum.
+ */
+void ogg_page_header_set_seq(uint8_t *page_header, size_t page_size, uint32_t seq);
+
 /**
  * ogg_packet_init:
  * @packet: An uninitialized #ogg_packet structure
@@ -177,6 +649,199 @@ void ogg_packet_init(ogg_packet *packet);
  */
 void ogg_packet_clear(ogg_packet *packet);
 
+/**
+ * ogg_packet_read:
+ * @packet: An initialized #ogg_packet to save the packet into
+ * @stream: #ogg_stream to read the packet from
+ *
+ * Read the next packet from a stream, reading as many pages as it spans.
+ * The packet data is not copied: each slice in the packet's page chain
+ * points into the page it was read from. Pages that the packet continues
+ * from are owned by the packet, but the final page may be shared with the
+ * stream, so the packet is only valid until the next call to
+ * ogg_packet_read() on @stream. Use ogg_packet_flatten() to keep a copy.
+ *
+ * All pages are assumed to belong to the same logical bitstream; use
+ * ogg_demux_stream_read_packet() for streams that may be multiplexed or
+ * chained.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM if there are no more packets,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+int ogg_packet_read(ogg_packet *packet, ogg_stream *stream);
+
+/**
+ * ogg_packet_reader_init:
+ * @reader: An uninitialized #ogg_packet_reader structure
+ *
+ * Initialize a previously unused #ogg_packet_reader structure
+ */
+void ogg_packet_reader_init(ogg_packet_reader *reader);
+
+/**
+ * ogg_packet_reader_clear:
+ * @reader: A previously-used #ogg_packet_reader structure
+ *
+ * Free the page held by the reader, and reinitialize
+ */
+void ogg_packet_reader_clear(ogg_packet_reader *reader);
+
+/**
+ * ogg_packet_read_pages:
+ * @packet: An initialized #ogg_packet to save the packet into
+ * @reader: The state of the logical bitstream being read
+ * @source: Function to get the next page of the logical bitstream
+ * @user: Data to pass to @source
+ *
+ * Read the next packet of a logical bitstream whose pages come from
+ * somewhere other than a single #ogg_stream, such as an #ogg_demux. The
+ * packet is only valid until the next call with the same @reader; otherwise
+ * this works like ogg_packet_read().
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM if there are no more packets,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+int ogg_packet_read_pages(ogg_packet *packet, ogg_packet_reader *reader, ogg_page_source_func source, void *user);
+
+/**
+ * ogg_packet_iovec:
+ * @packet: An #ogg_packet returned by ogg_packet_read()
+ * @iov: Array to fill with the slices of the packet
+ * @iovcnt: The number of entries available in @iov
+ *
+ * Describe the packet data as a list of slices, suitable for writev().
+ *
+ * Returns: The number of slices in the packet, which may be more than
+ * @iovcnt, in which case only the first @iovcnt were filled in
+ */
+size_t ogg_packet_iovec(const ogg_packet *packet, struct iovec *iov, size_t iovcnt);
+
+/**
+ * ogg_packet_flatten:
+ * @packet: An #ogg_packet returned by ogg_packet_read()
+ * @buffer: A buffer of at least #ogg_packet.data_len bytes
+ *
+ * Copy the packet data into a single contiguous buffer
+ */
+void ogg_packet_flatten(const ogg_packet *packet, uint8_t *buffer);
+
+/**
+ * ogg_packet_paginate:
+ * @data: The packet data
+ * @len: The number of bytes in @data
+ * @granule_pos: The granule position of the page the packet ends on
+ * @serial: The serial number of the logical bitstream
+ * @seq: The page counter for the first page
+ * @pages: Array to fill with the pages of the packet
+ * @count: The number of entries available in @pages
+ *
+ * Split a packet over as many pages of its own as it needs. The pages
+ * borrow their data from @data, which must stay valid while they are used;
+ * nothing is copied. Only the page headers and checksums are left to be
+ * built when the pages are written.
+ *
+ * Returns: The number of pages for the packet, which may be more than
+ * @count, in which case only the first @count were filled in
+ */
+size_t ogg_packet_paginate(
+	const uint8_t *data,
+	size_t len,
+	uint64_t granule_pos,
+	uint32_t serial,
+	uint32_t seq,
+	ogg_page *pages,
+	size_t count);
+
+/**
+ * ogg_packet_write:
+ * @data: The packet data
+ * @len: The number of bytes in @data
+ * @granule_pos: The granule position of the page the packet ends on
+ * @serial: The serial number of the logical bitstream
+ * @seq: The page counter for the first page, which is updated to the page
+ *   counter following the last page if they were all written
+ * @stream: #ogg_stream to write the pages to
+ *
+ * Write a packet on pages of its own, split over as many pages as it needs
+ * with ogg_packet_paginate(). Only the page headers are built; the page data
+ * is written from @data without being copied. Writing stops at the first
+ * error.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_packet_write(
+	const uint8_t *data,
+	size_t len,
+	uint64_t granule_pos,
+	uint32_t serial,
+	uint32_t *seq,
+	ogg_stream *stream);
+
+/**
+ * ogg_packet_rewrite_pages:
+ * @pages: The pages that a packet was read from, in order, as returned by
+ *   ogg_page_read() with their offsets recorded
+ * @count: The number of entries in @pages
+ * @data: The new contents of the packet
+ * @len: The number of bytes in @data
+ * @stream: #ogg_stream supporting positional reads and writes, containing
+ *   @pages
+ *
+ * Replace a packet in place, reusing the page headers it was stored in.
+ * This is only possible if the new packet has exactly the same size as the
+ * old one, and the pages contain nothing but the packet. If the pages are
+ * contiguous, they are written with a single positional write.
+ *
+ * Returns: 0 on success, %OGG_BAD_SIZE if the new packet does not fit in
+ * the old pages (in which case nothing was written), otherwise a value from
+ * #ogg_error_codes and #ogg_error will contain a message
+ */
+int ogg_packet_rewrite_pages(
+	const ogg_page *pages,
+	size_t count,
+	const uint8_t *data,
+	size_t len,
+	ogg_stream *stream);
+
+/**
+ * ogg_stream_copy_pages:
+ * @from: #ogg_stream to copy pages from, from its current position
+ * @to: #ogg_stream to write the pages to
+ * @serial: The logical bitstream to renumber
+ * @seq_delta: The amount to add to the page counter of each page of @serial
+ *
+ * Copy the remaining pages of a stream, renumbering the pages of one logical
+ * bitstream on the way. Only the page headers are changed: checksums are
+ * patched with ogg_page_header_set_seq(), so the page data is neither
+ * checksummed nor, if @from supports mapping, copied into a buffer.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_stream_copy_pages(ogg_stream *from, ogg_stream *to, uint32_t serial, int32_t seq_delta);
+
+/**
+ * ogg_stream_new:
+ *
+ * Allocate an #ogg_stream for a backend implementation, which must fill in
+ * #ogg_stream.io and #ogg_stream.priv
+ *
+ * Returns: A newly allocated #ogg_stream
+ */
+ogg_stream *ogg_stream_new(void);
+
+/**
+ * ogg_stream_free:
+ * @stream: The #ogg_stream to free
+ *
+ * Free an #ogg_stream allocated with ogg_stream_new(). Backends call this
+ * from their close function after releasing their own resources.
+ */
+void ogg_stream_free(ogg_stream *stream);
+
 /**
  * ogg_stream_file_open_read:
  * @filename: The path to a local ogg file
@@ -201,6 +866,19 @@ ogg_stream *ogg_stream_file_open_read(const char *filename);
  */
 ogg_stream *ogg_stream_file_open(const char *filename);
 
+/**
+ * ogg_stream_file_create:
+ * @filename: The path to a local ogg file
+ *
+ * Create a local file, or empty an existing one, for writing with the ogg
+ * packet api
+ *
+ * Returns: A newly allocated #ogg_stream, which must be freed with
+ * ogg_stream_file_close() or %NULL on error, in which case #ogg_error will
+ * have a message.
+ */
+ogg_stream *ogg_stream_file_create(const char *filename);
+
 /**
  * ogg_stream_file_close:
  * @stream: The #ogg_stream to close and free
@@ -210,4 +888,93 @@ ogg_stream *ogg_stream_file_open(const char *filename);
  */
 void ogg_stream_file_close(ogg_stream *stream);
 
+/**
+ * ogg_stream_fd_open:
+ * @filename: The path to a local ogg file
+ * @writable: Whether to open the file for writing as well as reading
+ *
+ * Open a local file with a raw file descriptor. The stream supports
+ * positional reads and writes, which may be used from several threads at
+ * once to work on different parts of the file.
+ *
+ * Returns: A newly allocated #ogg_stream which must be freed with
+ * ogg_stream_close(), or %NULL on an error - in which case #ogg_error
+ * will have a message.
+ */
+ogg_stream *ogg_stream_fd_open(const char *filename, bool writable);
+
+/**
+ * ogg_stream_fd_new:
+ * @fd: An open file descriptor for a seekable file
+ *
+ * Create a stream like ogg_stream_fd_open() for a file that is already
+ * open. The stream takes ownership of @fd, and closes it when it is closed.
+ * It starts at offset 0, whatever the file offset of @fd.
+ *
+ * Returns: A newly allocated #ogg_stream which must be freed with
+ * ogg_stream_close()
+ */
+ogg_stream *ogg_stream_fd_new(int fd);
+
+/**
+ * ogg_stream_mmap_open_read:
+ * @filename: The path to a local ogg file
+ *
+ * Open a local file in read-only mode by mapping it into memory. Pages read
+ * from this stream borrow their data from the mapping instead of copying it.
+ *
+ * Returns: A newly allocated #ogg_stream which must be freed with
+ * ogg_stream_close(), or %NULL on an error - in which case #ogg_error
+ * will have a message.
+ */
+ogg_stream *ogg_stream_mmap_open_read(const char *filename);
+
+/**
+ * ogg_stream_pipe_open:
+ * @fd: A readable file descriptor, such as a pipe or standard input
+ *
+ * Open a stream that reads from a non-seekable source through a ring
+ * buffer. Offsets are counted from the first byte read from @fd; seeking is
+ * possible forwards, or backwards by up to one page. The stream resyncs to
+ * the next capture pattern when it finds a corrupt page. @fd is not closed by
+ * ogg_stream_close().
+ *
+ * Returns: A newly allocated #ogg_stream which must be freed with
+ * ogg_stream_close()
+ */
+ogg_stream *ogg_stream_pipe_open(int fd);
+
+/**
+ * ogg_stream_resync:
+ * @stream: An #ogg_stream
+ *
+ * Skip forward to the next Ogg capture pattern at or after the current
+ * position. Streams with #ogg_stream.resync set do this automatically when
+ * ogg_page_read() or ogg_packet_read() find a corrupt page.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM if no capture pattern was found,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+int ogg_stream_resync(ogg_stream *stream);
+
+/**
+ * ogg_stream_set_pool:
+ * @stream: An #ogg_stream
+ * @pool: An #ogg_page_pool, or %NULL to allocate every page separately
+ *
+ * Make pages read from @stream take their data buffers from @pool. This has
+ * no effect on streams that lend out their data without copying.
+ */
+void ogg_stream_set_pool(ogg_stream *stream, ogg_page_pool *pool);
+
+/**
+ * ogg_stream_close:
+ * @stream: The #ogg_stream to close and free
+ *
+ * Close an ogg stream opened with any of the ogg_stream open functions and
+ * free allocated memory
+ */
+void ogg_stream_close(ogg_stream *stream);
+
 #endif
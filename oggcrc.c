@@ -0,0 +1,345 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "oggcrc.h"
+
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OGG_CRC_HAVE_CLMUL 1
+#include <immintrin.h>
+#endif
+
+/* The Ogg CRC32 polynomial, without the implicit x^32 term */
+#define OGG_CRC_POLY 0x04c11db7
+
+/* Lookup table for the Ogg page CRC32 verification */
+static const uint32_t crc_lookup[256]={
+	0x00000000,0x04c11db7,0x09823b6e,0x0d4326d9,
+	0x130476dc,0x17c56b6b,0x1a864db2,0x1e475005,
+	0x2608edb8,0x22c9f00f,0x2f8ad6d6,0x2b4bcb61,
+	0x350c9b64,0x31cd86d3,0x3c8ea00a,0x384fbdbd,
+	0x4c11db70,0x48d0c6c7,0x4593e01e,0x4152fda9,
+	0x5f15adac,0x5bd4b01b,0x569796c2,0x52568b75,
+	0x6a1936c8,0x6ed82b7f,0x639b0da6,0x675a1011,
+	0x791d4014,0x7ddc5da3,0x709f7b7a,0x745e66cd,
+	0x9823b6e0,0x9ce2ab57,0x91a18d8e,0x95609039,
+	0x8b27c03c,0x8fe6dd8b,0x82a5fb52,0x8664e6e5,
+	0xbe2b5b58,0xbaea46ef,0xb7a96036,0xb3687d81,
+	0xad2f2d84,0xa9ee3033,0xa4ad16ea,0xa06c0b5d,
+	0xd4326d90,0xd0f37027,0xddb056fe,0xd9714b49,
+	0xc7361b4c,0xc3f706fb,0xceb42022,0xca753d95,
+	0xf23a8028,0xf6fb9d9f,0xfbb8bb46,0xff79a6f1,
+	0xe13ef6f4,0xe5ffeb43,0xe8bccd9a,0xec7dd02d,
+	0x34867077,0x30476dc0,0x3d044b19,0x39c556ae,
+	0x278206ab,0x23431b1c,0x2e003dc5,0x2ac12072,
+	0x128e9dcf,0x164f8078,0x1b0ca6a1,0x1fcdbb16,
+	0x018aeb13,0x054bf6a4,0x0808d07d,0x0cc9cdca,
+	0x7897ab07,0x7c56b6b0,0x71159069,0x75d48dde,
+	0x6b93dddb,0x6f52c06c,0x6211e6b5,0x66d0fb02,
+	0x5e9f46bf,0x5a5e5b08,0x571d7dd1,0x53dc6066,
+	0x4d9b3063,0x495a2dd4,0x44190b0d,0x40d816ba,
+	0xaca5c697,0xa864db20,0xa527fdf9,0xa1e6e04e,
+	0xbfa1b04b,0xbb60adfc,0xb6238b25,0xb2e29692,
+	0x8aad2b2f,0x8e6c3698,0x832f1041,0x87ee0df6,
+	0x99a95df3,0x9d684044,0x902b669d,0x94ea7b2a,
+	0xe0b41de7,0xe4750050,0xe9362689,0xedf73b3e,
+	0xf3b06b3b,0xf771768c,0xfa325055,0xfef34de2,
+	0xc6bcf05f,0xc27dede8,0xcf3ecb31,0xcbffd686,
+	0xd5b88683,0xd1799b34,0xdc3abded,0xd8fba05a,
+	0x690ce0ee,0x6dcdfd59,0x608edb80,0x644fc637,
+	0x7a089632,0x7ec98b85,0x738aad5c,0x774bb0eb,
+	0x4f040d56,0x4bc510e1,0x46863638,0x42472b8f,
+	0x5c007b8a,0x58c1663d,0x558240e4,0x51435d53,
+	0x251d3b9e,0x21dc2629,0x2c9f00f0,0x285e1d47,
+	0x36194d42,0x32d850f5,0x3f9b762c,0x3b5a6b9b,
+	0x0315d626,0x07d4cb91,0x0a97ed48,0x0e56f0ff,
+	0x1011a0fa,0x14d0bd4d,0x19939b94,0x1d528623,
+	0xf12f560e,0xf5ee4bb9,0xf8ad6d60,0xfc6c70d7,
+	0xe22b20d2,0xe6ea3d65,0xeba91bbc,0xef68060b,
+	0xd727bbb6,0xd3e6a601,0xdea580d8,0xda649d6f,
+	0xc423cd6a,0xc0e2d0dd,0xcda1f604,0xc960ebb3,
+	0xbd3e8d7e,0xb9ff90c9,0xb4bcb610,0xb07daba7,
+	0xae3afba2,0xaafbe615,0xa7b8c0cc,0xa379dd7b,
+	0x9b3660c6,0x9ff77d71,0x92b45ba8,0x9675461f,
+	0x8832161a,0x8cf30bad,0x81b02d74,0x857130c3,
+	0x5d8a9099,0x594b8d2e,0x5408abf7,0x50c9b640,
+	0x4e8ee645,0x4a4ffbf2,0x470cdd2b,0x43cdc09c,
+	0x7b827d21,0x7f436096,0x7200464f,0x76c15bf8,
+	0x68860bfd,0x6c47164a,0x61043093,0x65c52d24,
+	0x119b4be9,0x155a565e,0x18197087,0x1cd86d30,
+	0x029f3d35,0x065e2082,0x0b1d065b,0x0fdc1bec,
+	0x3793a651,0x3352bbe6,0x3e119d3f,0x3ad08088,
+	0x2497d08d,0x2056cd3a,0x2d15ebe3,0x29d4f654,
+	0xc5a92679,0xc1683bce,0xcc2b1d17,0xc8ea00a0,
+	0xd6ad50a5,0xd26c4d12,0xdf2f6bcb,0xdbee767c,
+	0xe3a1cbc1,0xe760d676,0xea23f0af,0xeee2ed18,
+	0xf0a5bd1d,0xf464a0aa,0xf9278673,0xfde69bc4,
+	0x89b8fd09,0x8d79e0be,0x803ac667,0x84fbdbd0,
+	0x9abc8bd5,0x9e7d9662,0x933eb0bb,0x97ffad0c,
+	0xafb010b1,0xab710d06,0xa6322bdf,0xa2f33668,
+	0xbcb4666d,0xb8757bda,0xb5365d03,0xb1f740b4
+};
+
+/* Slicing tables: crc_tables[k][i] is the checksum of byte i followed by
+ * k zero bytes. crc_tables[0] is a copy of crc_lookup. */
+static uint32_t crc_tables[16][256];
+
+/* Folding constants for the carry-less multiply kernel */
+static uint64_t crc_fold_512[2];
+static uint64_t crc_fold_384[2];
+static uint64_t crc_fold_256[2];
+static uint64_t crc_fold_128[2];
+
+/* crc_shift_powers[k] is x^(8*2^k) mod P, for appending 2^k zero bytes */
+static uint32_t crc_shift_powers[64];
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc_kernel)(uint32_t crc, const uint8_t *data, size_t len);
+
+/* Compute x^n mod P */
+static uint32_t ogg_crc_xpow(unsigned int n) {
+	uint32_t r = 1;
+	
+	while (n--)
+		r = (r << 1) ^ ((r & 0x80000000) ? OGG_CRC_POLY : 0);
+	
+	return r;
+}
+
+/* Multiply two polynomials modulo P */
+static uint32_t ogg_crc_multiply(uint32_t a, uint32_t b) {
+	uint32_t r = 0;
+	int i;
+	
+	for (i = 31; i >= 0; i--) {
+		r = (r << 1) ^ ((r & 0x80000000) ? OGG_CRC_POLY : 0);
+		if (b & (UINT32_C(1) << i))
+			r ^= a;
+	}
+	
+	return r;
+}
+
+/* Folding by n bits multiplies the high and low qwords of a 128-bit block by
+ * x^(n+64) and x^n respectively */
+static void ogg_crc_fold_constants(uint64_t k[2], unsigned int n) {
+	k[0] = ogg_crc_xpow(n);
+	k[1] = ogg_crc_xpow(n + 64);
+}
+
+static void ogg_crc_init(void) {
+	int i, k;
+	
+	for (i = 0; i < 256; i++)
+		crc_tables[0][i] = crc_lookup[i];
+	for (k = 1; k < 16; k++) {
+		for (i = 0; i < 256; i++) {
+			uint32_t prev = crc_tables[k - 1][i];
+			crc_tables[k][i] = (prev << 8) ^ crc_lookup[prev >> 24];
+		}
+	}
+	
+	ogg_crc_fold_constants(crc_fold_512, 512);
+	ogg_crc_fold_constants(crc_fold_384, 384);
+	ogg_crc_fold_constants(crc_fold_256, 256);
+	ogg_crc_fold_constants(crc_fold_128, 128);
+	
+	crc_shift_powers[0] = ogg_crc_xpow(8);
+	for (k = 1; k < 64; k++)
+		crc_shift_powers[k] = ogg_crc_multiply(crc_shift_powers[k - 1], crc_shift_powers[k - 1]);
+	
+	if (ogg_crc_clmul_supported())
+		crc_kernel = ogg_crc_update_clmul;
+	else
+		crc_kernel = ogg_crc_update_slice16;
+}
+
+uint32_t ogg_crc_update(uint32_t crc, const uint8_t *data, size_t len) {
+	pthread_once(&crc_once, ogg_crc_init);
+	return crc_kernel(crc, data, len);
+}
+
+uint32_t ogg_crc_shift(uint32_t crc, uint64_t len) {
+	int k;
+	
+	pthread_once(&crc_once, ogg_crc_init);
+	
+	/* Multiply by x^(8*len), one power of two at a time */
+	for (k = 0; len; k++, len >>= 1) {
+		if (len & 1)
+			crc = ogg_crc_multiply(crc, crc_shift_powers[k]);
+	}
+	
+	return crc;
+}
+
+uint32_t ogg_crc_update_bytewise(uint32_t crc, const uint8_t *data, size_t len) {
+	size_t i;
+	
+	for (i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc_lookup[((crc >> 24) & 0xff) ^ data[i]];
+	
+	return crc;
+}
+
+static inline uint32_t read_be32(const uint8_t *in) {
+	return (((uint32_t) in[0]) << 24) |
+	       (((uint32_t) in[1]) << 16) |
+	       (((uint32_t) in[2]) << 8) |
+	       ((uint32_t) in[3]);
+}
+
+uint32_t ogg_crc_update_slice8(uint32_t crc, const uint8_t *data, size_t len) {
+	pthread_once(&crc_once, ogg_crc_init);
+	
+	while (len >= 8) {
+		uint32_t a = crc ^ read_be32(data);
+		
+		crc = crc_tables[7][a >> 24] ^
+		      crc_tables[6][(a >> 16) & 0xff] ^
+		      crc_tables[5][(a >> 8) & 0xff] ^
+		      crc_tables[4][a & 0xff] ^
+		      crc_tables[3][data[4]] ^
+		      crc_tables[2][data[5]] ^
+		      crc_tables[1][data[6]] ^
+		      crc_tables[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+	
+	return ogg_crc_update_bytewise(crc, data, len);
+}
+
+uint32_t ogg_crc_update_slice16(uint32_t crc, const uint8_t *data, size_t len) {
+	pthread_once(&crc_once, ogg_crc_init);
+	
+	while (len >= 16) {
+		uint32_t a = crc ^ read_be32(data);
+		
+		crc = crc_tables[15][a >> 24] ^
+		      crc_tables[14][(a >> 16) & 0xff] ^
+		      crc_tables[13][(a >> 8) & 0xff] ^
+		      crc_tables[12][a & 0xff] ^
+		      crc_tables[11][data[4]] ^
+		      crc_tables[10][data[5]] ^
+		      crc_tables[9][data[6]] ^
+		      crc_tables[8][data[7]] ^
+		      crc_tables[7][data[8]] ^
+		      crc_tables[6][data[9]] ^
+		      crc_tables[5][data[10]] ^
+		      crc_tables[4][data[11]] ^
+		      crc_tables[3][data[12]] ^
+		      crc_tables[2][data[13]] ^
+		      crc_tables[1][data[14]] ^
+		      crc_tables[0][data[15]];
+		data += 16;
+		len -= 16;
+	}
+	
+	return ogg_crc_update_bytewise(crc, data, len);
+}
+
+#ifdef OGG_CRC_HAVE_CLMUL
+
+bool ogg_crc_clmul_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+/* Load 16 bytes as a 128-bit polynomial, with the first byte holding the
+ * highest-order coefficients (the CRC is not reflected) */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i ogg_crc_load(const uint8_t *data) {
+	const __m128i bswap = _mm_set_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), bswap);
+}
+
+/* Multiply a 128-bit block by x^n, reducing it to something congruent mod P
+ * that still fits in 128 bits */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i ogg_crc_fold(__m128i x, __m128i k) {
+	return _mm_xor_si128(
+		_mm_clmulepi64_si128(x, k, 0x11),
+		_mm_clmulepi64_si128(x, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+uint32_t ogg_crc_update_clmul(uint32_t crc, const uint8_t *data, size_t len) {
+	const __m128i bswap = _mm_set_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i x0, x1, x2, x3, k;
+	uint8_t tail[16];
+	
+	pthread_once(&crc_once, ogg_crc_init);
+	
+	/* Short buffers aren't worth the setup */
+	if (len < 128)
+		return ogg_crc_update_slice16(crc, data, len);
+	
+	/* The incoming CRC is equivalent to xoring it into the first 4 bytes */
+	x0 = _mm_xor_si128(ogg_crc_load(data), _mm_set_epi32(crc, 0, 0, 0));
+	x1 = ogg_crc_load(data + 16);
+	x2 = ogg_crc_load(data + 32);
+	x3 = ogg_crc_load(data + 48);
+	data += 64;
+	len -= 64;
+	
+	/* Fold four independent lanes forward by 512 bits per step */
+	k = _mm_loadu_si128((const __m128i *) crc_fold_512);
+	while (len >= 64) {
+		x0 = _mm_xor_si128(ogg_crc_fold(x0, k), ogg_crc_load(data));
+		x1 = _mm_xor_si128(ogg_crc_fold(x1, k), ogg_crc_load(data + 16));
+		x2 = _mm_xor_si128(ogg_crc_fold(x2, k), ogg_crc_load(data + 32));
+		x3 = _mm_xor_si128(ogg_crc_fold(x3, k), ogg_crc_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+	
+	/* Combine the lanes into one */
+	x3 = _mm_xor_si128(x3, ogg_crc_fold(x0,
+		_mm_loadu_si128((const __m128i *) crc_fold_384)));
+	x3 = _mm_xor_si128(x3, ogg_crc_fold(x1,
+		_mm_loadu_si128((const __m128i *) crc_fold_256)));
+	k = _mm_loadu_si128((const __m128i *) crc_fold_128);
+	x3 = _mm_xor_si128(x3, ogg_crc_fold(x2, k));
+	
+	while (len >= 16) {
+		x3 = _mm_xor_si128(ogg_crc_fold(x3, k), ogg_crc_load(data));
+		data += 16;
+		len -= 16;
+	}
+	
+	/* The folded block has the same remainder as everything before it, so
+	 * finish with the table kernel over it and the remaining bytes */
+	_mm_storeu_si128((__m128i *) tail, _mm_shuffle_epi8(x3, bswap));
+	crc = ogg_crc_update_slice16(0, tail, sizeof (tail));
+	
+	return ogg_crc_update_slice16(crc, data, len);
+}
+
+#else
+
+bool ogg_crc_clmul_supported(void) {
+	return false;
+}
+
+uint32_t ogg_crc_update_clmul(uint32_t crc, const uint8_t *data, size_t len) {
+	return ogg_crc_update_slice16(crc, data, len);
+}
+
+#endif
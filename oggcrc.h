@@ -0,0 +1,100 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:oggcrc
+ * @short_description: Ogg page checksum kernels
+ * @title: Ogg CRC
+ *
+ * The Ogg page checksum is a non-reflected CRC32 with the polynomial
+ * 0x04c11db7, a zero initial value and no final xor. Several implementations
+ * are provided; ogg_crc_update() picks the fastest one supported by the CPU
+ * the first time it is called. The individual kernels are exported so that
+ * they can be checked against each other.
+ */
+
+#ifndef OGGCRC_H
+#define OGGCRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * ogg_crc_update:
+ * @crc: The checksum of the data preceding @data, or 0 to start a new one
+ * @data: The data to add to the checksum
+ * @len: The number of bytes in @data
+ *
+ * Continue an Ogg CRC32 checksum with the best available kernel
+ *
+ * Returns: The updated checksum
+ */
+uint32_t ogg_crc_update(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * ogg_crc_shift:
+ * @crc: The checksum of some data
+ * @len: A number of zero bytes
+ *
+ * Find the checksum of the data followed by @len zero bytes, in time
+ * logarithmic in @len. Since the checksum is linear, this is what's needed
+ * to work out how a change in one part of a page alters its checksum,
+ * without reading the rest of the page.
+ *
+ * Returns: The checksum of the extended data
+ */
+uint32_t ogg_crc_shift(uint32_t crc, uint64_t len);
+
+/**
+ * ogg_crc_update_bytewise:
+ *
+ * Reference kernel for ogg_crc_update(), processing one byte at a time
+ */
+uint32_t ogg_crc_update_bytewise(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * ogg_crc_update_slice8:
+ *
+ * Kernel for ogg_crc_update() processing 8 bytes per step with 8 tables
+ */
+uint32_t ogg_crc_update_slice8(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * ogg_crc_update_slice16:
+ *
+ * Kernel for ogg_crc_update() processing 16 bytes per step with 16 tables
+ */
+uint32_t ogg_crc_update_slice16(uint32_t crc, const uint8_t *data, size_t len);
+
+/**
+ * ogg_crc_clmul_supported:
+ *
+ * Check whether ogg_crc_update_clmul() can be used on this CPU
+ *
+ * Returns: %true if the carry-less multiply kernel is available
+ */
+bool ogg_crc_clmul_supported(void);
+
+/**
+ * ogg_crc_update_clmul:
+ *
+ * Kernel for ogg_crc_update() folding 64 bytes per step with carry-less
+ * multiplication (PCLMULQDQ). Must only be called if
+ * ogg_crc_clmul_supported() returns %true.
+ */
+uint32_t ogg_crc_update_clmul(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,238 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "oggdemux.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct ogg_demux_page {
+	ogg_page page;
+	uint8_t lacing[OGG_PAGE_MAX_SEGMENTS];
+	uint8_t segments;
+	struct ogg_demux_page *next;
+};
+
+void ogg_demux_init(ogg_demux *demux, ogg_stream *stream) {
+	demux->stream = stream;
+	demux->link = 0;
+	demux->link_data = false;
+	demux->discard = false;
+	demux->streams = NULL;
+}
+
+void ogg_demux_clear(ogg_demux *demux) {
+	ogg_demux_stream *logical = demux->streams;
+	
+	while (logical) {
+		ogg_demux_stream *next = logical->next;
+		ogg_demux_page *queued = logical->head;
+		
+		while (queued) {
+			ogg_demux_page *next_page = queued->next;
+			ogg_page_clear(&queued->page);
+			free(queued);
+			queued = next_page;
+		}
+		ogg_packet_reader_clear(&logical->reader);
+		free(logical);
+		
+		logical = next;
+	}
+	
+	demux->streams = NULL;
+}
+
+/* Find a logical stream of the current link */
+static ogg_demux_stream *ogg_demux_find(ogg_demux *demux, uint32_t serial) {
+	ogg_demux_stream *logical;
+	
+	for (logical = demux->streams; logical; logical = logical->next) {
+		if (logical->link == demux->link && logical->serial == serial)
+			return logical;
+	}
+	
+	return NULL;
+}
+
+/* Check whether every stream of the current link has ended */
+static bool ogg_demux_link_ended(ogg_demux *demux) {
+	ogg_demux_stream *logical;
+	bool any = false;
+	
+	for (logical = demux->streams; logical; logical = logical->next) {
+		if (logical->link != demux->link)
+			continue;
+		if (!logical->eos)
+			return false;
+		any = true;
+	}
+	
+	return any;
+}
+
+/* Read the next page in file order, with its segment table */
+static int ogg_demux_next(
+	ogg_demux *demux,
+	ogg_page *page,
+	uint8_t *lacing,
+	uint8_t *segments,
+	ogg_demux_stream **logical
+) {
+	ogg_demux_stream *found;
+	int err;
+	
+	err = ogg_page_read_lacing(page, demux->stream, lacing, segments);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	if (page->type & OGG_PAGE_TYPE_BOS) {
+		/* A BOS after the end of every stream starts a new chain link */
+		if (ogg_demux_link_ended(demux)) {
+			demux->link++;
+			demux->link_data = false;
+		} else if (demux->link_data) {
+			ogg_error = "Stream starts after the data of other streams";
+			err = OGG_INVALID;
+			goto error;
+		}
+		
+		if (ogg_demux_find(demux, page->serial)) {
+			ogg_error = "Duplicate stream serial number";
+			err = OGG_INVALID;
+			goto error;
+		}
+		
+		found = calloc(1, sizeof (ogg_demux_stream));
+		found->serial = page->serial;
+		found->link = demux->link;
+		found->discard = demux->discard;
+		ogg_packet_reader_init(&found->reader);
+		found->next = demux->streams;
+		demux->streams = found;
+	} else {
+		found = ogg_demux_find(demux, page->serial);
+		if (!found) {
+			ogg_error = "Page belongs to an unknown stream";
+			err = OGG_MULTI_STREAM;
+			goto error;
+		}
+		demux->link_data = true;
+	}
+	
+	if (page->type & OGG_PAGE_TYPE_EOS)
+		found->eos = true;
+	
+	*logical = found;
+	return OGG_SUCCESS;
+
+error:
+	ogg_page_clear(page);
+	return err;
+}
+
+int ogg_demux_read_page(ogg_demux *demux, ogg_page *page, ogg_demux_stream **logical) {
+	return ogg_demux_next(demux, page, NULL, NULL, logical);
+}
+
+/* Get the next page of one logical stream, with its segment table */
+static int ogg_demux_stream_next(
+	ogg_demux *demux,
+	ogg_demux_stream *logical,
+	ogg_page *page,
+	uint8_t *lacing,
+	uint8_t *segments
+) {
+	uint8_t other_lacing[OGG_PAGE_MAX_SEGMENTS];
+	uint8_t other_segments;
+	ogg_demux_stream *other;
+	ogg_demux_page *queued;
+	int err;
+	
+	/* Hand out pages that were read earlier first */
+	if (logical->head) {
+		queued = logical->head;
+		logical->head = queued->next;
+		if (!logical->head)
+			logical->tail = NULL;
+		logical->queued--;
+		
+		*page = queued->page;
+		if (lacing) {
+			memcpy(lacing, queued->lacing, queued->segments);
+			*segments = queued->segments;
+		}
+		free(queued);
+		return OGG_SUCCESS;
+	}
+	
+	for (;;) {
+		if (logical->eos) {
+			ogg_error = "End of stream";
+			return OGG_END_OF_STREAM;
+		}
+		
+		err = ogg_demux_next(demux, page, other_lacing, &other_segments, &other);
+		if (err != OGG_SUCCESS)
+			return err;
+		if (other == logical) {
+			if (lacing) {
+				memcpy(lacing, other_lacing, other_segments);
+				*segments = other_segments;
+			}
+			return OGG_SUCCESS;
+		}
+		
+		if (other->discard) {
+			ogg_page_clear(page);
+			continue;
+		}
+		
+		queued = malloc(sizeof (ogg_demux_page));
+		queued->page = *page;
+		memcpy(queued->lacing, other_lacing, other_segments);
+		queued->segments = other_segments;
+		queued->next = NULL;
+		if (other->tail)
+			other->tail->next = queued;
+		else
+			other->head = queued;
+		other->tail = queued;
+		other->queued++;
+		ogg_page_init(page);
+	}
+}
+
+int ogg_demux_stream_read_page(ogg_demux *demux, ogg_demux_stream *logical, ogg_page *page) {
+	return ogg_demux_stream_next(demux, logical, page, NULL, NULL);
+}
+
+/* The logical stream to read pages of, for ogg_packet_read_pages() */
+typedef struct ogg_demux_source {
+	ogg_demux *demux;
+	ogg_demux_stream *logical;
+} ogg_demux_source;
+
+static int ogg_demux_packet_source(void *user, ogg_page *page, uint8_t *lacing, uint8_t *segments) {
+	ogg_demux_source *source = user;
+	
+	return ogg_demux_stream_next(source->demux, source->logical, page, lacing, segments);
+}
+
+int ogg_demux_stream_read_packet(ogg_demux *demux, ogg_demux_stream *logical, ogg_packet *packet) {
+	ogg_demux_source source = { demux, logical };
+	
+	return ogg_packet_read_pages(packet, &logical->reader, ogg_demux_packet_source, &source);
+}
@@ -0,0 +1,142 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:oggdemux
+ * @short_description: Routing of Ogg pages to logical bitstreams
+ * @title: Ogg demux
+ *
+ * Splits a physical Ogg stream into its logical bitstreams in a single pass.
+ * Multiplexed streams are told apart by serial number, and chained streams
+ * (a new group of BOS pages after every stream of the previous group has
+ * ended) are numbered as consecutive links, so that a serial number reused in
+ * a later link is treated as a new logical stream.
+ */
+
+#ifndef OGGDEMUX_H
+#define OGGDEMUX_H
+
+#include "ogg.h"
+
+typedef struct ogg_demux_page ogg_demux_page;
+
+/**
+ * ogg_demux_stream:
+ * @serial: Logical bitstream identification serial number
+ * @link: The index of the chain link containing this stream, from 0
+ * @eos: Whether the last page of the stream has been read
+ * @discard: Whether pages read ahead for other streams are dropped instead of
+ *   being queued for this one
+ * @queued: The number of pages waiting in the queue
+ * @reader: The state of ogg_demux_stream_read_packet()
+ *
+ * A logical bitstream found by an #ogg_demux
+ */
+typedef struct ogg_demux_stream {
+	uint32_t serial;
+	unsigned int link;
+	bool eos;
+	bool discard;
+	size_t queued;
+	ogg_demux_page *head;
+	ogg_demux_page *tail;
+	struct ogg_demux_stream *next;
+	ogg_packet_reader reader;
+} ogg_demux_stream;
+
+/**
+ * ogg_demux:
+ * @discard: Whether logical streams found from now on start out set to
+ *   discard, for readers that only want the streams they pick
+ *
+ * Demultiplexer state for one physical #ogg_stream
+ */
+typedef struct ogg_demux {
+	ogg_stream *stream;
+	unsigned int link;
+	bool link_data;
+	bool discard;
+	ogg_demux_stream *streams;
+} ogg_demux;
+
+/**
+ * ogg_demux_init:
+ * @demux: An uninitialized #ogg_demux structure
+ * @stream: The #ogg_stream to read pages from
+ *
+ * Initialize a demultiplexer reading from the current position of @stream
+ */
+void ogg_demux_init(ogg_demux *demux, ogg_stream *stream);
+
+/**
+ * ogg_demux_clear:
+ * @demux: A previously-used #ogg_demux structure
+ *
+ * Free all logical streams and queued pages of the demultiplexer
+ */
+void ogg_demux_clear(ogg_demux *demux);
+
+/**
+ * ogg_demux_read_page:
+ * @demux: An #ogg_demux
+ * @page: An initialized #ogg_page to save the page into
+ * @logical: Location to store the logical stream the page belongs to
+ *
+ * Read the next page from the physical stream, in file order, and find out
+ * which logical stream it belongs to. New logical streams are created for BOS
+ * pages. Pages already queued by ogg_demux_stream_read_page() are not
+ * returned again.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM at the end of the physical
+ * stream, otherwise a value from #ogg_error_codes and #ogg_error will contain
+ * a message
+ */
+int ogg_demux_read_page(ogg_demux *demux, ogg_page *page, ogg_demux_stream **logical);
+
+/**
+ * ogg_demux_stream_read_page:
+ * @demux: An #ogg_demux
+ * @logical: The logical stream to read a page of
+ * @page: An initialized #ogg_page to save the page into
+ *
+ * Get the next page of one logical stream. Pages of other logical streams
+ * that have to be read first are queued for them, unless they are set to
+ * discard.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM after the last page of @logical,
+ * otherwise a value from #ogg_error_codes and #ogg_error will contain a
+ * message
+ */
+int ogg_demux_stream_read_page(ogg_demux *demux, ogg_demux_stream *logical, ogg_page *page);
+
+/**
+ * ogg_demux_stream_read_packet:
+ * @demux: An #ogg_demux
+ * @logical: The logical stream to read a packet of
+ * @packet: An initialized #ogg_packet to save the packet into
+ *
+ * Get the next packet of one logical stream, reading pages as with
+ * ogg_demux_stream_read_page(). The packet is only valid until the next call
+ * for the same @logical. Don't mix this with ogg_demux_stream_read_page() on
+ * the same logical stream, except to read pages that come before the first
+ * packet read.
+ *
+ * Returns: 0 on success, %OGG_END_OF_STREAM after the last packet of
+ * @logical, otherwise a value from #ogg_error_codes and #ogg_error will
+ * contain a message
+ */
+int ogg_demux_stream_read_packet(ogg_demux *demux, ogg_demux_stream *logical, ogg_packet *packet);
+
+#endif
@@ -0,0 +1,283 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "oggindex.h"
+#include "bits.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* The sidecar file starts with this, followed by the fixed header fields */
+static const uint8_t OGG_INDEX_MAGIC[] = {
+	0x4f, 0x67, 0x67, 0x49, 0x64, 0x78, 0x00, 0x01
+};
+
+/* Size of the sidecar file header, including the magic */
+#define OGG_INDEX_HEADER_SIZE 52
+
+/* Size of each entry in the sidecar file */
+#define OGG_INDEX_ENTRY_SIZE 16
+
+void ogg_index_init(ogg_index *index) {
+	memset(index, 0, sizeof (ogg_index));
+}
+
+void ogg_index_clear(ogg_index *index) {
+	free(index->entries);
+	ogg_index_init(index);
+}
+
+static void ogg_index_append(ogg_index *index, size_t *allocated, uint64_t granule_pos, off_t offset) {
+	if (index->count == *allocated) {
+		*allocated = *allocated ? *allocated * 2 : 256;
+		index->entries = realloc(index->entries, *allocated * sizeof (ogg_index_entry));
+	}
+	index->entries[index->count].granule_pos = granule_pos;
+	index->entries[index->count].offset = offset;
+	index->count++;
+}
+
+int ogg_index_build(ogg_index *index, ogg_stream *stream, uint32_t serial, uint64_t interval) {
+	ogg_page_info info;
+	size_t allocated = 0;
+	bool first = true;
+	int err;
+	
+	free(index->entries);
+	index->entries = NULL;
+	index->count = 0;
+	index->serial = serial;
+	
+	while ((err = ogg_page_read_info(&info, stream)) == OGG_SUCCESS) {
+		if (first) {
+			index->first_crc = info.crc;
+			first = false;
+		}
+		index->last_offset = info.offset;
+		index->last_crc = info.crc;
+		
+		if (info.serial != serial || info.granule_pos == OGG_GRANULE_POS_NO_PACKET)
+			continue;
+		if (index->count > 0 &&
+		    info.granule_pos < index->entries[index->count - 1].granule_pos + interval)
+			continue;
+		
+		ogg_index_append(index, &allocated, info.granule_pos, info.offset);
+	}
+	
+	if (err != OGG_END_OF_STREAM)
+		return err;
+	if (first) {
+		ogg_error = "Stream contains no pages";
+		return OGG_INVALID;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+off_t ogg_index_lookup(const ogg_index *index, uint64_t granule_pos) {
+	size_t low = 0, high = index->count;
+	
+	/* Find the first entry at or after the position... */
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (index->entries[mid].granule_pos < granule_pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	
+	/* ...then start at the indexed page before that, which ends before
+	 * the position. Its first packet may be continued from an earlier
+	 * page, so the caller has to skip that. */
+	if (low == 0)
+		return 0;
+	return index->entries[low - 1].offset;
+}
+
+int ogg_index_write(const ogg_index *index, const char *filename) {
+	uint8_t header[OGG_INDEX_HEADER_SIZE];
+	uint8_t entry[OGG_INDEX_ENTRY_SIZE];
+	FILE *file;
+	size_t i;
+	
+	memcpy(header, OGG_INDEX_MAGIC, sizeof (OGG_INDEX_MAGIC));
+	write_le64(&header[8], index->file_size);
+	write_le64(&header[16], index->mtime_ns);
+	write_le32(&header[24], index->serial);
+	write_le32(&header[28], index->first_crc);
+	write_le64(&header[32], index->last_offset);
+	write_le32(&header[40], index->last_crc);
+	write_le64(&header[44], index->count);
+	
+	file = fopen(filename, "wb");
+	if (!file) {
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	
+	fwrite(header, 1, sizeof (header), file);
+	for (i = 0; i < index->count; i++) {
+		write_le64(&entry[0], index->entries[i].granule_pos);
+		write_le64(&entry[8], index->entries[i].offset);
+		fwrite(entry, 1, sizeof (entry), file);
+	}
+	
+	if (ferror(file) | fclose(file)) {
+		ogg_error = "Error writing index file";
+		return OGG_INVALID;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+int ogg_index_read(ogg_index *index, const char *filename) {
+	uint8_t header[OGG_INDEX_HEADER_SIZE];
+	uint8_t entry[OGG_INDEX_ENTRY_SIZE];
+	struct stat st;
+	uint64_t count;
+	FILE *file;
+	size_t i;
+	
+	file = fopen(filename, "rb");
+	if (!file) {
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	
+	if (fread(header, 1, sizeof (header), file) < sizeof (header) ||
+	    memcmp(header, OGG_INDEX_MAGIC, sizeof (OGG_INDEX_MAGIC))) {
+		ogg_error = "Not an index file";
+		goto error;
+	}
+	
+	/* Don't trust the entry count further than the file size */
+	count = read_le64(&header[44]);
+	if (fstat(fileno(file), &st) < 0 ||
+	    count != (st.st_size - OGG_INDEX_HEADER_SIZE) / OGG_INDEX_ENTRY_SIZE) {
+		ogg_error = "Index file is truncated";
+		goto error;
+	}
+	
+	ogg_index_clear(index);
+	index->file_size = read_le64(&header[8]);
+	index->mtime_ns = read_le64(&header[16]);
+	index->serial = read_le32(&header[24]);
+	index->first_crc = read_le32(&header[28]);
+	index->last_offset = read_le64(&header[32]);
+	index->last_crc = read_le32(&header[40]);
+	index->count = count;
+	index->entries = malloc(count * sizeof (ogg_index_entry));
+	
+	for (i = 0; i < count; i++) {
+		if (fread(entry, 1, sizeof (entry), file) < sizeof (entry)) {
+			ogg_error = "Error reading index file";
+			ogg_index_clear(index);
+			goto error;
+		}
+		index->entries[i].granule_pos = read_le64(&entry[0]);
+		index->entries[i].offset = read_le64(&entry[8]);
+	}
+	
+	fclose(file);
+	return OGG_SUCCESS;
+
+error:
+	fclose(file);
+	return OGG_INVALID;
+}
+
+static int64_t ogg_index_mtime_ns(const struct stat *st) {
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+bool ogg_index_is_current(const ogg_index *index, const char *filename, ogg_stream *stream) {
+	ogg_page_info info;
+	struct stat st;
+	off_t saved;
+	bool current = false;
+	
+	if (stat(filename, &st) < 0)
+		return false;
+	if ((uint64_t) st.st_size != index->file_size ||
+	    ogg_index_mtime_ns(&st) != index->mtime_ns)
+		return false;
+	
+	saved = stream->io->tell(stream);
+	
+	if (stream->io->seek(stream, 0) ||
+	    ogg_page_read_info(&info, stream) != OGG_SUCCESS ||
+	    info.crc != index->first_crc)
+		goto done;
+	if (stream->io->seek(stream, index->last_offset) ||
+	    ogg_page_read_info(&info, stream) != OGG_SUCCESS ||
+	    info.crc != index->last_crc)
+		goto done;
+	current = true;
+
+done:
+	stream->io->seek(stream, saved);
+	return current;
+}
+
+int ogg_index_open(
+	ogg_index *index,
+	const char *filename,
+	ogg_stream *stream,
+	uint32_t serial,
+	uint64_t interval
+) {
+	struct stat st;
+	char *sidecar;
+	off_t saved;
+	int err;
+	
+	sidecar = malloc(strlen(filename) + sizeof (".idx"));
+	strcpy(sidecar, filename);
+	strcat(sidecar, ".idx");
+	
+	if (ogg_index_read(index, sidecar) == OGG_SUCCESS &&
+	    index->serial == serial &&
+	    ogg_index_is_current(index, filename, stream)) {
+		free(sidecar);
+		return OGG_SUCCESS;
+	}
+	
+	if (stat(filename, &st) < 0) {
+		ogg_error = strerror(errno);
+		free(sidecar);
+		return OGG_INVALID;
+	}
+	
+	saved = stream->io->tell(stream);
+	if (stream->io->seek(stream, 0)) {
+		ogg_error = "Error seeking to start of stream";
+		free(sidecar);
+		return OGG_INVALID;
+	}
+	err = ogg_index_build(index, stream, serial, interval);
+	stream->io->seek(stream, saved);
+	
+	if (err == OGG_SUCCESS) {
+		index->file_size = st.st_size;
+		index->mtime_ns = ogg_index_mtime_ns(&st);
+		ogg_index_write(index, sidecar);
+	}
+	
+	free(sidecar);
+	return err;
+}
@@ -0,0 +1,180 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:oggindex
+ * @short_description: Sidecar seek index for Ogg files
+ * @title: Ogg index
+ *
+ * A compact table mapping granule positions to page offsets for one logical
+ * bitstream, stored next to the media file (as "track.opus.idx"). It is built
+ * once with a header-only walk of the pages, and then lets any position be
+ * found with a single lookup. The index records the size and modification
+ * time of the file and the checksums of its first and last pages, so that a
+ * stale index is detected and rebuilt.
+ *
+ * The index is for programs that seek many times within a file. opustag and
+ * opusgain don't use it: they read each file from the start once, and they
+ * shouldn't leave sidecar files in a music library.
+ */
+
+#ifndef OGGINDEX_H
+#define OGGINDEX_H
+
+#include "ogg.h"
+
+/**
+ * ogg_index_entry:
+ * @granule_pos: The granule position of an indexed page
+ * @offset: The offset of that page from the start of the file
+ */
+typedef struct ogg_index_entry {
+	uint64_t granule_pos;
+	off_t offset;
+} ogg_index_entry;
+
+/**
+ * ogg_index:
+ * @file_size: The size of the indexed file
+ * @mtime_ns: The modification time of the indexed file, in nanoseconds
+ * @serial: The logical bitstream that was indexed
+ * @first_crc: The checksum of the first page in the file
+ * @last_offset: The offset of the last page in the file
+ * @last_crc: The checksum of the last page in the file
+ * @count: The number of entries
+ * @entries: Indexed pages, in increasing order of granule position
+ *
+ * A seek index for one logical bitstream of an Ogg file
+ */
+typedef struct ogg_index {
+	uint64_t file_size;
+	int64_t mtime_ns;
+	uint32_t serial;
+	uint32_t first_crc;
+	off_t last_offset;
+	uint32_t last_crc;
+	size_t count;
+	ogg_index_entry *entries;
+} ogg_index;
+
+/**
+ * ogg_index_init:
+ * @index: An uninitialized #ogg_index structure
+ *
+ * Initialize a previously unused #ogg_index structure
+ */
+void ogg_index_init(ogg_index *index);
+
+/**
+ * ogg_index_clear:
+ * @index: A previously-used #ogg_index structure
+ *
+ * Free the entries of the index, and reinitialize it
+ */
+void ogg_index_clear(ogg_index *index);
+
+/**
+ * ogg_index_build:
+ * @index: An initialized #ogg_index to fill in
+ * @stream: #ogg_stream to index, positioned at its start
+ * @serial: The logical bitstream to index
+ * @interval: The minimum granule position difference between entries
+ *
+ * Build an index by walking the page headers of a stream, without reading
+ * the page data. The file identity fields other than the checksums are left
+ * for the caller to fill in.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_index_build(ogg_index *index, ogg_stream *stream, uint32_t serial, uint64_t interval);
+
+/**
+ * ogg_index_lookup:
+ * @index: An #ogg_index
+ * @granule_pos: The position to look for
+ *
+ * Find where to start reading to get to a granule position: the offset of
+ * the start of the last indexed page that ends before it. That page may
+ * begin with the end of a packet continued from an earlier page
+ * (%OGG_PAGE_TYPE_CONTINUED), which the caller must skip, as well as
+ * packets ending before @granule_pos.
+ *
+ * Returns: An offset in the file, or 0 if reading should start at the
+ * beginning
+ */
+off_t ogg_index_lookup(const ogg_index *index, uint64_t granule_pos);
+
+/**
+ * ogg_index_write:
+ * @index: The #ogg_index to save
+ * @filename: The path of the index file
+ *
+ * Save an index to a file
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_index_write(const ogg_index *index, const char *filename);
+
+/**
+ * ogg_index_read:
+ * @index: An initialized #ogg_index to load into
+ * @filename: The path of the index file
+ *
+ * Load an index from a file, without checking that it is current
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_index_read(ogg_index *index, const char *filename);
+
+/**
+ * ogg_index_is_current:
+ * @index: A loaded #ogg_index
+ * @filename: The path of the indexed file
+ * @stream: An #ogg_stream open on @filename
+ *
+ * Check that an index still describes a file, by comparing its size and
+ * modification time, and the checksums of its first and last pages. The
+ * stream position is restored afterwards.
+ *
+ * Returns: %true if the index can be used
+ */
+bool ogg_index_is_current(const ogg_index *index, const char *filename, ogg_stream *stream);
+
+/**
+ * ogg_index_open:
+ * @index: An initialized #ogg_index to fill in
+ * @filename: The path of the file to index
+ * @stream: An #ogg_stream open on @filename
+ * @serial: The logical bitstream to index
+ * @interval: The minimum granule position difference between entries
+ *
+ * Load the sidecar index of a file ("@filename.idx") if it is current,
+ * otherwise build a new one and try to save it. Failing to save the sidecar
+ * is not an error. The stream position is restored afterwards.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_index_open(
+	ogg_index *index,
+	const char *filename,
+	ogg_stream *stream,
+	uint32_t serial,
+	uint64_t interval);
+
+#endif
@@ -15,9 +15,14 @@
 
 #include "oggopus.h"
 #include "ogg.h"
+#include "oggdemux.h"
+#include "oggrewrite.h"
+#include "bits.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 static const uint8_t OGGOPUS_HEAD_MAGIC[] = {
 	0x4f, 0x70, 0x75, 0x73, 0x48, 0x65, 0x61, 0x64
@@ -29,10 +34,763 @@ static const uint8_t OGGOPUS_TAGS_MAGIC[] = {
 	0x4f, 0x70, 0x75, 0x73, 0x54, 0x61, 0x67, 0x73
 };
 
-int oggopus_recognize(const ogg_page *page) {
+/* Magic, vendor string length and comment count */
+#define OGGOPUS_TAGS_MIN_LENGTH 16
+
+int oggopus_head_parse(oggopus_head *head, const uint8_t *data, size_t len) {
+	int i;
+	
+	if (len < OGGOPUS_HEAD_LENGTH ||
+	    memcmp(data, OGGOPUS_HEAD_MAGIC, sizeof (OGGOPUS_HEAD_MAGIC))) {
+		ogg_error = "Packet is not OpusHead";
+		return OGG_INVALID;
+	}
+	
+	head->version = data[8];
+	head->channels = data[9];
+	head->pre_skip = read_le16(&data[10]);
+	head->input_sample_rate = read_le32(&data[12]);
+	head->output_gain = (int16_t) read_le16(&data[16]);
+	head->mapping_family = data[18];
+	
+	/* Later minor versions are compatible, a new major version isn't */
+	if (head->version > 15) {
+		ogg_error = "Unsupported OpusHead version";
+		return OGG_INVALID;
+	}
+	if (head->channels == 0) {
+		ogg_error = "OpusHead has no channels";
+		return OGG_INVALID;
+	}
+	
+	if (head->mapping_family == 0) {
+		if (head->channels > 2) {
+			ogg_error = "Channel mapping family 0 allows at most 2 channels";
+			return OGG_INVALID;
+		}
+		head->stream_count = 1;
+		head->coupled_count = head->channels - 1;
+		for (i = 0; i < head->channels; i++)
+			head->mapping[i] = i;
+		return OGG_SUCCESS;
+	}
+	if (head->mapping_family == 1 && head->channels > 8) {
+		ogg_error = "Channel mapping family 1 allows at most 8 channels";
+		return OGG_INVALID;
+	}
+	
+	if (len < OGGOPUS_HEAD_LENGTH + 2 + head->channels) {
+		ogg_error = "OpusHead channel mapping table is truncated";
+		return OGG_INVALID;
+	}
+	head->stream_count = data[19];
+	head->coupled_count = data[20];
+	memcpy(head->mapping, &data[21], head->channels);
+	
+	if (head->stream_count == 0 || head->coupled_count > head->stream_count ||
+	    head->stream_count + head->coupled_count > 255) {
+		ogg_error = "OpusHead has an invalid stream count";
+		return OGG_INVALID;
+	}
+	for (i = 0; i < head->channels; i++) {
+		if (head->mapping[i] != 255 &&
+		    head->mapping[i] >= head->stream_count + head->coupled_count) {
+			ogg_error = "OpusHead channel mapping refers to a missing channel";
+			return OGG_INVALID;
+		}
+	}
+	
+	return OGG_SUCCESS;
+}
+
+int oggopus_recognize(const ogg_page *page, oggopus_head *head) {
+	oggopus_head scratch;
+	
 	if (!(page->type & OGG_PAGE_TYPE_BOS))
 		return -1;
-	if (page->data_len < OGGOPUS_HEAD_LENGTH)
+	if (oggopus_head_parse(head ? head : &scratch, page->data, page->data_len))
 		return -1;
-	return memcmp(page->data, OGGOPUS_HEAD_MAGIC, sizeof (OGGOPUS_HEAD_MAGIC));
+	return 0;
+}
+
+int oggopus_duration(const oggopus_head *head, ogg_stream *stream, uint32_t serial, uint64_t *samples) {
+	ogg_page_info last;
+	int err;
+	
+	err = ogg_page_find_last(&last, stream, serial);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	if (last.granule_pos > head->pre_skip)
+		*samples = last.granule_pos - head->pre_skip;
+	else
+		*samples = 0;
+	
+	return OGG_SUCCESS;
+}
+
+int oggopus_adjust_output_gain(const char *filename, int delta, int *applied) {
+	ogg_stream *stream;
+	ogg_page page;
+	oggopus_head head;
+	int32_t output_gain;
+	int err;
+	
+	stream = ogg_stream_fd_open(filename, true);
+	if (!stream)
+		return OGG_INVALID;
+	ogg_page_init(&page);
+	
+	err = ogg_page_read_at(&page, stream, 0);
+	if (err != OGG_SUCCESS)
+		goto error;
+	if (oggopus_recognize(&page, &head)) {
+		ogg_error = "File is not OggOpus";
+		err = OGG_INVALID;
+		goto error;
+	}
+	
+	output_gain = head.output_gain + delta;
+	if (output_gain > INT16_MAX)
+		output_gain = INT16_MAX;
+	if (output_gain < INT16_MIN)
+		output_gain = INT16_MIN;
+	if (applied)
+		*applied = output_gain - head.output_gain;
+	
+	/* OpusHead is alone on its page, so the page keeps its size */
+	write_le16(&page.data[16], (uint16_t) output_gain);
+	err = ogg_page_write_at(&page, stream, page.offset);
+
+error:
+	ogg_page_clear(&page);
+	ogg_stream_close(stream);
+	
+	return err;
+}
+
+void oggopus_tags_init(oggopus_tags *tags) {
+	memset(tags, 0, sizeof (oggopus_tags));
+}
+
+void oggopus_tags_clear(oggopus_tags *tags) {
+	uint32_t i;
+	
+	for (i = 0; i < tags->count; i++)
+		free(tags->comments[i].data);
+	free(tags->comments);
+	free(tags->vendor);
+	free(tags->padding);
+	oggopus_tags_init(tags);
+}
+
+/* Copy a length-prefixed string out of a packet, adding a terminator */
+static char *oggopus_string_read(const uint8_t *data, size_t len, size_t *pos, uint32_t *length) {
+	char *string;
+	
+	if (len - *pos < 4)
+		return NULL;
+	*length = read_le32(&data[*pos]);
+	*pos += 4;
+	if (len - *pos < *length)
+		return NULL;
+	
+	string = malloc(*length + 1);
+	memcpy(string, &data[*pos], *length);
+	string[*length] = '\0';
+	*pos += *length;
+	
+	return string;
+}
+
+int oggopus_tags_parse(oggopus_tags *tags, const uint8_t *data, size_t len) {
+	size_t pos = sizeof (OGGOPUS_TAGS_MAGIC);
+	uint32_t count;
+	
+	oggopus_tags_clear(tags);
+	
+	if (len < OGGOPUS_TAGS_MIN_LENGTH ||
+	    memcmp(data, OGGOPUS_TAGS_MAGIC, sizeof (OGGOPUS_TAGS_MAGIC))) {
+		ogg_error = "Packet is not OpusTags";
+		return OGG_INVALID;
+	}
+	
+	tags->vendor = oggopus_string_read(data, len, &pos, &tags->vendor_length);
+	if (!tags->vendor)
+		goto error;
+	
+	if (len - pos < 4)
+		goto error;
+	count = read_le32(&data[pos]);
+	pos += 4;
+	
+	/* Each comment takes at least 4 bytes, so don't trust a larger count */
+	if (count > (len - pos) / 4)
+		goto error;
+	tags->comments = malloc(count * sizeof (oggopus_comment));
+	
+	while (tags->count < count) {
+		oggopus_comment *comment = &tags->comments[tags->count];
+		
+		comment->data = oggopus_string_read(data, len, &pos, &comment->length);
+		if (!comment->data)
+			goto error;
+		tags->count++;
+	}
+	
+	tags->padding_len = len - pos;
+	if (tags->padding_len > 0) {
+		tags->padding = malloc(tags->padding_len);
+		memcpy(tags->padding, &data[pos], tags->padding_len);
+	}
+	
+	return OGG_SUCCESS;
+
+error:
+	oggopus_tags_clear(tags);
+	ogg_error = "OpusTags packet is truncated";
+	return OGG_INVALID;
+}
+
+size_t oggopus_tags_length(const oggopus_tags *tags) {
+	size_t len = OGGOPUS_TAGS_MIN_LENGTH + tags->vendor_length;
+	uint32_t i;
+	
+	for (i = 0; i < tags->count; i++)
+		len += 4 + tags->comments[i].length;
+	
+	return len + tags->padding_len;
+}
+
+void oggopus_tags_write(const oggopus_tags *tags, uint8_t *buffer) {
+	uint32_t i;
+	
+	memcpy(buffer, OGGOPUS_TAGS_MAGIC, sizeof (OGGOPUS_TAGS_MAGIC));
+	buffer += sizeof (OGGOPUS_TAGS_MAGIC);
+	
+	write_le32(buffer, tags->vendor_length);
+	memcpy(buffer + 4, tags->vendor, tags->vendor_length);
+	buffer += 4 + tags->vendor_length;
+	
+	write_le32(buffer, tags->count);
+	buffer += 4;
+	for (i = 0; i < tags->count; i++) {
+		write_le32(buffer, tags->comments[i].length);
+		memcpy(buffer + 4, tags->comments[i].data, tags->comments[i].length);
+		buffer += 4 + tags->comments[i].length;
+	}
+	
+	if (tags->padding_len > 0)
+		memcpy(buffer, tags->padding, tags->padding_len);
+}
+
+void oggopus_tags_remove(oggopus_tags *tags, const char *name) {
+	size_t name_len = strlen(name);
+	uint32_t i, kept = 0;
+	
+	for (i = 0; i < tags->count; i++) {
+		oggopus_comment *comment = &tags->comments[i];
+		
+		if (comment->length > name_len && comment->data[name_len] == '=' &&
+		    !strncasecmp(comment->data, name, name_len)) {
+			free(comment->data);
+			continue;
+		}
+		tags->comments[kept++] = *comment;
+	}
+	
+	tags->count = kept;
+}
+
+void oggopus_tags_set(oggopus_tags *tags, const char *name, const char *value) {
+	size_t name_len = strlen(name), value_len = strlen(value);
+	oggopus_comment *comment;
+	
+	oggopus_tags_remove(tags, name);
+	
+	tags->comments = realloc(tags->comments, (tags->count + 1) * sizeof (oggopus_comment));
+	comment = &tags->comments[tags->count++];
+	comment->length = name_len + 1 + value_len;
+	comment->data = malloc(comment->length + 1);
+	memcpy(comment->data, name, name_len);
+	comment->data[name_len] = '=';
+	memcpy(&comment->data[name_len + 1], value, value_len + 1);
+}
+
+bool oggopus_tags_set_padding(oggopus_tags *tags, size_t len) {
+	if (tags->padding_len > 0 && (tags->padding[0] & 1))
+		return false;
+	
+	free(tags->padding);
+	tags->padding = len > 0 ? calloc(len, 1) : NULL;
+	tags->padding_len = len;
+	
+	return true;
+}
+
+bool oggopus_tags_fit(oggopus_tags *tags, size_t length) {
+	size_t unpadded = oggopus_tags_length(tags) - tags->padding_len;
+	
+	if (length == unpadded + tags->padding_len)
+		return true;
+	if (length < unpadded)
+		return false;
+	
+	return oggopus_tags_set_padding(tags, length - unpadded);
+}
+
+/* A read position in a packet spread over pages that haven't been read, for
+ * reading parts of it and skipping over the rest */
+typedef struct oggopus_cursor {
+	ogg_stream *stream;
+	uint32_t serial;
+	off_t next_page;
+	off_t pos;
+	size_t left;
+	bool started;
+	bool ended;
+} oggopus_cursor;
+
+/* Move on to the data of the next page of the packet */
+static int oggopus_cursor_next_page(oggopus_cursor *cursor) {
+	ogg_stream *stream = cursor->stream;
+	ogg_page_info info;
+	int err;
+	
+	if (cursor->ended) {
+		ogg_error = "OpusTags packet is truncated";
+		return OGG_INVALID;
+	}
+	
+	do {
+		if (stream->io->seek(stream, cursor->next_page)) {
+			ogg_error = "Error seeking to next page";
+			return OGG_INVALID;
+		}
+		err = ogg_page_read_info(&info, stream);
+		if (err == OGG_END_OF_STREAM)
+			ogg_error = "OpusTags packet is truncated";
+		if (err != OGG_SUCCESS)
+			return OGG_INVALID;
+		cursor->next_page = info.offset + info.size;
+	} while (info.serial != cursor->serial);
+	
+	if (cursor->started != !!(info.type & OGG_PAGE_TYPE_CONTINUED)) {
+		ogg_error = "OpusTags packet is not on pages of its own";
+		return OGG_INVALID;
+	}
+	
+	cursor->pos = info.offset + info.size - info.data_len;
+	cursor->left = info.data_len;
+	cursor->started = true;
+	cursor->ended = info.granule_pos != OGG_GRANULE_POS_NO_PACKET;
+	
+	return OGG_SUCCESS;
+}
+
+static int oggopus_cursor_read(oggopus_cursor *cursor, uint8_t *buffer, size_t len) {
+	ogg_stream *stream = cursor->stream;
+	int err;
+	
+	while (len > 0) {
+		size_t chunk;
+		
+		if (cursor->left == 0) {
+			err = oggopus_cursor_next_page(cursor);
+			if (err != OGG_SUCCESS)
+				return err;
+			continue;
+		}
+		
+		chunk = len < cursor->left ? len : cursor->left;
+		if (stream->io->seek(stream, cursor->pos) ||
+		    stream->io->read(stream, buffer, chunk) < chunk) {
+			ogg_error = "Error reading OpusTags packet";
+			return OGG_INVALID;
+		}
+		cursor->pos += chunk;
+		cursor->left -= chunk;
+		buffer += chunk;
+		len -= chunk;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+static int oggopus_cursor_skip(oggopus_cursor *cursor, uint64_t len) {
+	int err;
+	
+	while (len > 0) {
+		size_t chunk;
+		
+		if (cursor->left == 0) {
+			err = oggopus_cursor_next_page(cursor);
+			if (err != OGG_SUCCESS)
+				return err;
+			continue;
+		}
+		
+		chunk = len < cursor->left ? len : cursor->left;
+		cursor->pos += chunk;
+		cursor->left -= chunk;
+		len -= chunk;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+/* Read a length-prefixed string, adding a terminator */
+static int oggopus_cursor_read_string(oggopus_cursor *cursor, uint32_t length, char **string) {
+	int err;
+	
+	*string = malloc((size_t) length + 1);
+	err = oggopus_cursor_read(cursor, (uint8_t *) *string, length);
+	if (err != OGG_SUCCESS) {
+		free(*string);
+		*string = NULL;
+		return err;
+	}
+	(*string)[length] = '\0';
+	
+	return OGG_SUCCESS;
+}
+
+/* Check whether the start of a comment has one of the field names */
+static bool oggopus_tags_name_matches(const char *const *names, const char *start, size_t len) {
+	for (; *names; names++) {
+		size_t name_len = strlen(*names);
+		
+		if (name_len > 0 && (*names)[name_len - 1] == '*') {
+			if (len >= name_len - 1 && !strncasecmp(start, *names, name_len - 1))
+				return true;
+		} else {
+			if (len > name_len && start[name_len] == '=' &&
+			    !strncasecmp(start, *names, name_len))
+				return true;
+		}
+	}
+	
+	return false;
+}
+
+int oggopus_tags_scan(
+	oggopus_tags *tags,
+	ogg_stream *stream,
+	off_t offset,
+	uint32_t serial,
+	const char *const *names
+) {
+	oggopus_cursor cursor = { stream, serial, offset, 0, 0, false, false };
+	uint8_t header[sizeof (OGGOPUS_TAGS_MAGIC)];
+	uint8_t length[4];
+	size_t peek_len = 0;
+	char *peek = NULL;
+	uint32_t count, i;
+	int err;
+	
+	oggopus_tags_clear(tags);
+	
+	/* Enough of the start of a comment to tell if its name matches */
+	for (i = 0; names[i]; i++) {
+		if (strlen(names[i]) + 1 > peek_len)
+			peek_len = strlen(names[i]) + 1;
+	}
+	peek = malloc(peek_len);
+	
+	err = oggopus_cursor_read(&cursor, header, sizeof (header));
+	if (err != OGG_SUCCESS)
+		goto error;
+	if (memcmp(header, OGGOPUS_TAGS_MAGIC, sizeof (OGGOPUS_TAGS_MAGIC))) {
+		ogg_error = "Packet is not OpusTags";
+		err = OGG_INVALID;
+		goto error;
+	}
+	
+	err = oggopus_cursor_read(&cursor, length, 4);
+	if (err != OGG_SUCCESS)
+		goto error;
+	tags->vendor_length = read_le32(length);
+	err = oggopus_cursor_read_string(&cursor, tags->vendor_length, &tags->vendor);
+	if (err != OGG_SUCCESS)
+		goto error;
+	
+	err = oggopus_cursor_read(&cursor, length, 4);
+	if (err != OGG_SUCCESS)
+		goto error;
+	count = read_le32(length);
+	
+	for (i = 0; i < count; i++) {
+		oggopus_comment *comment;
+		uint32_t comment_len;
+		size_t start_len;
+		
+		err = oggopus_cursor_read(&cursor, length, 4);
+		if (err != OGG_SUCCESS)
+			goto error;
+		comment_len = read_le32(length);
+		
+		start_len = comment_len < peek_len ? comment_len : peek_len;
+		err = oggopus_cursor_read(&cursor, (uint8_t *) peek, start_len);
+		if (err != OGG_SUCCESS)
+			goto error;
+		
+		if (!oggopus_tags_name_matches(names, peek, start_len)) {
+			err = oggopus_cursor_skip(&cursor, comment_len - start_len);
+			if (err != OGG_SUCCESS)
+				goto error;
+			continue;
+		}
+		
+		tags->comments = realloc(tags->comments, (tags->count + 1) * sizeof (oggopus_comment));
+		comment = &tags->comments[tags->count];
+		comment->length = comment_len;
+		comment->data = malloc((size_t) comment_len + 1);
+		memcpy(comment->data, peek, start_len);
+		err = oggopus_cursor_read(&cursor, (uint8_t *) comment->data + start_len,
+			comment_len - start_len);
+		if (err != OGG_SUCCESS) {
+			free(comment->data);
+			goto error;
+		}
+		comment->data[comment_len] = '\0';
+		tags->count++;
+	}
+	
+	free(peek);
+	return OGG_SUCCESS;
+
+error:
+	free(peek);
+	oggopus_tags_clear(tags);
+	return err;
+}
+
+/* The number of bytes a packet takes on pages of its own, as written by
+ * ogg_packet_write() */
+static off_t oggopus_packet_pages_size(size_t len) {
+	size_t pages = len / (255*255) + 1;
+	size_t last = len - (pages - 1) * (255*255);
+	
+	return len + pages * OGG_PAGE_HEADER_SIZE + (pages - 1) * OGG_PAGE_MAX_SEGMENTS +
+		last / 255 + 1;
+}
+
+/* Pad the tags so that their pages change size by a multiple of the block
+ * size, which keeps the audio after them at the same offset within a block
+ * as in the original, so that it can be cloned instead of copied. Each byte
+ * of padding grows the pages by one or two bytes, so a size that fits is
+ * found within a few blocks. */
+static void oggopus_tags_align(oggopus_tags *tags, size_t padding, off_t old_size, off_t block) {
+	size_t unpadded = oggopus_tags_length(tags) - tags->padding_len;
+	size_t extra;
+	
+	if (block <= 0)
+		return;
+	
+	for (extra = 0; extra < 4 * (size_t) block; extra++) {
+		off_t size = oggopus_packet_pages_size(unpadded + padding + extra);
+		
+		if ((size - old_size) % block == 0) {
+			oggopus_tags_set_padding(tags, padding + extra);
+			return;
+		}
+	}
+}
+
+/* Replace a file with a copy that has new tags pages, for when the new tags
+ * don't fit in the old pages */
+static int oggopus_rewrite_tags(
+	const char *filename,
+	const ogg_page *pages,
+	size_t count,
+	oggopus_tags *tags,
+	size_t padding,
+	off_t pages_end
+) {
+	const ogg_page *last = &pages[count - 1];
+	uint32_t seq = pages[0].seq;
+	ogg_rewrite *rewrite;
+	uint8_t *packet;
+	size_t len;
+	int err;
+	
+	rewrite = ogg_rewrite_new(filename);
+	if (!rewrite)
+		return OGG_INVALID;
+	
+	/* Padding that has to be kept as it is can't be resized */
+	if (tags->padding_len == 0 || !(tags->padding[0] & 1))
+		oggopus_tags_align(tags, padding, pages_end - pages[0].offset,
+			ogg_rewrite_block_size(rewrite));
+	len = oggopus_tags_length(tags);
+	packet = malloc(len);
+	oggopus_tags_write(tags, packet);
+	
+	err = ogg_rewrite_copy(rewrite, 0, pages[0].offset);
+	if (err == OGG_SUCCESS)
+		err = ogg_packet_write(packet, len, last->granule_pos, last->serial,
+			&seq, ogg_rewrite_stream(rewrite));
+	if (err == OGG_SUCCESS)
+		err = ogg_rewrite_copy_pages(rewrite, pages_end, last->serial,
+			seq - (last->seq + 1));
+	if (err == OGG_SUCCESS)
+		err = ogg_rewrite_commit(rewrite);
+	
+	ogg_rewrite_free(rewrite);
+	free(packet);
+	return err;
+}
+
+/* Look through the BOS pages of the first link for an Opus stream, leaving
+ * its first page in head_page */
+static int oggopus_find_stream(ogg_demux *demux, ogg_page *head_page, ogg_demux_stream **opus) {
+	int err;
+	
+	*opus = NULL;
+	while (!*opus) {
+		ogg_demux_stream *logical;
+		
+		ogg_page_clear(head_page);
+		err = ogg_demux_read_page(demux, head_page, &logical);
+		if (err != OGG_SUCCESS)
+			return err;
+		if (!(head_page->type & OGG_PAGE_TYPE_BOS)) {
+			ogg_error = "File is not OggOpus";
+			return OGG_INVALID;
+		}
+		if (oggopus_recognize(head_page, NULL))
+			logical->discard = true;
+		else
+			*opus = logical;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+int oggopus_read_tags(const char *filename, oggopus_tags *tags, const char *const *names) {
+	ogg_stream *stream;
+	ogg_demux demux;
+	ogg_demux_stream *opus;
+	ogg_page head_page;
+	ogg_page_info info;
+	int err;
+	
+	stream = ogg_stream_mmap_open_read(filename);
+	if (!stream)
+		return OGG_INVALID;
+	
+	ogg_demux_init(&demux, stream);
+	ogg_page_init(&head_page);
+	
+	err = oggopus_find_stream(&demux, &head_page, &opus);
+	if (err != OGG_SUCCESS)
+		goto error;
+	
+	/* The OpusTags packet starts on the stream's next page, somewhere after
+	 * the end of the OpusHead page */
+	if (stream->io->seek(stream, head_page.offset)) {
+		ogg_error = "Error seeking to OpusHead page";
+		err = OGG_INVALID;
+		goto error;
+	}
+	err = ogg_page_read_info(&info, stream);
+	if (err != OGG_SUCCESS)
+		goto error;
+	
+	err = oggopus_tags_scan(tags, stream, info.offset + info.size, head_page.serial, names);
+
+error:
+	ogg_page_clear(&head_page);
+	ogg_demux_clear(&demux);
+	ogg_stream_close(stream);
+	
+	return err;
+}
+
+int oggopus_update_tags(const char *filename, oggopus_tags_edit_func edit, void *user, size_t padding) {
+	ogg_stream *stream, *file = NULL;
+	ogg_demux demux;
+	ogg_demux_stream *opus = NULL;
+	ogg_page head_page;
+	ogg_page *pages = NULL;
+	size_t count = 0, allocated = 0, len = 0, i;
+	uint8_t *packet = NULL;
+	oggopus_tags tags;
+	int err;
+	
+	stream = ogg_stream_mmap_open_read(filename);
+	if (!stream)
+		return OGG_INVALID;
+	
+	ogg_demux_init(&demux, stream);
+	ogg_page_init(&head_page);
+	oggopus_tags_init(&tags);
+	
+	err = oggopus_find_stream(&demux, &head_page, &opus);
+	if (err != OGG_SUCCESS)
+		goto error;
+	
+	/* Collect the pages of the OpusTags packet */
+	do {
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 4;
+			pages = realloc(pages, allocated * sizeof (ogg_page));
+		}
+		ogg_page_init(&pages[count]);
+		err = ogg_demux_stream_read_page(&demux, opus, &pages[count]);
+		if (err != OGG_SUCCESS)
+			goto error;
+		len += pages[count].data_len;
+	} while (pages[count++].granule_pos == OGG_GRANULE_POS_NO_PACKET);
+	
+	packet = malloc(len);
+	for (i = 0, len = 0; i < count; i++) {
+		memcpy(&packet[len], pages[i].data, pages[i].data_len);
+		len += pages[i].data_len;
+	}
+	
+	err = oggopus_tags_parse(&tags, packet, len);
+	if (err != OGG_SUCCESS || !edit(&tags, user))
+		goto error;
+	
+	/* Absorb a change in size into the padding if possible, so that the
+	 * tags can be written in place, otherwise leave room for next time */
+	if (!oggopus_tags_fit(&tags, len))
+		oggopus_tags_set_padding(&tags, padding);
+	free(packet);
+	len = oggopus_tags_length(&tags);
+	packet = malloc(len);
+	oggopus_tags_write(&tags, packet);
+	
+	file = ogg_stream_fd_open(filename, true);
+	if (!file) {
+		err = OGG_INVALID;
+		goto error;
+	}
+	err = ogg_packet_rewrite_pages(pages, count, packet, len, file);
+	
+	if (err == OGG_BAD_SIZE) {
+		/* Pages of other streams between the tags pages would be lost */
+		if (demux.streams != opus || opus->next) {
+			ogg_error = "Only files with a single logical stream can be rewritten";
+			err = OGG_INVALID;
+			goto error;
+		}
+		err = oggopus_rewrite_tags(filename, pages, count, &tags, padding,
+			stream->io->tell(stream));
+	}
+
+error:
+	if (file)
+		ogg_stream_close(file);
+	for (i = 0; i < count; i++)
+		ogg_page_clear(&pages[i]);
+	free(pages);
+	free(packet);
+	oggopus_tags_clear(&tags);
+	ogg_page_clear(&head_page);
+	ogg_demux_clear(&demux);
+	ogg_stream_close(stream);
+	
+	return err;
 }
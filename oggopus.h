@@ -16,16 +16,307 @@
 #ifndef OGGOPUS_H
 #define OGGOPUS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 typedef struct ogg_page ogg_page;
+typedef struct ogg_stream ogg_stream;
+
+/**
+ * OGGOPUS_MAX_CHANNELS:
+ *
+ * The largest number of channels an OggOpus stream can have
+ */
+#define OGGOPUS_MAX_CHANNELS 255
+
+/**
+ * oggopus_head:
+ * @version: The encapsulation version; only the major version 0 (0-15) is
+ *   understood
+ * @channels: The number of output channels
+ * @pre_skip: The number of 48 kHz samples to discard from the start of the
+ *   decoder output
+ * @input_sample_rate: The sample rate of the original input, for
+ *   information only
+ * @output_gain: The gain to apply to the decoder output, in dB as a Q7.8
+ *   fixed point number
+ * @mapping_family: The channel mapping family
+ * @stream_count: The number of Opus streams in each packet
+ * @coupled_count: The number of those streams that are stereo
+ * @mapping: For each output channel, the decoded channel it comes from, or
+ *   255 for silence. Filled in for every mapping family.
+ *
+ * The contents of an OpusHead packet. The field layout is described in
+ * stream-disassembly.txt.
+ */
+typedef struct oggopus_head {
+	uint8_t version;
+	uint8_t channels;
+	uint16_t pre_skip;
+	uint32_t input_sample_rate;
+	int16_t output_gain;
+	uint8_t mapping_family;
+	uint8_t stream_count;
+	uint8_t coupled_count;
+	uint8_t mapping[OGGOPUS_MAX_CHANNELS];
+} oggopus_head;
+
+/**
+ * oggopus_head_parse:
+ * @head: Location to store the parsed header
+ * @data: The OpusHead packet
+ * @len: The number of bytes in @data
+ *
+ * Parse and check an OpusHead packet. For mapping family 0, which has no
+ * mapping table in the packet, the implied one stream and mapping are
+ * filled in.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_head_parse(oggopus_head *head, const uint8_t *data, size_t len);
 
 /**
  * oggopus_recognize:
  * @page: An Ogg Opus page containing a possible OggOpus stream first packet
+ * @head: Optional location to store the parsed OpusHead packet
  *
- * Check if the Ogg page is the start of an OggOpus stream
+ * Check if the Ogg page is the start of an OggOpus stream, with a valid
+ * OpusHead packet
  *
  * Returns: 0 if the stream appears to be OggOpus
  */
-int oggopus_recognize(const ogg_page *page);
+int oggopus_recognize(const ogg_page *page, oggopus_head *head);
+
+/**
+ * oggopus_duration:
+ * @head: The OggOpus stream header
+ * @stream: The #ogg_stream containing the OggOpus stream
+ * @serial: The serial number of the OggOpus stream
+ * @samples: Location to store the duration
+ *
+ * Find the playable length of an OggOpus stream from the granule position of
+ * its last page, minus the pre-skip. Only the end of the stream is read.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message. @samples is in 48 kHz samples.
+ */
+int oggopus_duration(const oggopus_head *head, ogg_stream *stream, uint32_t serial, uint64_t *samples);
+
+/**
+ * oggopus_adjust_output_gain:
+ * @filename: The path of an OggOpus file
+ * @delta: The change to the output gain, in Q7.8 fixed point dB
+ * @applied: Optional location to store the change actually made, which is
+ *   less than @delta if the output gain was clamped
+ *
+ * Add to the output gain field of the OpusHead packet, clamped to the range
+ * of the field. Only the first page is rewritten, in place, with a new
+ * checksum; the rest of the file is not read.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_adjust_output_gain(const char *filename, int delta, int *applied);
+
+/**
+ * oggopus_comment:
+ * @length: The number of bytes in @data, not counting the terminator
+ * @data: The comment, normally in the form "NAME=value", with a NUL
+ *   terminator added
+ */
+typedef struct oggopus_comment {
+	uint32_t length;
+	char *data;
+} oggopus_comment;
+
+/**
+ * oggopus_tags:
+ * @vendor_length: The number of bytes in @vendor, not counting the
+ *   terminator
+ * @vendor: The vendor string, with a NUL terminator added
+ * @count: The number of entries in @comments
+ * @comments: The user comments, in the order they appear in the packet
+ * @padding_len: The number of bytes in @padding
+ * @padding: Whatever followed the comments in the packet. If the first byte
+ *   has its lowest bit set this is data that must be kept; otherwise it is
+ *   padding that may be resized.
+ *
+ * The contents of an OpusTags packet
+ */
+typedef struct oggopus_tags {
+	uint32_t vendor_length;
+	char *vendor;
+	uint32_t count;
+	oggopus_comment *comments;
+	size_t padding_len;
+	uint8_t *padding;
+} oggopus_tags;
+
+/**
+ * oggopus_tags_init:
+ * @tags: An uninitialized #oggopus_tags structure
+ *
+ * Initialize a previously unused #oggopus_tags structure
+ */
+void oggopus_tags_init(oggopus_tags *tags);
+
+/**
+ * oggopus_tags_clear:
+ * @tags: A previously-used #oggopus_tags structure
+ *
+ * Free memory internally allocated for the tags, and reinitialize.
+ */
+void oggopus_tags_clear(oggopus_tags *tags);
+
+/**
+ * oggopus_tags_parse:
+ * @tags: An initialized #oggopus_tags to save the tags into
+ * @data: The OpusTags packet
+ * @len: The number of bytes in @data
+ *
+ * Parse an OpusTags packet. Everything is copied out of @data.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_tags_parse(oggopus_tags *tags, const uint8_t *data, size_t len);
+
+/**
+ * oggopus_tags_length:
+ * @tags: An #oggopus_tags
+ *
+ * Returns: The size of the OpusTags packet that oggopus_tags_write() makes
+ */
+size_t oggopus_tags_length(const oggopus_tags *tags);
+
+/**
+ * oggopus_tags_write:
+ * @tags: An #oggopus_tags
+ * @buffer: A buffer of at least oggopus_tags_length() bytes
+ *
+ * Build an OpusTags packet
+ */
+void oggopus_tags_write(const oggopus_tags *tags, uint8_t *buffer);
+
+/**
+ * oggopus_tags_set:
+ * @tags: An #oggopus_tags
+ * @name: The field name
+ * @value: The new value
+ *
+ * Replace every comment with the field name (compared case-insensitively)
+ * with a single "@name=@value" comment, added at the end
+ */
+void oggopus_tags_set(oggopus_tags *tags, const char *name, const char *value);
+
+/**
+ * oggopus_tags_remove:
+ * @tags: An #oggopus_tags
+ * @name: The field name
+ *
+ * Remove every comment with the field name (compared case-insensitively)
+ */
+void oggopus_tags_remove(oggopus_tags *tags, const char *name);
+
+/**
+ * oggopus_tags_set_padding:
+ * @tags: An #oggopus_tags
+ * @len: The number of bytes of padding
+ *
+ * Replace the padding after the comments with @len zero bytes, leaving room
+ * for the comments to grow in later in-place rewrites. Data after the
+ * comments that has to be kept is left alone.
+ *
+ * Returns: %true if the padding was changed
+ */
+bool oggopus_tags_set_padding(oggopus_tags *tags, size_t len);
+
+/**
+ * oggopus_tags_fit:
+ * @tags: An #oggopus_tags
+ * @length: The packet size to aim for
+ *
+ * Grow or shrink the padding so that the packet built by
+ * oggopus_tags_write() is exactly @length bytes, so that it can replace a
+ * packet of that size in place
+ *
+ * Returns: %true if the packet is now @length bytes
+ */
+bool oggopus_tags_fit(oggopus_tags *tags, size_t length);
+
+/**
+ * oggopus_tags_scan:
+ * @tags: An initialized #oggopus_tags to save the matching tags into
+ * @stream: The #ogg_stream containing the OggOpus stream, which must
+ *   support seeking
+ * @offset: The offset of the first page of the OpusTags packet
+ * @serial: The serial number of the OggOpus stream
+ * @names: A %NULL-terminated list of field names to look for. A name ending
+ *   in '*' matches every field name starting with the rest of it.
+ *
+ * Read the vendor string and the comments with the given field names from an
+ * OpusTags packet, without reading the whole packet. Only the length of the
+ * other comments is read, and their data is skipped over by walking page
+ * headers, so large comments such as embedded pictures cost nothing.
+ *
+ * The resulting @tags only hold a selection of the comments, so they must not
+ * be written back with oggopus_tags_write().
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_tags_scan(
+	oggopus_tags *tags,
+	ogg_stream *stream,
+	off_t offset,
+	uint32_t serial,
+	const char *const *names);
+
+/**
+ * oggopus_read_tags:
+ * @filename: The path of an OggOpus file
+ * @tags: An initialized #oggopus_tags to save the matching tags into
+ * @names: A %NULL-terminated list of field names to look for, as for
+ *   oggopus_tags_scan()
+ *
+ * Find the first OggOpus stream of a file and read the comments with the
+ * given field names with oggopus_tags_scan(), skipping over the others
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_read_tags(const char *filename, oggopus_tags *tags, const char *const *names);
+
+/**
+ * oggopus_tags_edit_func:
+ * @tags: The current tags of a file, to be changed
+ * @user: The data passed to oggopus_update_tags()
+ *
+ * Change the tags of a file
+ *
+ * Returns: %true if the tags should be written back
+ */
+typedef bool (*oggopus_tags_edit_func)(oggopus_tags *tags, void *user);
+
+/**
+ * oggopus_update_tags:
+ * @filename: The path of an OggOpus file
+ * @edit: Function to change the tags
+ * @user: Data to pass to @edit
+ * @padding: The padding to leave after the comments if the file has to be
+ *   rewritten
+ *
+ * Change the tags of the first OggOpus stream in a file. If the new tags can
+ * be made to fit in the old pages by resizing the padding, only the tags
+ * pages are written, in place. Otherwise the whole file is rewritten with
+ * #ogg_rewrite, which is only possible if it has a single logical stream.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int oggopus_update_tags(const char *filename, oggopus_tags_edit_func edit, void *user, size_t padding);
 
 #endif
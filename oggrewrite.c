@@ -0,0 +1,288 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include "oggrewrite.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* Size of the bounce buffer used if the kernel can't copy a range itself */
+#define OGG_REWRITE_BUFFER_SIZE 65536
+
+/* How many names to try when linking the new file into the directory */
+#define OGG_REWRITE_NAME_ATTEMPTS 100
+
+struct ogg_rewrite {
+	char *filename;
+	char *tmpname;
+	ogg_stream *source;
+	int source_fd;
+	off_t source_size;
+	ogg_stream *stream;
+	int fd;
+	blksize_t block_size;
+	bool committed;
+};
+
+ogg_rewrite *ogg_rewrite_new(const char *filename) {
+	ogg_rewrite *rewrite;
+	struct stat st;
+	char *dir;
+	
+	rewrite = calloc(1, sizeof (ogg_rewrite));
+	rewrite->filename = strdup(filename);
+	rewrite->source_fd = -1;
+	rewrite->fd = -1;
+	
+	rewrite->source_fd = open(filename, O_RDONLY);
+	if (rewrite->source_fd < 0)
+		goto error;
+	rewrite->source = ogg_stream_fd_new(rewrite->source_fd);
+	if (fstat(rewrite->source_fd, &st) < 0)
+		goto error;
+	rewrite->source_size = st.st_size;
+	
+	/* The new file has to be on the same filesystem as the original to be
+	 * renamed over it, so put it in the same directory */
+	dir = strdup(filename);
+	rewrite->fd = open(dirname(dir), O_TMPFILE | O_RDWR, 0600);
+	free(dir);
+	if (rewrite->fd < 0) {
+		/* Not every filesystem supports unnamed files */
+		rewrite->tmpname = malloc(strlen(filename) + sizeof (".XXXXXX"));
+		sprintf(rewrite->tmpname, "%s.XXXXXX", filename);
+		rewrite->fd = mkstemp(rewrite->tmpname);
+		if (rewrite->fd < 0) {
+			free(rewrite->tmpname);
+			rewrite->tmpname = NULL;
+			goto error;
+		}
+	}
+	rewrite->stream = ogg_stream_fd_new(rewrite->fd);
+	
+	if (fchmod(rewrite->fd, st.st_mode & 07777) < 0)
+		goto error;
+	if (fstat(rewrite->fd, &st) < 0)
+		goto error;
+	rewrite->block_size = st.st_blksize;
+	
+	return rewrite;
+
+error:
+	ogg_error = strerror(errno);
+	ogg_rewrite_free(rewrite);
+	return NULL;
+}
+
+ogg_stream *ogg_rewrite_stream(ogg_rewrite *rewrite) {
+	return rewrite->stream;
+}
+
+off_t ogg_rewrite_block_size(const ogg_rewrite *rewrite) {
+	return rewrite->block_size;
+}
+
+/* Copy a range through memory, for kernels or filesystems that can't */
+static int ogg_rewrite_copy_buffered(ogg_rewrite *rewrite, off_t src, off_t dst, off_t len) {
+	uint8_t *buffer = malloc(OGG_REWRITE_BUFFER_SIZE);
+	int err = OGG_SUCCESS;
+	
+	while (len > 0) {
+		size_t chunk = len < OGG_REWRITE_BUFFER_SIZE ? len : OGG_REWRITE_BUFFER_SIZE;
+		
+		if (rewrite->source->io->pread(rewrite->source, buffer, chunk, src) < chunk) {
+			ogg_error = "Error reading original file";
+			err = OGG_INVALID;
+			break;
+		}
+		if (rewrite->stream->io->pwrite(rewrite->stream, buffer, chunk, dst) < chunk) {
+			ogg_error = "Error writing new file";
+			err = OGG_INVALID;
+			break;
+		}
+		src += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+	
+	free(buffer);
+	return err;
+}
+
+/* Copy a range inside the kernel, which may share the data on disk */
+static int ogg_rewrite_copy_kernel(ogg_rewrite *rewrite, off_t src, off_t dst, off_t len) {
+	while (len > 0) {
+		ssize_t done = copy_file_range(rewrite->source_fd, &src, rewrite->fd, &dst, len, 0);
+		
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP))
+			return ogg_rewrite_copy_buffered(rewrite, src, dst, len);
+		if (done <= 0) {
+			ogg_error = done < 0 ? strerror(errno) : "Original file is truncated";
+			return OGG_INVALID;
+		}
+		len -= done;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+int ogg_rewrite_copy(ogg_rewrite *rewrite, off_t offset, off_t len) {
+	off_t dst = rewrite->stream->io->tell(rewrite->stream);
+	off_t block = rewrite->block_size;
+	int err;
+	
+	if (len <= 0)
+		return OGG_SUCCESS;
+	
+	/* Whole blocks can be cloned if the range keeps its alignment. The
+	 * start is copied first, so that the clone doesn't begin past the end
+	 * of the new file. */
+	if (block > 0 && offset % block == dst % block) {
+		off_t head = (block - offset % block) % block;
+		off_t body;
+		
+		if (head > len)
+			head = len;
+		body = len - head;
+		if (offset + len < rewrite->source_size)
+			body -= body % block;
+		
+		if (body > 0) {
+			struct file_clone_range range;
+			
+			err = ogg_rewrite_copy_kernel(rewrite, offset, dst, head);
+			if (err != OGG_SUCCESS)
+				return err;
+			
+			range.src_fd = rewrite->source_fd;
+			range.src_offset = offset + head;
+			range.src_length = body;
+			range.dest_offset = dst + head;
+			if (ioctl(rewrite->fd, FICLONERANGE, &range) < 0)
+				body = 0;
+			
+			offset += head + body;
+			dst += head + body;
+			len -= head + body;
+		}
+	}
+	
+	err = ogg_rewrite_copy_kernel(rewrite, offset, dst, len);
+	if (err != OGG_SUCCESS)
+		return err;
+	
+	rewrite->stream->io->seek(rewrite->stream, dst + len);
+	return OGG_SUCCESS;
+}
+
+int ogg_rewrite_copy_pages(ogg_rewrite *rewrite, off_t offset, uint32_t serial, int32_t seq_delta) {
+	ogg_stream *source;
+	int err;
+	
+	if (seq_delta == 0)
+		return ogg_rewrite_copy(rewrite, offset, rewrite->source_size - offset);
+	
+	/* Every header changes, so nothing is left to clone; a mapping lets
+	 * the page data go straight into the large writes */
+	source = ogg_stream_mmap_open_read(rewrite->filename);
+	if (source && source->io->size(source) != rewrite->source_size) {
+		/* Not the file that was opened to begin with */
+		ogg_stream_close(source);
+		source = NULL;
+	}
+	if (!source)
+		source = rewrite->source;
+	
+	if (source->io->seek(source, offset)) {
+		ogg_error = "Error seeking in original file";
+		err = OGG_INVALID;
+	} else {
+		err = ogg_stream_copy_pages(source, rewrite->stream, serial, seq_delta);
+	}
+	
+	if (source != rewrite->source)
+		ogg_stream_close(source);
+	return err;
+}
+
+int ogg_rewrite_commit(ogg_rewrite *rewrite) {
+	char path[64];
+	char *tmpname;
+	int i, ret = -1;
+	
+	if (fsync(rewrite->fd) < 0) {
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	
+	/* Give an unnamed file a temporary name next to the original */
+	if (!rewrite->tmpname) {
+		snprintf(path, sizeof (path), "/proc/self/fd/%d", rewrite->fd);
+		tmpname = malloc(strlen(rewrite->filename) + 32);
+		
+		for (i = 0; i < OGG_REWRITE_NAME_ATTEMPTS; i++) {
+			sprintf(tmpname, "%s.%d.%d", rewrite->filename, (int) getpid(), i);
+			ret = linkat(AT_FDCWD, path, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW);
+			if (ret == 0 || errno != EEXIST)
+				break;
+		}
+		if (ret < 0) {
+			ogg_error = strerror(errno);
+			free(tmpname);
+			return OGG_INVALID;
+		}
+		rewrite->tmpname = tmpname;
+	}
+	
+	if (rename(rewrite->tmpname, rewrite->filename) < 0) {
+		ogg_error = strerror(errno);
+		return OGG_INVALID;
+	}
+	rewrite->committed = true;
+	
+	return OGG_SUCCESS;
+}
+
+void ogg_rewrite_free(ogg_rewrite *rewrite) {
+	if (rewrite->tmpname && !rewrite->committed)
+		unlink(rewrite->tmpname);
+	
+	if (rewrite->stream)
+		ogg_stream_close(rewrite->stream);
+	else if (rewrite->fd >= 0)
+		close(rewrite->fd);
+	
+	if (rewrite->source)
+		ogg_stream_close(rewrite->source);
+	else if (rewrite->source_fd >= 0)
+		close(rewrite->source_fd);
+	
+	free(rewrite->tmpname);
+	free(rewrite->filename);
+	free(rewrite);
+}
@@ -0,0 +1,121 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:oggrewrite
+ * @short_description: Replacing an Ogg file with an edited copy
+ * @title: Ogg rewrite
+ *
+ * When a change to an Ogg file can't be made in place, the new file is
+ * assembled in an unnamed temporary file in the same directory, then linked
+ * over the original. New data is written through an #ogg_stream, and
+ * unchanged parts of the original are copied inside the kernel with
+ * FICLONERANGE or copy_file_range(), so on filesystems with reflinks they
+ * share storage with the original instead of being duplicated.
+ */
+
+#ifndef OGGREWRITE_H
+#define OGGREWRITE_H
+
+#include "ogg.h"
+
+typedef struct ogg_rewrite ogg_rewrite;
+
+/**
+ * ogg_rewrite_new:
+ * @filename: The path of the file to rewrite
+ *
+ * Start rewriting a file. The new contents are empty until written.
+ *
+ * Returns: A newly allocated #ogg_rewrite, which must be freed with
+ * ogg_rewrite_free(), or %NULL on an error - in which case #ogg_error will
+ * have a message.
+ */
+ogg_rewrite *ogg_rewrite_new(const char *filename);
+
+/**
+ * ogg_rewrite_stream:
+ * @rewrite: An #ogg_rewrite
+ *
+ * Get the stream to write new pages to. It is positioned at the end of
+ * everything written or copied so far.
+ *
+ * Returns: An #ogg_stream owned by @rewrite
+ */
+ogg_stream *ogg_rewrite_stream(ogg_rewrite *rewrite);
+
+/**
+ * ogg_rewrite_copy:
+ * @rewrite: An #ogg_rewrite
+ * @offset: The start of the range in the original file
+ * @len: The number of bytes to copy
+ *
+ * Append a range of the original file without reading it into memory
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_rewrite_copy(ogg_rewrite *rewrite, off_t offset, off_t len);
+
+/**
+ * ogg_rewrite_block_size:
+ * @rewrite: An #ogg_rewrite
+ *
+ * Get the block size of the new file. A range copied with ogg_rewrite_copy()
+ * is only cloned, sharing storage with the original, if its offsets in the
+ * old and new file are the same modulo the block size.
+ *
+ * Returns: The block size in bytes
+ */
+off_t ogg_rewrite_block_size(const ogg_rewrite *rewrite);
+
+/**
+ * ogg_rewrite_copy_pages:
+ * @rewrite: An #ogg_rewrite
+ * @offset: The offset of a page in the original file
+ * @serial: The logical bitstream to renumber
+ * @seq_delta: The amount to add to the page counter of each page of @serial
+ *
+ * Append the pages of the original file from @offset to the end, like
+ * ogg_stream_copy_pages(). If @seq_delta is 0 the rest of the file is copied
+ * as one range by the kernel. Otherwise every page of @serial gets a new
+ * header, and audio pages are far smaller than a filesystem block, so the
+ * pages pass through memory and are written in large batches instead.
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_rewrite_copy_pages(ogg_rewrite *rewrite, off_t offset, uint32_t serial, int32_t seq_delta);
+
+/**
+ * ogg_rewrite_commit:
+ * @rewrite: An #ogg_rewrite
+ *
+ * Flush the new file to disk and atomically replace the original with it
+ *
+ * Returns: 0 on success, otherwise a value from #ogg_error_codes and
+ * #ogg_error will contain a message
+ */
+int ogg_rewrite_commit(ogg_rewrite *rewrite);
+
+/**
+ * ogg_rewrite_free:
+ * @rewrite: The #ogg_rewrite to free
+ *
+ * Free a rewrite, discarding the new file if it wasn't committed
+ */
+void ogg_rewrite_free(ogg_rewrite *rewrite);
+
+#endif
@@ -0,0 +1,528 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "ogguring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* Number of read-ahead buffers per stream */
+#define OGG_URING_BUFFERS 4
+
+/* Size of each read-ahead buffer */
+#define OGG_URING_BUFFER_SIZE (256 * 1024)
+
+struct ogg_uring {
+	int fd;
+	unsigned int entries;
+	unsigned int to_submit;
+	unsigned int abandoned;
+	
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* A read that returned less than was asked for leaves its buffer partial,
+ * until the rest of the chunk is read */
+typedef enum {
+	OGG_URING_BUFFER_EMPTY = 0,
+	OGG_URING_BUFFER_PENDING,
+	OGG_URING_BUFFER_PARTIAL,
+	OGG_URING_BUFFER_READY,
+} ogg_uring_buffer_state;
+
+/* One read-ahead buffer, holding a chunk of the file */
+typedef struct ogg_uring_buffer {
+	uint8_t *data;
+	uint64_t chunk;
+	size_t len;
+	size_t want;
+	int state;
+	int error;
+} ogg_uring_buffer;
+
+typedef struct ogg_stream_uring {
+	ogg_uring *ring;
+	int fd;
+	off_t size;
+	off_t pos;
+	ogg_uring_buffer buffers[OGG_URING_BUFFERS];
+} ogg_stream_uring;
+
+static int ogg_uring_enter(ogg_uring *ring, unsigned int min_complete) {
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+	
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	
+	if (ret >= 0)
+		ring->to_submit -= ret < (int) ring->to_submit ? ret : ring->to_submit;
+	
+	return ret;
+}
+
+/* Mark the buffers of all completed reads as ready */
+static void ogg_uring_reap(ogg_uring *ring) {
+	unsigned int head, tail;
+	
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		ogg_uring_buffer *buffer = (ogg_uring_buffer *) (uintptr_t) cqe->user_data;
+		
+		/* Network filesystems may return less than was asked for
+		 * before the end of the file; only an empty read is the end */
+		if (cqe->res < 0) {
+			buffer->error = -cqe->res;
+			buffer->len = 0;
+			buffer->state = OGG_URING_BUFFER_READY;
+		} else if (cqe->res > 0 && buffer->len + cqe->res < buffer->want) {
+			buffer->len += cqe->res;
+			buffer->state = OGG_URING_BUFFER_PARTIAL;
+		} else {
+			buffer->len += cqe->res;
+			buffer->state = OGG_URING_BUFFER_READY;
+		}
+		
+		head++;
+	}
+	
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for at least one read to complete */
+static int ogg_uring_wait(ogg_uring *ring) {
+	if (ogg_uring_enter(ring, 1) < 0)
+		return -1;
+	ogg_uring_reap(ring);
+	return 0;
+}
+
+/* Queue a read of the rest of a buffer's chunk, after the bytes it has */
+static int ogg_uring_queue(ogg_stream_uring *uring, ogg_uring_buffer *buffer) {
+	ogg_uring *ring = uring->ring;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+	
+	/* Make room in the submission queue if it is full */
+	tail = *ring->sq_tail;
+	while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+		if (ogg_uring_enter(ring, 0) < 0)
+			return -1;
+	}
+	
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof (*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = uring->fd;
+	sqe->off = buffer->chunk * OGG_URING_BUFFER_SIZE + buffer->len;
+	sqe->addr = (uintptr_t) (buffer->data + buffer->len);
+	sqe->len = buffer->want - buffer->len;
+	sqe->user_data = (uintptr_t) buffer;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	
+	buffer->state = OGG_URING_BUFFER_PENDING;
+	
+	return 0;
+}
+
+/* Queue a read of one chunk of the file into a buffer */
+static int ogg_uring_submit(ogg_stream_uring *uring, ogg_uring_buffer *buffer, uint64_t chunk) {
+	off_t left = uring->size - (off_t) (chunk * OGG_URING_BUFFER_SIZE);
+	
+	buffer->chunk = chunk;
+	buffer->len = 0;
+	buffer->error = 0;
+	buffer->want = left < OGG_URING_BUFFER_SIZE ? (size_t) left : OGG_URING_BUFFER_SIZE;
+	
+	return ogg_uring_queue(uring, buffer);
+}
+
+/* Make sure reads are queued for the chunks following the current one */
+static void ogg_stream_uring_prefetch(ogg_stream_uring *uring, uint64_t chunk) {
+	uint64_t i;
+	
+	for (i = chunk; i < chunk + OGG_URING_BUFFERS; i++) {
+		ogg_uring_buffer *buffer = &uring->buffers[i % OGG_URING_BUFFERS];
+		
+		if ((off_t) (i * OGG_URING_BUFFER_SIZE) >= uring->size)
+			break;
+		if (buffer->state == OGG_URING_BUFFER_PENDING)
+			continue;
+		if (buffer->state == OGG_URING_BUFFER_READY && buffer->chunk == i)
+			continue;
+		if (buffer->state == OGG_URING_BUFFER_PARTIAL && buffer->chunk == i) {
+			if (ogg_uring_queue(uring, buffer))
+				break;
+			continue;
+		}
+		if (ogg_uring_submit(uring, buffer, i))
+			break;
+	}
+	
+	if (uring->ring->to_submit)
+		ogg_uring_enter(uring->ring, 0);
+}
+
+/* Get the buffer holding a chunk, waiting for its read if necessary */
+static ogg_uring_buffer *ogg_stream_uring_get(ogg_stream_uring *uring, uint64_t chunk) {
+	ogg_uring_buffer *buffer = &uring->buffers[chunk % OGG_URING_BUFFERS];
+	
+	ogg_stream_uring_prefetch(uring, chunk);
+	
+	while (buffer->state != OGG_URING_BUFFER_READY || buffer->chunk != chunk) {
+		if (buffer->state == OGG_URING_BUFFER_PARTIAL && buffer->chunk == chunk) {
+			if (ogg_uring_queue(uring, buffer))
+				return NULL;
+		} else if (buffer->state != OGG_URING_BUFFER_PENDING) {
+			if (ogg_uring_submit(uring, buffer, chunk))
+				return NULL;
+		}
+		if (ogg_uring_wait(uring->ring))
+			return NULL;
+	}
+	
+	if (buffer->error) {
+		errno = buffer->error;
+		return NULL;
+	}
+	
+	return buffer;
+}
+
+static size_t ogg_stream_uring_read(ogg_stream *stream, uint8_t *data, size_t len) {
+	ogg_stream_uring *uring = stream->priv;
+	size_t done = 0;
+	
+	while (done < len && uring->pos < uring->size) {
+		uint64_t chunk = uring->pos / OGG_URING_BUFFER_SIZE;
+		size_t offset = uring->pos % OGG_URING_BUFFER_SIZE;
+		ogg_uring_buffer *buffer;
+		size_t copy;
+		
+		buffer = ogg_stream_uring_get(uring, chunk);
+		if (!buffer || buffer->len <= offset)
+			break;
+		
+		copy = buffer->len - offset;
+		if (copy > len - done)
+			copy = len - done;
+		memcpy(data + done, buffer->data + offset, copy);
+		
+		uring->pos += copy;
+		done += copy;
+	}
+	
+	return done;
+}
+
+static size_t ogg_stream_uring_write(ogg_stream *stream, const uint8_t *buffer, size_t len) {
+	/* Read-only backend */
+	return 0;
+}
+
+static off_t ogg_stream_uring_tell(ogg_stream *stream) {
+	ogg_stream_uring *uring = stream->priv;
+	return uring->pos;
+}
+
+static int ogg_stream_uring_seek(ogg_stream *stream, off_t offset) {
+	ogg_stream_uring *uring = stream->priv;
+	
+	if (offset < 0)
+		return -1;
+	uring->pos = offset;
+	
+	return 0;
+}
+
+static off_t ogg_stream_uring_size(ogg_stream *stream) {
+	ogg_stream_uring *uring = stream->priv;
+	return uring->size;
+}
+
+static size_t ogg_stream_uring_pread(ogg_stream *stream, uint8_t *buffer, size_t len, off_t offset) {
+	ogg_stream_uring *uring = stream->priv;
+	size_t done = 0;
+	
+	/* Positional reads bypass the read-ahead buffers */
+	while (done < len) {
+		ssize_t ret = pread(uring->fd, buffer + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	
+	return done;
+}
+
+static void ogg_stream_uring_close(ogg_stream *stream) {
+	ogg_stream_uring *uring = stream->priv;
+	int i;
+	
+	/* The kernel may still be writing into the buffers. If the reads
+	 * can't be waited for, the buffers and the structure the completions
+	 * point to are leaked rather than freed under the kernel. */
+	for (i = 0; i < OGG_URING_BUFFERS; i++) {
+		while (uring->buffers[i].state == OGG_URING_BUFFER_PENDING) {
+			if (ogg_uring_wait(uring->ring)) {
+				ogg_error = "Failed to wait for pending reads";
+				uring->ring->abandoned++;
+				close(uring->fd);
+				ogg_stream_free(stream);
+				return;
+			}
+		}
+	}
+	
+	for (i = 0; i < OGG_URING_BUFFERS; i++)
+		free(uring->buffers[i].data);
+	close(uring->fd);
+	free(uring);
+	
+	ogg_stream_free(stream);
+}
+
+static ogg_stream_io_functions ogg_stream_uring_functions = {
+	ogg_stream_uring_read,
+	ogg_stream_uring_write,
+	ogg_stream_uring_tell,
+	ogg_stream_uring_seek,
+	ogg_stream_uring_size,
+	ogg_stream_uring_pread,
+	NULL,
+	NULL,
+	ogg_stream_uring_close
+};
+
+ogg_stream *ogg_stream_uring_open_read(ogg_uring *ring, const char *filename) {
+	ogg_stream *stream;
+	ogg_stream_uring *uring;
+	struct stat st;
+	int fd, i;
+	
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ogg_error = strerror(errno);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		ogg_error = strerror(errno);
+		close(fd);
+		return NULL;
+	}
+	
+	uring = calloc(1, sizeof (ogg_stream_uring));
+	uring->ring = ring;
+	uring->fd = fd;
+	uring->size = st.st_size;
+	for (i = 0; i < OGG_URING_BUFFERS; i++)
+		uring->buffers[i].data = malloc(OGG_URING_BUFFER_SIZE);
+	
+	stream = ogg_stream_new();
+	stream->io = &ogg_stream_uring_functions;
+	stream->priv = uring;
+	
+	/* Start reading before the first page is asked for */
+	ogg_stream_uring_prefetch(uring, 0);
+	
+	return stream;
+}
+
+/* IORING_OP_READ only came in Linux 5.6, after io_uring itself, and so did
+ * IORING_REGISTER_PROBE, so a kernel that can't be probed can't read */
+static bool ogg_uring_can_read(int fd) {
+	struct io_uring_probe *probe;
+	bool supported;
+	
+	probe = calloc(1, sizeof (struct io_uring_probe) +
+		(IORING_OP_READ + 1) * sizeof (struct io_uring_probe_op));
+	supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			probe, IORING_OP_READ + 1) == 0 &&
+		probe->ops_len > IORING_OP_READ &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	
+	return supported;
+}
+
+ogg_uring *ogg_uring_new(unsigned int max_streams) {
+	struct io_uring_params params;
+	ogg_uring *ring;
+	int fd;
+	
+	memset(&params, 0, sizeof (params));
+	fd = syscall(__NR_io_uring_setup, max_streams * OGG_URING_BUFFERS, &params);
+	if (fd < 0) {
+		ogg_error = strerror(errno);
+		return NULL;
+	}
+	if (!ogg_uring_can_read(fd)) {
+		ogg_error = "io_uring does not support reads on this kernel";
+		close(fd);
+		return NULL;
+	}
+	
+	ring = calloc(1, sizeof (ogg_uring));
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto error;
+	
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto error;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+	
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+	
+	ring->sq_head = (unsigned int *) ((uint8_t *) ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((uint8_t *) ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((uint8_t *) ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((uint8_t *) ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned int *) ((uint8_t *) ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((uint8_t *) ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((uint8_t *) ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ring + params.cq_off.cqes);
+	
+	return ring;
+
+error:
+	ogg_error = strerror(errno);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->cq_ring_size && ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	close(fd);
+	free(ring);
+	return NULL;
+}
+
+void ogg_uring_free(ogg_uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+size_t ogg_uring_batch_run(
+	const char *const *filenames,
+	size_t count,
+	unsigned int depth,
+	ogg_uring_batch_func func,
+	void *user_data
+) {
+	ogg_uring *ring;
+	ogg_stream **streams;
+	const char **errors;
+	size_t opened = 0, i, failed = 0;
+	
+	if (depth == 0)
+		depth = 1;
+	
+	ring = ogg_uring_new(depth);
+	streams = calloc(depth, sizeof (ogg_stream *));
+	errors = calloc(depth, sizeof (const char *));
+	
+	for (i = 0; i < count; i++) {
+		ogg_stream *stream;
+		
+		/* Keep the window of open files (and their queued reads) full */
+		while (opened < count && opened < i + depth) {
+			if (ring)
+				stream = ogg_stream_uring_open_read(ring, filenames[opened]);
+			else
+				stream = ogg_stream_file_open_read(filenames[opened]);
+			streams[opened % depth] = stream;
+			errors[opened % depth] = stream ? NULL : ogg_error;
+			opened++;
+		}
+		
+		stream = streams[i % depth];
+		if (!stream)
+			ogg_error = errors[i % depth];
+		if (func(stream, filenames[i], user_data))
+			failed++;
+		if (stream && ring) {
+			unsigned int abandoned = ring->abandoned;
+			
+			ogg_stream_close(stream);
+			if (ring->abandoned != abandoned)
+				failed++;
+		} else if (stream) {
+			ogg_stream_close(stream);
+		}
+		streams[i % depth] = NULL;
+	}
+	
+	free(errors);
+	free(streams);
+	if (ring)
+		ogg_uring_free(ring);
+	
+	return failed;
+}
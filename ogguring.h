@@ -0,0 +1,115 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * SECTION:ogguring
+ * @short_description: io_uring backed Ogg streams
+ * @title: Ogg io_uring
+ *
+ * An #ogg_stream backend that reads local files through a shared io_uring
+ * instance. Each stream keeps several read-ahead buffers in flight, so the
+ * parser rarely waits on the disk, and many streams can share one ring to
+ * keep reads for dozens of files queued on the device at once.
+ */
+
+#ifndef OGGURING_H
+#define OGGURING_H
+
+#include "ogg.h"
+
+#include <stddef.h>
+
+/**
+ * ogg_uring:
+ *
+ * An io_uring instance shared by a set of streams. It is not thread-safe;
+ * all of its streams must be used from the same thread.
+ */
+typedef struct ogg_uring ogg_uring;
+
+/**
+ * ogg_uring_batch_func:
+ * @stream: The open stream for @filename, or %NULL if it could not be opened,
+ *   in which case #ogg_error will have a message
+ * @filename: The file being processed
+ * @user_data: The user data passed to ogg_uring_batch_run()
+ *
+ * Callback processing one file of a batch. The stream is closed by the batch
+ * driver after the callback returns.
+ *
+ * Returns: 0 on success, or nonzero if processing the file failed
+ */
+typedef int (*ogg_uring_batch_func)(ogg_stream *stream, const char *filename, void *user_data);
+
+/**
+ * ogg_uring_new:
+ * @max_streams: The maximum number of streams that will be open at once
+ *
+ * Set up an io_uring instance with room for the read-ahead of @max_streams
+ * streams
+ *
+ * Returns: A newly allocated #ogg_uring, which must be freed with
+ * ogg_uring_free(), or %NULL if io_uring is not available or the kernel
+ * lacks IORING_OP_READ (before Linux 5.6) - in which case #ogg_error will
+ * have a message.
+ */
+ogg_uring *ogg_uring_new(unsigned int max_streams);
+
+/**
+ * ogg_uring_free:
+ * @ring: The #ogg_uring to free
+ *
+ * Tear down an io_uring instance. All of its streams must have been closed.
+ */
+void ogg_uring_free(ogg_uring *ring);
+
+/**
+ * ogg_stream_uring_open_read:
+ * @ring: The #ogg_uring to submit reads to
+ * @filename: The path to a local ogg file
+ *
+ * Open a local file in read-only mode, and immediately queue reads of its
+ * first few read-ahead buffers. Closing the stream waits for the reads still
+ * in flight; if that fails, its buffers are leaked and #ogg_error is set.
+ *
+ * Returns: A newly allocated #ogg_stream which must be freed with
+ * ogg_stream_close(), or %NULL on an error - in which case #ogg_error
+ * will have a message.
+ */
+ogg_stream *ogg_stream_uring_open_read(ogg_uring *ring, const char *filename);
+
+/**
+ * ogg_uring_batch_run:
+ * @filenames: The files to process
+ * @count: The number of entries in @filenames
+ * @depth: How many files to keep open, with reads queued, at once
+ * @func: Callback to process each file, called in order
+ * @user_data: User data passed to @func
+ *
+ * Process a list of files one at a time, while the reads for the next
+ * @depth files are already in flight. If io_uring is not available, the
+ * files are opened with ogg_stream_file_open_read() instead.
+ *
+ * Returns: The number of files for which @func returned nonzero, or whose
+ * stream could not be closed cleanly
+ */
+size_t ogg_uring_batch_run(
+	const char *const *filenames,
+	size_t count,
+	unsigned int depth,
+	ogg_uring_batch_func func,
+	void *user_data);
+
+#endif
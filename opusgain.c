@@ -0,0 +1,1331 @@
+/* 
+ * opusgain - Calculate EBU R128 and ReplayGain for Ogg Opus files
+ * Copyright © 2012 Calvin Walton <calvin.walton@kepstin.ca>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "gaincache.h"
+#include "ogg.h"
+#include "oggdemux.h"
+#include "oggopus.h"
+#include "bits.h"
+#include "ebur128/ebur128.h"
+#include "replaygain/gain_analysis.h"
+
+#include <opus_multistream.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* All Opus streams are decoded at 48 kHz */
+#define OPUSGAIN_RATE 48000
+
+/* The longest possible Opus packet, 120 ms */
+#define OPUSGAIN_MAX_FRAME 5760
+
+/* The EBU R128 reference level, in LUFS */
+#define OPUSGAIN_R128_REFERENCE -23.0
+
+#define OPUSGAIN_DEFAULT_PADDING 512
+
+/* Files are split into parts of at least this many bytes, one per thread at
+ * most, so that a single long file can use every core */
+#define OPUSGAIN_SPLIT_SIZE (16 * 1024 * 1024)
+
+/* Samples decoded and thrown away before each split point, so that the
+ * decoder has converged by the time the samples are analysed: the 80 ms
+ * that the Opus spec recommends when seeking */
+#define OPUSGAIN_PREROLL 3840
+
+/* Split points are moved onto a 100 ms grid from the start of the file, the
+ * EBU R128 block step and two ReplayGain windows, so that the blocks and
+ * windows of the parts line up with those of an unsplit analysis */
+#define OPUSGAIN_SPLIT_ALIGN 4800
+
+/* The number of recent pages remembered while looking for a pre-roll start */
+#define OPUSGAIN_SPLIT_HISTORY 64
+
+/* Cached results start with this, so that results from an older analysis
+ * aren't mistaken for current ones */
+#define OPUSGAIN_CACHE_VERSION 1
+
+/* The number of bins in the EBU R128 gating block histogram */
+#define OPUSGAIN_EBUR128_BINS 1000
+
+/* The longest cached results: the version, and for each histogram its first
+ * bin, its length and a count per bin, as varints of up to 5 bytes */
+#define OPUSGAIN_CACHE_MAX_RECORD \
+	(1 + 2 * 10 + (OPUSGAIN_EBUR128_BINS + GAIN_ANALYSIS_TABLE_SIZE) * 5)
+
+typedef struct opusgain_album opusgain_album;
+
+/**
+ * opusgain_file:
+ * @filename: The path of the file
+ * @size: The size of the file in bytes
+ * @album: The album the file belongs to
+ * @remaining: The number of parts still to be analysed
+ * @ebur128: EBU R128 state, with the blocks of all finished parts
+ * @rg_histogram: The ReplayGain histograms of the finished parts added
+ *   together, if the file is split, otherwise %NULL
+ * @track_loudness: The loudness of the file, once all parts are finished
+ * @track_rg: The ReplayGain of the file, once all parts are finished
+ * @failed: Whether the analysis of any part failed
+ * @key: The identity of the file when it was analysed, for the cache
+ * @cached: Whether the results were found in the cache
+ * @record: The results packed for the cache, if it is used, once all parts
+ *   are finished
+ * @record_len: The number of bytes in @record
+ *
+ * Analysis results for one file
+ */
+typedef struct opusgain_file {
+	char *filename;
+	off_t size;
+	opusgain_album *album;
+	size_t remaining;
+	ebur128_state *ebur128;
+	Uint32_t *rg_histogram;
+	double track_loudness;
+	Float_t track_rg;
+	bool failed;
+	gain_cache_key key;
+	bool cached;
+	uint8_t *record;
+	size_t record_len;
+} opusgain_file;
+
+/**
+ * opusgain_part:
+ * @file: The file the part belongs to
+ * @size: The number of bytes in the part, for scheduling
+ * @start: The offset of the page to start decoding at, or 0 to start after
+ *   the headers
+ * @start_granule: The granule position of the first sample decoded
+ * @begin: The granule position of the first sample to analyse
+ * @end: The granule position to stop analysing at, or %UINT64_MAX for the
+ *   end of the file
+ *
+ * A range of a file that is decoded and analysed by one worker. Decoding
+ * starts at least #OPUSGAIN_PREROLL samples before @begin, on a page that
+ * doesn't start with a continued packet.
+ */
+typedef struct opusgain_part {
+	opusgain_file *file;
+	off_t size;
+	off_t start;
+	uint64_t start_granule;
+	uint64_t begin;
+	uint64_t end;
+} opusgain_part;
+
+/**
+ * opusgain_album:
+ * @tracks: The files of the album
+ * @count: The number of entries in @tracks
+ * @remaining: The number of tracks still to be analysed
+ * @failed: Whether the analysis of any track failed
+ * @rg_histogram: The ReplayGain histograms of the finished tracks, added
+ *   together
+ *
+ * A group of files whose album gain is calculated together. The album is
+ * finished by the worker that analyses its last track.
+ */
+struct opusgain_album {
+	opusgain_file **tracks;
+	size_t count;
+	size_t remaining;
+	bool failed;
+	Uint32_t rg_histogram[GAIN_ANALYSIS_TABLE_SIZE];
+};
+
+typedef struct opusgain_batch opusgain_batch;
+
+/**
+ * opusgain_worker:
+ * @batch: The batch the worker belongs to
+ * @lock: Protects @queue, @next and @end, which other workers steal from
+ * @queue: The parts given to this worker, largest first
+ * @next: The index in @queue of the next part to analyse
+ * @end: The number of parts in @queue
+ * @rg: ReplayGain state, reused for every part
+ * @decoder: Decoder of the last file, reused if the next file has the same
+ *   channel layout
+ * @layout: The OpusHead that @decoder was created for
+ * @pcm: Decoded samples of one packet
+ * @pcm_channels: The number of channels @pcm has room for
+ * @left: Left channel samples for ReplayGain
+ * @right: Right channel samples for ReplayGain
+ * @buffer: Packets that span pages, copied into one piece
+ * @size: The number of bytes allocated for @buffer
+ *
+ * A thread analysing parts of files, with all buffers that can be reused from
+ * one part to the next
+ */
+typedef struct opusgain_worker {
+	pthread_t thread;
+	opusgain_batch *batch;
+	pthread_mutex_t lock;
+	opusgain_part **queue;
+	size_t next;
+	size_t end;
+	replaygain_t rg;
+	OpusMSDecoder *decoder;
+	oggopus_head layout;
+	float *pcm;
+	unsigned int pcm_channels;
+	Float_t left[OPUSGAIN_MAX_FRAME];
+	Float_t right[OPUSGAIN_MAX_FRAME];
+	uint8_t *buffer;
+	size_t size;
+} opusgain_worker;
+
+/**
+ * opusgain_batch:
+ * @workers: The worker threads
+ * @count: The number of entries in @workers
+ * @lock: Protects album completion, output, @cache and @err
+ * @padding: Padding to leave if the tags have to be rewritten
+ * @dry_run: Whether to only print the gains
+ * @header_gain: Whether to apply the album gain to the OpusHead output gain,
+ *   only rewriting the gain tags a file already has
+ * @cache: Results of earlier runs, or %NULL to analyse every file
+ * @err: Set if anything failed
+ */
+struct opusgain_batch {
+	opusgain_worker *workers;
+	size_t count;
+	pthread_mutex_t lock;
+	size_t padding;
+	bool dry_run;
+	bool header_gain;
+	gain_cache *cache;
+	int err;
+};
+
+/* The gains to store in the tags of a file, for set_gain_tags() */
+typedef struct opusgain_tags {
+	int16_t r128_track;
+	int16_t r128_album;
+	Float_t rg_track;
+	Float_t rg_album;
+} opusgain_tags;
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-a] [-H] [-n] [-c FILE] [-j THREADS] [-p BYTES] [-f LIST] [file.opus]...\n", name);
+	fprintf(stderr, "All files are analysed together as one album, unless -a is given.\n");
+	fprintf(stderr, "  -a          Treat the files in each directory as a separate album\n");
+	fprintf(stderr, "  -c FILE     Reuse the results of unchanged files from the cache FILE,\n");
+	fprintf(stderr, "              and store the results of the others there\n");
+	fprintf(stderr, "  -f LIST     Also read file names from LIST, one per line (- for stdin)\n");
+	fprintf(stderr, "  -H          Apply the album gain to the header output gain; only gain\n");
+	fprintf(stderr, "              tags already in a file are rewritten, relative to it\n");
+	fprintf(stderr, "  -j THREADS  Number of files to analyse at once (default: one per CPU)\n");
+	fprintf(stderr, "  -n          Only print the gains, don't write tags\n");
+	fprintf(stderr, "  -p BYTES    Padding to leave if the tags have to be rewritten (default %d)\n",
+		OPUSGAIN_DEFAULT_PADDING);
+}
+
+/* Tell ebur128 which speaker each channel is for, so that surround channels
+ * are weighted and the LFE channel is left out. Only mapping families 0 and
+ * 1 define the speaker layout; other channels are all counted equally. */
+static void set_ebur128_channels(ebur128_state *st, const oggopus_head *head) {
+	static const int layouts[8][8] = {
+		{ EBUR128_CENTER },
+		{ EBUR128_LEFT, EBUR128_RIGHT },
+		{ EBUR128_LEFT, EBUR128_CENTER, EBUR128_RIGHT },
+		{ EBUR128_LEFT, EBUR128_RIGHT, EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND },
+		{ EBUR128_LEFT, EBUR128_CENTER, EBUR128_RIGHT, EBUR128_LEFT_SURROUND,
+		  EBUR128_RIGHT_SURROUND },
+		{ EBUR128_LEFT, EBUR128_CENTER, EBUR128_RIGHT, EBUR128_LEFT_SURROUND,
+		  EBUR128_RIGHT_SURROUND, EBUR128_UNUSED },
+		{ EBUR128_LEFT, EBUR128_CENTER, EBUR128_RIGHT, EBUR128_LEFT_SURROUND,
+		  EBUR128_RIGHT_SURROUND, EBUR128_LEFT_SURROUND, EBUR128_UNUSED },
+		{ EBUR128_LEFT, EBUR128_CENTER, EBUR128_RIGHT, EBUR128_LEFT_SURROUND,
+		  EBUR128_RIGHT_SURROUND, EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND,
+		  EBUR128_UNUSED },
+	};
+	unsigned int i;
+	
+	for (i = 0; i < head->channels; i++) {
+		if (head->mapping_family <= 1 && head->channels <= 8)
+			ebur128_set_channel(st, i, layouts[head->channels - 1][i]);
+		else
+			ebur128_set_channel(st, i, EBUR128_CENTER);
+	}
+}
+
+/* Pick the front left and right channels for ReplayGain, which only handles
+ * stereo. Returns the number of channels to analyse. */
+static int replaygain_channels(const oggopus_head *head, int *left, int *right) {
+	*left = 0;
+	*right = 1;
+	if (head->channels == 1)
+		return 1;
+	
+	/* Vorbis channel order puts the center between left and right */
+	if (head->mapping_family == 1 && (head->channels == 3 || head->channels >= 5))
+		*right = 2;
+	return 2;
+}
+
+/* Get a contiguous copy of the packet data, avoiding the copy when the packet
+ * is on a single page */
+static const uint8_t *packet_data(const ogg_packet *packet, uint8_t **buffer, size_t *size) {
+	if (!packet->first.next)
+		return packet->first.page.data + packet->first.offset;
+	
+	if (*size < packet->data_len) {
+		*size = packet->data_len;
+		*buffer = realloc(*buffer, *size);
+	}
+	ogg_packet_flatten(packet, *buffer);
+	return *buffer;
+}
+
+/* Set up the worker's decoder for a file, reusing the one from the last file
+ * if the channel layout is the same */
+static int setup_decoder(opusgain_worker *worker, const oggopus_head *head) {
+	int ret;
+	
+	if (worker->decoder &&
+	    worker->layout.channels == head->channels &&
+	    worker->layout.stream_count == head->stream_count &&
+	    worker->layout.coupled_count == head->coupled_count &&
+	    !memcmp(worker->layout.mapping, head->mapping, head->channels)) {
+		opus_multistream_decoder_ctl(worker->decoder, OPUS_RESET_STATE);
+	} else {
+		if (worker->decoder)
+			opus_multistream_decoder_destroy(worker->decoder);
+		worker->decoder = opus_multistream_decoder_create(OPUSGAIN_RATE, head->channels,
+			head->stream_count, head->coupled_count, head->mapping, &ret);
+		if (ret != OPUS_OK) {
+			worker->decoder = NULL;
+			return ret;
+		}
+		worker->layout = *head;
+	}
+	
+	/* Measure what a player will output, including the header gain */
+	opus_multistream_decoder_ctl(worker->decoder, OPUS_SET_GAIN(head->output_gain));
+	
+	if (worker->pcm_channels < head->channels) {
+		worker->pcm_channels = head->channels;
+		worker->pcm = realloc(worker->pcm,
+			OPUSGAIN_MAX_FRAME * head->channels * sizeof (float));
+	}
+	
+	return OPUS_OK;
+}
+
+/* Move a split point forward onto the grid of #OPUSGAIN_SPLIT_ALIGN */
+static uint64_t align_split(uint64_t granule, uint64_t pre_skip) {
+	if (granule <= pre_skip || granule == UINT64_MAX)
+		return granule;
+	return pre_skip + (granule - pre_skip + OPUSGAIN_SPLIT_ALIGN - 1) /
+		OPUSGAIN_SPLIT_ALIGN * OPUSGAIN_SPLIT_ALIGN;
+}
+
+/* Decode the audio packets of one Opus stream of a part of a file, and feed
+ * the same PCM to both the EBU R128 and the ReplayGain analysis. In the
+ * first link the range of the part applies; later links are analysed whole. */
+static int analyse_link(opusgain_worker *worker, const opusgain_part *part, ogg_demux *demux, ogg_demux_stream *opus, const oggopus_head *head, bool first, ebur128_state **st) {
+	opusgain_file *file = part->file;
+	ogg_packet packet;
+	const uint8_t *data;
+	uint64_t pos = 0, begin = head->pre_skip, end = UINT64_MAX;
+	int rg_channels, rg_left, rg_right;
+	int err = -1, ret, i;
+	
+	ogg_packet_init(&packet);
+	
+	if (first && part->start != 0) {
+		/* Parts after the first are only made in files with a single
+		 * logical stream, so the demux already knows every page */
+		if (demux->stream->io->seek(demux->stream, part->start)) {
+			fprintf(stderr, "%s: Failed to seek to part\n", file->filename);
+			goto error;
+		}
+	} else {
+		/* Skip the OpusTags packet */
+		ret = ogg_demux_stream_read_packet(demux, opus, &packet);
+		if (ret != OGG_SUCCESS) {
+			fprintf(stderr, "%s: Failed to read Opus headers: %s\n",
+				file->filename, ogg_error);
+			goto error;
+		}
+	}
+	
+	ret = setup_decoder(worker, head);
+	if (ret != OPUS_OK) {
+		fprintf(stderr, "%s: Failed to create decoder: %s\n", file->filename,
+			opus_strerror(ret));
+		goto error;
+	}
+	
+	/* Every link adds its blocks to the same EBU R128 state */
+	if (!*st) {
+		*st = ebur128_init(head->channels, OPUSGAIN_RATE,
+			EBUR128_MODE_I | EBUR128_MODE_HISTOGRAM);
+	} else if ((*st)->channels != head->channels &&
+	           ebur128_change_parameters(*st, head->channels, OPUSGAIN_RATE) != EBUR128_SUCCESS) {
+		ebur128_destroy(st);
+	}
+	if (!*st) {
+		fprintf(stderr, "%s: Failed to initialize EBU R128 analysis\n", file->filename);
+		goto error;
+	}
+	set_ebur128_channels(*st, head);
+	rg_channels = replaygain_channels(head, &rg_left, &rg_right);
+	
+	/* Drop the decoder delay and pre-roll at the start, by granule
+	 * position */
+	if (first) {
+		pos = part->start_granule;
+		begin = align_split(part->begin, head->pre_skip);
+		if (begin < head->pre_skip)
+			begin = head->pre_skip;
+		end = align_split(part->end, head->pre_skip);
+	}
+	
+	while (pos < end && (ret = ogg_demux_stream_read_packet(demux, opus, &packet)) == OGG_SUCCESS) {
+		const ogg_packet_page *last = &packet.first;
+		float *frames;
+		uint64_t from, to;
+		int samples;
+		
+		data = packet_data(&packet, &worker->buffer, &worker->size);
+		samples = opus_multistream_decode_float(worker->decoder, data, packet.data_len,
+			worker->pcm, OPUSGAIN_MAX_FRAME, 0);
+		if (samples < 0) {
+			fprintf(stderr, "%s: Failed to decode packet: %s\n", file->filename,
+				opus_strerror(samples));
+			goto error;
+		}
+		
+		/* Samples after the granule position of the last page are
+		 * padding */
+		while (last->next)
+			last = last->next;
+		if ((last->page.type & OGG_PAGE_TYPE_EOS) &&
+		    packet.granule_pos != OGG_GRANULE_POS_NO_PACKET && packet.granule_pos < end)
+			end = packet.granule_pos;
+		
+		from = pos > begin ? pos : begin;
+		to = pos + samples < end ? pos + samples : end;
+		frames = worker->pcm + (from - pos) * head->channels;
+		pos += samples;
+		if (to <= from)
+			continue;
+		samples = to - from;
+		
+		ebur128_add_frames_float(*st, frames, samples);
+		
+		/* ReplayGain wants separate channels at 16 bit scale */
+		for (i = 0; i < samples; i++) {
+			worker->left[i] = frames[i * head->channels + rg_left] * 32768.0f;
+			worker->right[i] = frames[i * head->channels + rg_right] * 32768.0f;
+		}
+		if (AnalyzeSamples(&worker->rg, worker->left,
+		    rg_channels == 2 ? worker->right : NULL, samples,
+		    rg_channels) != GAIN_ANALYSIS_OK) {
+			fprintf(stderr, "%s: ReplayGain analysis failed\n", file->filename);
+			goto error;
+		}
+	}
+	if (pos < end && ret != OGG_END_OF_STREAM) {
+		fprintf(stderr, "%s: Failed to read Ogg packet: %s\n", file->filename, ogg_error);
+		goto error;
+	}
+	err = 0;
+
+error:
+	ogg_packet_clear(&packet);
+	
+	return err;
+}
+
+/* Analyse a part of a file. Pages are routed through a demux, so that only
+ * the first Opus stream of each link is decoded; the links of a chained
+ * file are analysed in turn, each with its own OpusHead, into the same
+ * state. */
+static int analyse_part(opusgain_worker *worker, const opusgain_part *part, ebur128_state **st) {
+	opusgain_file *file = part->file;
+	ogg_stream *stream;
+	ogg_demux demux;
+	ogg_demux_stream *logical, *opus = NULL;
+	ogg_page page;
+	oggopus_head head;
+	int err = -1, ret;
+	
+	ogg_page_init(&page);
+	
+	stream = ogg_stream_mmap_open_read(file->filename);
+	if (!stream) {
+		fprintf(stderr, "%s: Failed to open file: %s\n", file->filename, ogg_error);
+		return -1;
+	}
+	ogg_demux_init(&demux, stream);
+	demux.discard = true;
+	InitGainAnalysis(&worker->rg, OPUSGAIN_RATE);
+	
+	for (;;) {
+		ret = ogg_demux_read_page(&demux, &page, &logical);
+		if (ret == OGG_END_OF_STREAM && opus)
+			break;
+		if (ret != OGG_SUCCESS) {
+			fprintf(stderr, "%s: Failed to read Ogg page: %s\n", file->filename, ogg_error);
+			goto error;
+		}
+		if (!opus && !(page.type & OGG_PAGE_TYPE_BOS)) {
+			fprintf(stderr, "%s: File is not OggOpus\n", file->filename);
+			goto error;
+		}
+		
+		/* Pages of the other streams are left to the discard flag */
+		if (!(page.type & OGG_PAGE_TYPE_BOS) || (opus && opus->link == logical->link) ||
+		    oggopus_recognize(&page, &head)) {
+			ogg_page_clear(&page);
+			continue;
+		}
+		ogg_page_clear(&page);
+		
+		logical->discard = false;
+		if (analyse_link(worker, part, &demux, logical, &head, !opus, st))
+			goto error;
+		opus = logical;
+		
+		/* Only the last part goes on into the links after the first */
+		if (part->end != UINT64_MAX)
+			break;
+	}
+	err = 0;
+
+error:
+	ogg_page_clear(&page);
+	ogg_demux_clear(&demux);
+	ogg_stream_close(stream);
+	
+	return err;
+}
+
+/* Convert a loudness to an R128 gain in Q7.8 fixed point, relative to the
+ * header gain that was applied while decoding */
+static int16_t r128_gain(double loudness) {
+	double gain = round((OPUSGAIN_R128_REFERENCE - loudness) * 256.0);
+	
+	if (gain > INT16_MAX)
+		return INT16_MAX;
+	if (gain < INT16_MIN)
+		return INT16_MIN;
+	return gain;
+}
+
+/* Get the tags as they would be written, to compare them */
+static uint8_t *flatten_tags(const oggopus_tags *tags, size_t *len) {
+	uint8_t *data;
+	
+	*len = oggopus_tags_length(tags);
+	data = malloc(*len);
+	oggopus_tags_write(tags, data);
+	return data;
+}
+
+/* Returns %false if the tags already had these gains, so that the file isn't
+ * rewritten and keeps its identity in the cache */
+static bool set_gain_tags(oggopus_tags *tags, void *user) {
+	const opusgain_tags *gains = user;
+	uint8_t *before, *after;
+	size_t before_len, after_len;
+	char value[32];
+	bool changed;
+	
+	before = flatten_tags(tags, &before_len);
+	
+	snprintf(value, sizeof (value), "%d", gains->r128_track);
+	oggopus_tags_set(tags, "R128_TRACK_GAIN", value);
+	snprintf(value, sizeof (value), "%d", gains->r128_album);
+	oggopus_tags_set(tags, "R128_ALBUM_GAIN", value);
+	
+	/* Too short to analyse, so don't leave a misleading value */
+	if (gains->rg_track == GAIN_NOT_ENOUGH_SAMPLES) {
+		oggopus_tags_remove(tags, "REPLAYGAIN_TRACK_GAIN");
+		oggopus_tags_remove(tags, "REPLAYGAIN_ALBUM_GAIN");
+	} else {
+		snprintf(value, sizeof (value), "%.2f dB", gains->rg_track);
+		oggopus_tags_set(tags, "REPLAYGAIN_TRACK_GAIN", value);
+		snprintf(value, sizeof (value), "%.2f dB", gains->rg_album);
+		oggopus_tags_set(tags, "REPLAYGAIN_ALBUM_GAIN", value);
+	}
+	
+	after = flatten_tags(tags, &after_len);
+	changed = before_len != after_len || memcmp(before, after, before_len);
+	free(before);
+	free(after);
+	
+	return changed;
+}
+
+/* The tags that set_gain_tags() writes */
+static const char *const gain_tag_names[] = {
+	"R128_TRACK_GAIN", "R128_ALBUM_GAIN",
+	"REPLAYGAIN_TRACK_GAIN", "REPLAYGAIN_ALBUM_GAIN",
+	NULL
+};
+
+/* Whether the tags have any of the gains that set_gain_tags() writes */
+static bool has_gain_tags(const oggopus_tags *tags) {
+	uint32_t i;
+	size_t j;
+	
+	for (i = 0; i < tags->count; i++) {
+		const oggopus_comment *comment = &tags->comments[i];
+		
+		for (j = 0; gain_tag_names[j]; j++) {
+			size_t name_len = strlen(gain_tag_names[j]);
+			
+			if (comment->length > name_len && comment->data[name_len] == '=' &&
+			    !strncasecmp(comment->data, gain_tag_names[j], name_len))
+				return true;
+		}
+	}
+	
+	return false;
+}
+
+/* The gain tags are relative to the header gain, so once the album gain is in
+ * the header, tags left from an earlier run would have players apply it
+ * twice. Files without gain tags don't get them. */
+static bool rebase_gain_tags(oggopus_tags *tags, void *user) {
+	if (!has_gain_tags(tags))
+		return false;
+	return set_gain_tags(tags, user);
+}
+
+/* Write the gains to the tags of a file. Only the gain tags are read at
+ * first, so that a file that already has these gains, or has none to rebase,
+ * is left alone without reading the rest of its tags. */
+static int write_gain_tags(const char *filename, opusgain_tags *gains, bool rebase, size_t padding) {
+	oggopus_tags tags;
+	bool needed;
+	int ret;
+	
+	oggopus_tags_init(&tags);
+	ret = oggopus_read_tags(filename, &tags, gain_tag_names);
+	if (ret != OGG_SUCCESS)
+		goto error;
+	needed = rebase ? rebase_gain_tags(&tags, gains) : set_gain_tags(&tags, gains);
+	if (needed)
+		ret = oggopus_update_tags(filename, rebase ? rebase_gain_tags : set_gain_tags,
+			gains, padding);
+
+error:
+	oggopus_tags_clear(&tags);
+	return ret;
+}
+
+/* Pack a histogram as the index of its first non-zero bin, the number of bins
+ * up to the last non-zero one, and their counts, all as varints */
+static size_t pack_histogram(uint8_t *out, const Uint32_t *histogram, size_t bins) {
+	size_t first = 0, last = bins, len = 0, i;
+	
+	while (first < bins && !histogram[first])
+		first++;
+	while (last > first && !histogram[last - 1])
+		last--;
+	
+	len += write_varint(&out[len], first);
+	len += write_varint(&out[len], last - first);
+	for (i = first; i < last; i++)
+		len += write_varint(&out[len], histogram[i]);
+	return len;
+}
+
+/* Add the counts of a packed histogram to @histogram. Returns the number of
+ * bytes used, or 0 if the data is bad. */
+static size_t unpack_histogram(const uint8_t *in, size_t len, Uint32_t *histogram, size_t bins) {
+	uint64_t first, count, value;
+	size_t used, pos = 0, i;
+	
+	if (!(used = read_varint(&in[pos], len - pos, &first)))
+		return 0;
+	pos += used;
+	if (!(used = read_varint(&in[pos], len - pos, &count)))
+		return 0;
+	pos += used;
+	if (first > bins || count > bins - first)
+		return 0;
+	
+	for (i = 0; i < count; i++) {
+		if (!(used = read_varint(&in[pos], len - pos, &value)) || value > UINT32_MAX)
+			return 0;
+		pos += used;
+		histogram[first + i] += value;
+	}
+	return pos;
+}
+
+/* Pack the EBU R128 and ReplayGain histograms of a file for the cache. The
+ * loudness and gains are calculated from these exactly as after decoding. */
+static uint8_t *pack_results(const opusgain_file *file, size_t *len) {
+	unsigned long blocks[OPUSGAIN_EBUR128_BINS];
+	Uint32_t counts[OPUSGAIN_EBUR128_BINS];
+	uint8_t *record = malloc(OPUSGAIN_CACHE_MAX_RECORD);
+	size_t i;
+	
+	ebur128_get_histogram(file->ebur128, blocks);
+	for (i = 0; i < OPUSGAIN_EBUR128_BINS; i++)
+		counts[i] = blocks[i];
+	
+	record[0] = OPUSGAIN_CACHE_VERSION;
+	*len = 1;
+	*len += pack_histogram(&record[*len], counts, OPUSGAIN_EBUR128_BINS);
+	*len += pack_histogram(&record[*len], file->rg_histogram, GAIN_ANALYSIS_TABLE_SIZE);
+	return realloc(record, *len);
+}
+
+/* Set up a file from its cached results, as if all of its parts had just
+ * been analysed. Returns 0, or -1 if the results are bad. */
+static int unpack_results(opusgain_file *file, const uint8_t *record, size_t len) {
+	unsigned long blocks[OPUSGAIN_EBUR128_BINS];
+	Uint32_t counts[OPUSGAIN_EBUR128_BINS] = { 0 };
+	size_t pos = 1, used, i;
+	
+	if (len < 1 || record[0] != OPUSGAIN_CACHE_VERSION)
+		return -1;
+	if (!(used = unpack_histogram(&record[pos], len - pos, counts, OPUSGAIN_EBUR128_BINS)))
+		return -1;
+	pos += used;
+	file->rg_histogram = calloc(GAIN_ANALYSIS_TABLE_SIZE, sizeof (Uint32_t));
+	if (!(used = unpack_histogram(&record[pos], len - pos, file->rg_histogram,
+	    GAIN_ANALYSIS_TABLE_SIZE)) || pos + used != len) {
+		free(file->rg_histogram);
+		file->rg_histogram = NULL;
+		return -1;
+	}
+	
+	/* The channel layout only matters while adding frames */
+	file->ebur128 = ebur128_init(1, OPUSGAIN_RATE, EBUR128_MODE_I | EBUR128_MODE_HISTOGRAM);
+	if (!file->ebur128) {
+		free(file->rg_histogram);
+		file->rg_histogram = NULL;
+		return -1;
+	}
+	for (i = 0; i < OPUSGAIN_EBUR128_BINS; i++)
+		blocks[i] = counts[i];
+	ebur128_add_histogram(file->ebur128, blocks);
+	
+	file->record = malloc(len);
+	memcpy(file->record, record, len);
+	file->record_len = len;
+	return 0;
+}
+
+/* Calculate the album gain once all of its tracks are analysed, and write
+ * the tags of every track */
+static void finish_album(opusgain_batch *batch, opusgain_album *album) {
+	ebur128_state **states;
+	double album_loudness;
+	Float_t album_rg;
+	struct stat st;
+	size_t i;
+	int ret;
+	
+	if (album->failed) {
+		pthread_mutex_lock(&batch->lock);
+		fprintf(stderr, "Skipping album of %s, not all tracks could be analysed\n",
+			album->tracks[0]->filename);
+		batch->err = 1;
+		pthread_mutex_unlock(&batch->lock);
+		goto done;
+	}
+	
+	states = malloc(album->count * sizeof (ebur128_state *));
+	for (i = 0; i < album->count; i++)
+		states[i] = album->tracks[i]->ebur128;
+	ebur128_loudness_global_multiple(states, album->count, &album_loudness);
+	free(states);
+	album_rg = GetAccumulatedGain(album->rg_histogram);
+	
+	/* Keep the lines of an album together */
+	pthread_mutex_lock(&batch->lock);
+	for (i = 0; i < album->count; i++)
+		printf("%s: %.2f LUFS, ReplayGain %.2f dB\n", album->tracks[i]->filename,
+			album->tracks[i]->track_loudness, album->tracks[i]->track_rg);
+	printf("Album: %.2f LUFS, ReplayGain %.2f dB\n", album_loudness, album_rg);
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+	
+	for (i = 0; i < album->count && !batch->dry_run; i++) {
+		opusgain_file *file = album->tracks[i];
+		opusgain_tags gains = {
+			.r128_track = r128_gain(file->track_loudness),
+			.r128_album = r128_gain(album_loudness),
+			.rg_track = file->track_rg,
+			.rg_album = album_rg,
+		};
+		
+		/* Normalising through the header only needs the first page
+		 * rewritten, and the tags only if they already have gains */
+		if (batch->header_gain) {
+			int applied = 0;
+			
+			ret = OGG_SUCCESS;
+			if (gains.r128_album != 0)
+				ret = oggopus_adjust_output_gain(file->filename, gains.r128_album, &applied);
+			/* An unchanged header gain leaves the tags as they are */
+			if (ret == OGG_SUCCESS && applied != 0) {
+				gains.r128_track = r128_gain(file->track_loudness + applied / 256.0);
+				gains.r128_album = r128_gain(album_loudness + applied / 256.0);
+				if (gains.rg_track != GAIN_NOT_ENOUGH_SAMPLES) {
+					gains.rg_track -= applied / 256.0;
+					gains.rg_album -= applied / 256.0;
+				}
+				ret = write_gain_tags(file->filename, &gains, true, batch->padding);
+			}
+		} else {
+			ret = write_gain_tags(file->filename, &gains, false, batch->padding);
+		}
+		if (ret != OGG_SUCCESS) {
+			pthread_mutex_lock(&batch->lock);
+			fprintf(stderr, "%s: Failed to write gain: %s\n", file->filename, ogg_error);
+			batch->err = 1;
+			pthread_mutex_unlock(&batch->lock);
+		}
+	}
+	
+	/* Writing the tags gives a file a new identity but leaves the audio
+	 * alone, so the results are stored under the new one. A new header
+	 * gain changes the audio, so the file has to be analysed again. */
+	for (i = 0; i < album->count && batch->cache; i++) {
+		opusgain_file *file = album->tracks[i];
+		gain_cache_key key;
+		
+		if (batch->header_gain && !batch->dry_run && r128_gain(album_loudness) != 0)
+			break;
+		if (!file->record || stat(file->filename, &st))
+			continue;
+		gain_cache_key_init(&key, &st);
+		if (file->cached && !memcmp(&key, &file->key, sizeof (gain_cache_key)))
+			continue;
+		pthread_mutex_lock(&batch->lock);
+		gain_cache_add(batch->cache, &key, file->record, file->record_len);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+done:
+	/* Only the album gain needed these, so free them as early as possible */
+	for (i = 0; i < album->count; i++) {
+		if (album->tracks[i]->ebur128)
+			ebur128_destroy(&album->tracks[i]->ebur128);
+		free(album->tracks[i]->record);
+		album->tracks[i]->record = NULL;
+	}
+}
+
+/* Take the next part for a worker: its own largest remaining part, or else
+ * the largest remaining part of another worker */
+static opusgain_part *next_part(opusgain_worker *worker) {
+	opusgain_batch *batch = worker->batch;
+	opusgain_part *part = NULL;
+	size_t self = worker - batch->workers, i;
+	
+	for (i = 0; i < batch->count && !part; i++) {
+		opusgain_worker *victim = &batch->workers[(self + i) % batch->count];
+		
+		pthread_mutex_lock(&victim->lock);
+		if (victim->next < victim->end)
+			part = victim->queue[victim->next++];
+		pthread_mutex_unlock(&victim->lock);
+	}
+	
+	return part;
+}
+
+/* Add a file whose parts are all finished to its album, and pack its
+ * results for the cache. Returns whether that finished the album. Must be
+ * called with the batch lock held. */
+static bool finish_file(opusgain_batch *batch, opusgain_file *file) {
+	opusgain_album *album = file->album;
+	size_t i;
+	
+	if (file->failed) {
+		album->failed = true;
+	} else {
+		ebur128_loudness_global(file->ebur128, &file->track_loudness);
+		if (file->rg_histogram) {
+			file->track_rg = GetAccumulatedGain(file->rg_histogram);
+			for (i = 0; i < GAIN_ANALYSIS_TABLE_SIZE; i++)
+				album->rg_histogram[i] += file->rg_histogram[i];
+		}
+		if (batch->cache && !file->record)
+			file->record = pack_results(file, &file->record_len);
+	}
+	free(file->rg_histogram);
+	file->rg_histogram = NULL;
+	
+	return --album->remaining == 0;
+}
+
+/* Add the results of a part to its file. Returns whether that finished the
+ * album. Must be called with the batch lock held. */
+static bool finish_part(opusgain_worker *worker, opusgain_part *part, ebur128_state **st, bool failed) {
+	opusgain_file *file = part->file;
+	
+	if (failed) {
+		file->failed = true;
+	} else if (!file->ebur128) {
+		file->ebur128 = *st;
+		*st = NULL;
+	} else {
+		ebur128_merge_histogram(file->ebur128, *st);
+	}
+	
+	/* The cache needs the histogram of the whole file, not just the
+	 * album's */
+	if (!failed && !file->rg_histogram && worker->batch->cache)
+		file->rg_histogram = calloc(GAIN_ANALYSIS_TABLE_SIZE, sizeof (Uint32_t));
+	if (!failed && file->rg_histogram)
+		AccumulateAlbumGain(file->rg_histogram, &worker->rg);
+	else if (!failed)
+		AccumulateAlbumGain(file->album->rg_histogram, &worker->rg);
+	
+	if (--file->remaining > 0)
+		return false;
+	return finish_file(worker->batch, file);
+}
+
+static void *worker_main(void *data) {
+	opusgain_worker *worker = data;
+	opusgain_batch *batch = worker->batch;
+	opusgain_part *part;
+	
+	while ((part = next_part(worker))) {
+		ebur128_state *st = NULL;
+		Float_t rg = 0;
+		bool failed, last;
+		
+		failed = analyse_part(worker, part, &st) != 0;
+		if (!failed)
+			rg = GetTitleGain(&worker->rg);
+		
+		pthread_mutex_lock(&batch->lock);
+		if (!part->file->rg_histogram)
+			part->file->track_rg = rg;
+		last = finish_part(worker, part, &st, failed);
+		pthread_mutex_unlock(&batch->lock);
+		
+		if (st)
+			ebur128_destroy(&st);
+		if (last)
+			finish_album(batch, part->file->album);
+	}
+	
+	return NULL;
+}
+
+/* Sort parts by size, largest first */
+static int compare_size(const void *a, const void *b) {
+	const opusgain_part *pa = *(opusgain_part * const *) a;
+	const opusgain_part *pb = *(opusgain_part * const *) b;
+	
+	if (pa->size != pb->size)
+		return pa->size < pb->size ? 1 : -1;
+	return 0;
+}
+
+/* Split a file into parts at page boundaries, aiming for equal numbers of
+ * bytes. Each split point is a page that doesn't start with a continued
+ * packet, and with an earlier such page at least #OPUSGAIN_PREROLL samples
+ * before it to start decoding from. Files that are too small or can't be
+ * split are analysed in one part, and so are multiplexed files and chained
+ * files whose next link starts before the last split point. */
+static void split_file(opusgain_file *file, size_t max_parts, opusgain_part **parts, size_t *count, size_t *allocated) {
+	struct {
+		off_t offset;
+		uint64_t granule;
+	} history[OPUSGAIN_SPLIT_HISTORY];
+	size_t history_count = 0, first = *count, n = 1, k, i;
+	ogg_stream *stream = NULL;
+	ogg_page_info info;
+	opusgain_part *part;
+	uint64_t granule = 0;
+	uint32_t serial = 0;
+	int headers = 0;
+	
+	if (max_parts > 1 && file->size >= 2 * OPUSGAIN_SPLIT_SIZE)
+		n = file->size / OPUSGAIN_SPLIT_SIZE;
+	if (n > max_parts)
+		n = max_parts;
+	if (n > 1)
+		stream = ogg_stream_mmap_open_read(file->filename);
+	
+	if (*count + n > *allocated) {
+		*allocated = (*count + n) * 2;
+		*parts = realloc(*parts, *allocated * sizeof (opusgain_part));
+	}
+	part = &(*parts)[(*count)++];
+	*part = (opusgain_part) { .file = file, .end = UINT64_MAX };
+	
+	/* Walk the page headers, without reading any page data */
+	for (k = 1; stream && k < n && ogg_page_read_info(&info, stream) == OGG_SUCCESS; ) {
+		if (headers == 0)
+			serial = info.serial;
+		
+		/* Parts after the first can only start on pages of a single
+		 * logical stream; later links are left to the last part */
+		if (info.serial != serial || (headers > 0 && (info.type & OGG_PAGE_TYPE_BOS))) {
+			*count = first + 1;
+			part = &(*parts)[first];
+			part->end = UINT64_MAX;
+			break;
+		}
+		
+		/* Audio starts after the pages with the OpusHead and OpusTags */
+		if (headers >= 2 && !(info.type & OGG_PAGE_TYPE_CONTINUED)) {
+			history[history_count % OPUSGAIN_SPLIT_HISTORY].offset = info.offset;
+			history[history_count % OPUSGAIN_SPLIT_HISTORY].granule = granule;
+			history_count++;
+			
+			for (i = 1; info.offset >= file->size * k / n && i < history_count &&
+			     i <= OPUSGAIN_SPLIT_HISTORY; i++) {
+				size_t j = (history_count - i) % OPUSGAIN_SPLIT_HISTORY;
+				
+				if (history[j].granule + OPUSGAIN_PREROLL > granule)
+					continue;
+				
+				part->end = granule;
+				part = &(*parts)[(*count)++];
+				*part = (opusgain_part) {
+					.file = file,
+					.start = history[j].offset,
+					.start_granule = history[j].granule,
+					.begin = granule,
+					.end = UINT64_MAX,
+				};
+				k++;
+				break;
+			}
+		}
+		
+		if (info.granule_pos != OGG_GRANULE_POS_NO_PACKET) {
+			granule = info.granule_pos;
+			if (headers < 2)
+				headers++;
+		}
+	}
+	if (stream)
+		ogg_stream_close(stream);
+	
+	/* The size of each part, from where its analysis begins */
+	for (i = first; i < *count; i++) {
+		off_t from = i == first ? 0 : (*parts)[i].start;
+		off_t to = i + 1 < *count ? (*parts)[i + 1].start : file->size;
+		
+		(*parts)[i].size = to - from;
+	}
+	file->remaining = *count - first;
+	if (file->remaining > 1)
+		file->rg_histogram = calloc(GAIN_ANALYSIS_TABLE_SIZE, sizeof (Uint32_t));
+}
+
+/* The length of the directory part of a file name */
+static size_t directory_length(const char *filename) {
+	const char *slash = strrchr(filename, '/');
+	
+	return slash ? slash - filename : 0;
+}
+
+static bool same_directory(const opusgain_file *a, const opusgain_file *b) {
+	size_t len = directory_length(a->filename);
+	
+	return len == directory_length(b->filename) && !memcmp(a->filename, b->filename, len);
+}
+
+/* Sort files by directory, keeping the order of files within a directory */
+static int compare_directory(const void *a, const void *b) {
+	const opusgain_file *fa = *(opusgain_file * const *) a;
+	const opusgain_file *fb = *(opusgain_file * const *) b;
+	size_t la = directory_length(fa->filename);
+	size_t lb = directory_length(fb->filename);
+	int ret;
+	
+	ret = memcmp(fa->filename, fb->filename, la < lb ? la : lb);
+	if (ret)
+		return ret;
+	if (la != lb)
+		return la < lb ? -1 : 1;
+	return fa < fb ? -1 : fa > fb;
+}
+
+/* Group the files into albums, either all together or by directory. The
+ * albums point into @files, which is sorted by directory. */
+static opusgain_album *make_albums(opusgain_file **files, size_t count, bool by_directory, size_t *album_count) {
+	opusgain_album *albums;
+	size_t i, start;
+	
+	if (by_directory)
+		qsort(files, count, sizeof (opusgain_file *), compare_directory);
+	
+	albums = calloc(by_directory ? count : 1, sizeof (opusgain_album));
+	*album_count = 0;
+	for (start = 0, i = 1; i <= count; i++) {
+		opusgain_album *album;
+		
+		if (i < count && (!by_directory || same_directory(files[start], files[i])))
+			continue;
+		
+		album = &albums[(*album_count)++];
+		album->tracks = &files[start];
+		album->count = album->remaining = i - start;
+		for (; start < i; start++)
+			files[start]->album = album;
+	}
+	
+	return albums;
+}
+
+/* Add the file names listed in a file, one per line */
+static int read_file_list(const char *list, opusgain_file **files, size_t *count, size_t *allocated) {
+	FILE *in = strcmp(list, "-") ? fopen(list, "r") : stdin;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	
+	if (!in) {
+		fprintf(stderr, "Failed to open file list: %s\n", list);
+		return -1;
+	}
+	
+	while ((len = getline(&line, &line_size, in)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (*count == *allocated) {
+			*allocated = *allocated ? *allocated * 2 : 64;
+			*files = realloc(*files, *allocated * sizeof (opusgain_file));
+		}
+		memset(&(*files)[*count], 0, sizeof (opusgain_file));
+		(*files)[(*count)++].filename = strdup(line);
+	}
+	
+	free(line);
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	opusgain_batch batch = { .padding = OPUSGAIN_DEFAULT_PADDING };
+	opusgain_file *files = NULL;
+	opusgain_file **grouped = NULL;
+	opusgain_part *parts = NULL, **order = NULL;
+	opusgain_album *albums = NULL;
+	gain_cache cache;
+	const char *cache_file = NULL;
+	const uint8_t *record;
+	size_t record_len;
+	size_t count = 0, allocated = 0, album_count = 0, threads = 0, started, i;
+	size_t part_count = 0, parts_allocated = 0;
+	bool by_directory = false;
+	struct stat st;
+	int opt, err = 0;
+	char *end;
+	
+	pthread_mutex_init(&batch.lock, NULL);
+	
+	while ((opt = getopt(argc, argv, "ac:f:Hj:np:")) != -1) {
+		switch (opt) {
+		case 'a':
+			by_directory = true;
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'f':
+			if (read_file_list(optarg, &files, &count, &allocated)) {
+				err = 1;
+				goto error;
+			}
+			break;
+		case 'H':
+			batch.header_gain = true;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 10);
+			if (*end || end == optarg || threads == 0) {
+				fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+				err = 1;
+				goto error;
+			}
+			break;
+		case 'n':
+			batch.dry_run = true;
+			break;
+		case 'p':
+			batch.padding = strtoul(optarg, &end, 10);
+			if (*end || end == optarg || batch.padding > 255*255) {
+				fprintf(stderr, "Invalid padding size: %s\n", optarg);
+				err = 1;
+				goto error;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			err = 1;
+			goto error;
+		}
+	}
+	
+	for (; optind < argc; optind++) {
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			files = realloc(files, allocated * sizeof (opusgain_file));
+		}
+		memset(&files[count], 0, sizeof (opusgain_file));
+		files[count++].filename = strdup(argv[optind]);
+	}
+	if (count == 0) {
+		usage(argv[0]);
+		err = 1;
+		goto error;
+	}
+	
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		
+		threads = cpus > 0 ? cpus : 1;
+	}
+	
+	if (cache_file) {
+		if (gain_cache_open(&cache, cache_file) != OGG_SUCCESS)
+			fprintf(stderr, "Not using the old cache file %s: %s\n", cache_file, ogg_error);
+		batch.cache = &cache;
+	}
+	
+	/* Files that haven't changed since their results were cached don't
+	 * need to be opened at all */
+	grouped = malloc(count * sizeof (opusgain_file *));
+	for (i = 0; i < count; i++) {
+		grouped[i] = &files[i];
+		if (!stat(files[i].filename, &st)) {
+			files[i].size = st.st_size;
+			gain_cache_key_init(&files[i].key, &st);
+			if (batch.cache &&
+			    gain_cache_lookup(batch.cache, &files[i].key, &record, &record_len) &&
+			    unpack_results(&files[i], record, record_len) == 0) {
+				files[i].cached = true;
+				continue;
+			}
+		}
+		split_file(&files[i], threads, &parts, &part_count, &parts_allocated);
+	}
+	albums = make_albums(grouped, count, by_directory, &album_count);
+	
+	/* Albums with every track cached are finished before any decoding */
+	for (i = 0; i < count; i++) {
+		bool last;
+		
+		if (!files[i].cached)
+			continue;
+		pthread_mutex_lock(&batch.lock);
+		last = finish_file(&batch, &files[i]);
+		pthread_mutex_unlock(&batch.lock);
+		if (last)
+			finish_album(&batch, files[i].album);
+	}
+	
+	/* Start the largest parts first, so that a long file doesn't hold up
+	 * the end of the run; a worker's queue is in the same order */
+	order = malloc(part_count * sizeof (opusgain_part *));
+	for (i = 0; i < part_count; i++)
+		order[i] = &parts[i];
+	qsort(order, part_count, sizeof (opusgain_part *), compare_size);
+	
+	if (threads > part_count)
+		threads = part_count;
+	
+	/* Deal the parts out in turn, so that every worker starts with a share
+	 * of the large ones; idle workers steal from the others later */
+	batch.count = threads;
+	batch.workers = calloc(threads, sizeof (opusgain_worker));
+	for (i = 0; i < threads; i++) {
+		opusgain_worker *worker = &batch.workers[i];
+		size_t j;
+		
+		worker->batch = &batch;
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->queue = malloc((part_count / threads + 1) * sizeof (opusgain_part *));
+		for (j = i; j < part_count; j += threads)
+			worker->queue[worker->end++] = order[j];
+	}
+	
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&batch.workers[started].thread, NULL, worker_main,
+		    &batch.workers[started])) {
+			fprintf(stderr, "Failed to start worker thread, continuing with %zu\n",
+				started);
+			break;
+		}
+	}
+	/* Workers steal from every queue, so the ones running finish the
+	 * queues of any that failed to start */
+	if (started == 0 && threads > 0)
+		worker_main(&batch.workers[0]);
+	for (i = 0; i < started; i++)
+		pthread_join(batch.workers[i].thread, NULL);
+	
+	for (i = 0; i < threads; i++) {
+		opusgain_worker *worker = &batch.workers[i];
+		
+		if (worker->decoder)
+			opus_multistream_decoder_destroy(worker->decoder);
+		free(worker->pcm);
+		free(worker->buffer);
+		free(worker->queue);
+		pthread_mutex_destroy(&worker->lock);
+	}
+	free(batch.workers);
+	if (batch.err)
+		err = 1;
+	
+	if (batch.cache && gain_cache_commit(batch.cache) != OGG_SUCCESS) {
+		fprintf(stderr, "Failed to write cache file %s: %s\n", cache_file, ogg_error);
+		err = 1;
+	}
+
+error:
+	for (i = 0; i < count; i++) {
+		free(files[i].filename);
+		free(files[i].rg_histogram);
+		free(files[i].record);
+	}
+	free(files);
+	free(order);
+	free(parts);
+	free(grouped);
+	free(albums);
+	if (batch.cache)
+		gain_cache_clear(batch.cache);
+	pthread_mutex_destroy(&batch.lock);
+	
+	return err;
+}
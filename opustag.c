@@ -14,81 +14,337 @@
  */
 
 #include "ogg.h"
+#include "oggdemux.h"
 #include "oggopus.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Padding to leave after the comments when the tags have to be rewritten,
+ * so that later changes to the gain tags can be made in place */
+#define OPUSTAG_DEFAULT_PADDING 512
+
+/* A tag change from the command line; a %NULL value removes the tag */
+typedef struct tag_edit {
+	const char *name;
+	const char *value;
+} tag_edit;
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-p BYTES] [-s NAME=VALUE]... [-d NAME]... input.opus|- [output.opus]\n", name);
+	fprintf(stderr, "       %s -g input.opus\n", name);
+	fprintf(stderr, "Without an output file, the input file is updated in place.\n");
+	fprintf(stderr, "If the tags no longer fit, the file is rewritten with BYTES of padding\n");
+	fprintf(stderr, "after the tags (default %d).\n", OPUSTAG_DEFAULT_PADDING);
+	fprintf(stderr, "With -g, only the R128_* and REPLAYGAIN_* tags are shown, and the other\n");
+	fprintf(stderr, "tags such as cover art are skipped over without being read.\n");
+}
+
+/* The tags that -g shows */
+static const char *const gain_tag_names[] = { "R128_*", "REPLAYGAIN_*", NULL };
+
+/* Read the pages of the OpusTags packet, up to the page that it ends on */
+static int read_tags_pages(ogg_demux *demux, ogg_demux_stream *opus, ogg_page **pages, size_t *count) {
+	size_t allocated = 0;
+	ogg_page *page;
+	int ret;
+	
+	do {
+		if (*count == allocated) {
+			allocated = allocated ? allocated * 2 : 4;
+			*pages = realloc(*pages, allocated * sizeof (ogg_page));
+		}
+		page = &(*pages)[*count];
+		ogg_page_init(page);
+		ret = ogg_demux_stream_read_page(demux, opus, page);
+		if (ret != OGG_SUCCESS)
+			return ret;
+		(*count)++;
+	} while (page->granule_pos == OGG_GRANULE_POS_NO_PACKET);
+	
+	return OGG_SUCCESS;
+}
+
+/* Write the tags pages to a new file, with the data of the new packet */
+static int write_tags_pages(const ogg_page *pages, size_t count, const uint8_t *packet, size_t len, ogg_stream *stream) {
+	size_t i, total = 0;
+	int ret;
+	
+	for (i = 0; i < count; i++)
+		total += pages[i].data_len;
+	if (total != len) {
+		ogg_error = "Packet does not fit in the existing pages";
+		return OGG_BAD_SIZE;
+	}
+	
+	for (i = 0; i < count; i++) {
+		ogg_page page = pages[i];
+		
+		page.data = (uint8_t *) packet;
+		page.storage = OGG_PAGE_STORAGE_BORROWED;
+		ret = ogg_page_write(&page, stream);
+		if (ret != OGG_SUCCESS)
+			return ret;
+		packet += page.data_len;
+	}
+	
+	return OGG_SUCCESS;
+}
+
+/* The tag changes from the command line, for apply_edits() */
+typedef struct tag_edit_list {
+	const tag_edit *edits;
+	size_t count;
+} tag_edit_list;
+
+static void apply_edit_list(oggopus_tags *tags, const tag_edit *edits, size_t count) {
+	size_t i;
+	
+	for (i = 0; i < count; i++) {
+		if (edits[i].value)
+			oggopus_tags_set(tags, edits[i].name, edits[i].value);
+		else
+			oggopus_tags_remove(tags, edits[i].name);
+	}
+}
+
+static bool apply_edits(oggopus_tags *tags, void *user) {
+	const tag_edit_list *list = user;
+	
+	apply_edit_list(tags, list->edits, list->count);
+	return true;
+}
 
 int main(int argc, char *argv[]) {
 	struct ogg_stream *infile = NULL, *outfile = NULL;
-	struct ogg_page header_page, tags_page;
-	int ret, err = 0;
-	uint32_t serial;
+	struct ogg_page header_page;
+	ogg_page *tags_pages = NULL;
+	size_t tags_page_count = 0;
+	ogg_demux demux;
+	ogg_demux_stream *opus = NULL;
+	oggopus_head head;
+	oggopus_tags tags;
+	tag_edit *edits = NULL;
+	size_t edit_count = 0;
+	uint8_t *packet = NULL;
+	size_t packet_len, padding = OPUSTAG_DEFAULT_PADDING, i;
+	const char *input, *output;
+	bool gains_only = false;
+	int opt, ret, err = 0;
+	uint64_t duration;
 	
 	ogg_page_init(&header_page);
-	ogg_page_init(&tags_page);
+	ogg_demux_init(&demux, NULL);
+	oggopus_tags_init(&tags);
 	
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s input.opus output.opus\n", argv[0]);
+	while ((opt = getopt(argc, argv, "gp:s:d:")) != -1) {
+		char *equals, *end;
+		
+		switch (opt) {
+		case 'g':
+			gains_only = true;
+			break;
+		case 'p':
+			padding = strtoul(optarg, &end, 10);
+			if (*end || end == optarg || padding > 255*255) {
+				fprintf(stderr, "Invalid padding size: %s\n", optarg);
+				err = 1;
+				goto error;
+			}
+			break;
+		case 's':
+			equals = strchr(optarg, '=');
+			if (!equals || equals == optarg) {
+				fprintf(stderr, "Tag must be in the form NAME=VALUE: %s\n", optarg);
+				err = 1;
+				goto error;
+			}
+			*equals = '\0';
+			edits = realloc(edits, (edit_count + 1) * sizeof (tag_edit));
+			edits[edit_count].name = optarg;
+			edits[edit_count++].value = equals + 1;
+			break;
+		case 'd':
+			edits = realloc(edits, (edit_count + 1) * sizeof (tag_edit));
+			edits[edit_count].name = optarg;
+			edits[edit_count++].value = NULL;
+			break;
+		default:
+			usage(argv[0]);
+			err = 1;
+			goto error;
+		}
+	}
+	
+	if (optind != argc - 1 && optind != argc - 2) {
+		usage(argv[0]);
 		err = 1;
 		goto error;
 	}
+	input = argv[optind];
+	output = argv[optind + 1];
 	
-	infile = ogg_stream_file_open_read(argv[1]);
-	if (!infile) {
-		fprintf(stderr, "Failed to open input file: %s\n", ogg_error);
+	if (gains_only && (edit_count > 0 || output || !strcmp(input, "-"))) {
+		usage(argv[0]);
 		err = 1;
 		goto error;
 	}
 	
-	ret = ogg_page_read(&header_page, infile);
-	if (ret != OGG_SUCCESS) {
-		fprintf(stderr, "Failed to read Ogg Page: %s\n", ogg_error);
+	if (!strcmp(input, "-")) {
+		if (edit_count > 0 && !output) {
+			fprintf(stderr, "An output file is needed when reading from a pipe\n");
+			err = 1;
+			goto error;
+		}
+		infile = ogg_stream_pipe_open(STDIN_FILENO);
+	} else {
+		infile = ogg_stream_mmap_open_read(input);
+	}
+	if (!infile) {
+		fprintf(stderr, "Failed to open input file: %s\n", ogg_error);
 		err = 1;
 		goto error;
 	}
+	
+	ogg_demux_init(&demux, infile);
+	
+	/* Look through the BOS pages of the first link for an Opus stream */
+	while (!opus) {
+		ogg_demux_stream *logical;
+		
+		ret = ogg_demux_read_page(&demux, &header_page, &logical);
+		if (ret != OGG_SUCCESS) {
+			fprintf(stderr, "Failed to read Ogg Page: %s\n", ogg_error);
+			err = 1;
+			goto error;
+		}
+		if (!(header_page.type & OGG_PAGE_TYPE_BOS)) {
+			fprintf(stderr, "File is not OggOpus!\n");
+			err = 1;
+			goto error;
+		}
+		
+		if (oggopus_recognize(&header_page, &head)) {
+			logical->discard = true;
+			ogg_page_clear(&header_page);
+			continue;
+		}
+		opus = logical;
+	}
 	fprintf(stderr, "Page contains %d data bytes\n", header_page.data_len);
-
-	if (oggopus_recognize(&header_page)) {
-		fprintf(stderr, "File is not OggOpus!\n");
-		err = 1;
+	printf("OggOpus found in stream serial %#x\n", header_page.serial);
+	printf("Channels: %d (mapping family %d, %d streams, %d coupled)\n",
+		head.channels, head.mapping_family, head.stream_count, head.coupled_count);
+	printf("Output gain: %.2f dB\n", head.output_gain / 256.0);
+	
+	ret = oggopus_duration(&head, infile, header_page.serial, &duration);
+	if (ret == OGG_SUCCESS)
+		printf("Duration: %.3f seconds\n", duration / 48000.0);
+	else
+		fprintf(stderr, "Duration unknown: %s\n", ogg_error);
+	
+	if (gains_only) {
+		ret = oggopus_read_tags(input, &tags, gain_tag_names);
+		if (ret != OGG_SUCCESS) {
+			fprintf(stderr, "Failed to read OpusTags: %s\n", ogg_error);
+			err = 1;
+			goto error;
+		}
+		printf("Vendor: %s\n", tags.vendor);
+		for (i = 0; i < tags.count; i++)
+			printf("%s\n", tags.comments[i].data);
 		goto error;
 	}
-	serial = header_page.serial;
-	printf("OggOpus found in stream serial %#x\n", header_page.serial);
-
-
-	ret = ogg_page_read(&tags_page, infile);
+	
+	ret = read_tags_pages(&demux, opus, &tags_pages, &tags_page_count);
 	if (ret != OGG_SUCCESS) {
 		fprintf(stderr, "Failed to read Ogg Page: %s\n", ogg_error);
 		err = 1;
 		goto error;
 	}
-	if (tags_page.serial != serial) {
-		fprintf(stderr, "Multi-stream files are not supported\n");
-		err = 1;
-		goto error;
-	}
 	
+	packet_len = 0;
+	for (i = 0; i < tags_page_count; i++)
+		packet_len += tags_pages[i].data_len;
+	fprintf(stderr, "Tags span %zu pages, %zu data bytes\n", tags_page_count, packet_len);
 	
-	fprintf(stderr, "Page contains %d data bytes\n", tags_page.data_len);
-
-	outfile = ogg_stream_file_open(argv[2]);
-	if (!outfile) {
-		fprintf(stderr, "Failed to open output file: %s\n", ogg_error);
-		err = 1;
-		goto error;
+	packet = malloc(packet_len);
+	packet_len = 0;
+	for (i = 0; i < tags_page_count; i++) {
+		memcpy(&packet[packet_len], tags_pages[i].data, tags_pages[i].data_len);
+		packet_len += tags_pages[i].data_len;
 	}
 	
-	ret = ogg_page_write(&header_page, outfile);
+	ret = oggopus_tags_parse(&tags, packet, packet_len);
 	if (ret != OGG_SUCCESS) {
-		fprintf(stderr, "Failed to write Ogg Page: %s\n", ogg_error);
+		fprintf(stderr, "Failed to parse OpusTags: %s\n", ogg_error);
 		err = 1;
 		goto error;
 	}
-	ret = ogg_page_write(&tags_page, outfile);
+	
+	apply_edit_list(&tags, edits, edit_count);
+	
+	printf("Vendor: %s\n", tags.vendor);
+	for (i = 0; i < tags.count; i++)
+		printf("%s\n", tags.comments[i].data);
+	
+	/* Absorb a change in size into the padding if possible, so that the
+	 * tags can be written in place, otherwise leave room for next time */
+	if (!oggopus_tags_fit(&tags, packet_len))
+		oggopus_tags_set_padding(&tags, padding);
+	
+	free(packet);
+	packet_len = oggopus_tags_length(&tags);
+	packet = malloc(packet_len);
+	oggopus_tags_write(&tags, packet);
+	
+	if (output) {
+		const ogg_page *last = &tags_pages[tags_page_count - 1];
+		uint32_t seq = tags_pages[0].seq;
+		
+		/* Pages of other streams read before this point would be lost */
+		if (demux.streams != opus || opus->next) {
+			fprintf(stderr, "Only files with a single logical stream can be rewritten\n");
+			err = 1;
+			goto error;
+		}
+		
+		outfile = ogg_stream_file_create(output);
+		if (!outfile) {
+			fprintf(stderr, "Failed to open output file: %s\n", ogg_error);
+			err = 1;
+			goto error;
+		}
+		
+		ret = ogg_page_write(&header_page, outfile);
+		if (ret != OGG_SUCCESS) {
+			fprintf(stderr, "Failed to write Ogg Page: %s\n", ogg_error);
+			err = 1;
+			goto error;
+		}
+		
+		/* Keep the old page layout if possible, otherwise the pages after
+		 * the tags have to be renumbered */
+		ret = write_tags_pages(tags_pages, tags_page_count, packet, packet_len, outfile);
+		if (ret == OGG_SUCCESS)
+			seq = last->seq + 1;
+		else if (ret == OGG_BAD_SIZE)
+			ret = ogg_packet_write(packet, packet_len, last->granule_pos,
+				last->serial, &seq, outfile);
+		if (ret == OGG_SUCCESS)
+			ret = ogg_stream_copy_pages(infile, outfile, opus->serial,
+				seq - (last->seq + 1));
+	} else if (edit_count > 0) {
+		tag_edit_list list = { edits, edit_count };
+		
+		/* Patch only the tags pages if possible, leaving the rest of the
+		 * file alone */
+		ret = oggopus_update_tags(input, apply_edits, &list, padding);
+	}
 	if (ret != OGG_SUCCESS) {
 		fprintf(stderr, "Failed to write Ogg Page: %s\n", ogg_error);
 		err = 1;
@@ -98,17 +354,24 @@ int main(int argc, char *argv[]) {
 error:
 
 	if (outfile) {
-		ogg_stream_file_close(outfile);
+		ogg_stream_close(outfile);
 		outfile = NULL;
 	}
 	
+	ogg_demux_clear(&demux);
+	
 	if (infile) {
-		ogg_stream_file_close(infile);
+		ogg_stream_close(infile);
 		infile = NULL;
 	}
-
+	
 	ogg_page_clear(&header_page);
-	ogg_page_clear(&tags_page);
+	for (i = 0; i < tags_page_count; i++)
+		ogg_page_clear(&tags_pages[i]);
+	free(tags_pages);
+	oggopus_tags_clear(&tags);
+	free(packet);
+	free(edits);
 	
 	return err;
 }
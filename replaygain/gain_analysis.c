@@ -32,11 +32,13 @@
 /*
  *  Here's the deal. Call
  *
- *    InitGainAnalysis ( long samplefreq );
+ *    InitGainAnalysis ( replaygain_t* rg, long samplefreq );
  *
- *  to initialize everything. Call
+ *  to initialize everything. All state is kept in *rg, so several
+ *  streams can be analysed at once with separate states. Call
  *
- *    AnalyzeSamples ( const Float_t*  left_samples,
+ *    AnalyzeSamples ( replaygain_t*   rg,
+ *                     const Float_t*  left_samples,
  *                     const Float_t*  right_samples,
  *                     size_t          num_samples,
  *                     int             num_channels );
@@ -45,15 +47,17 @@
  *  If mono, pass the sample buffer in through left_samples, leave
  *  right_samples NULL, and make sure num_channels = 1.
  *
- *    GetTitleGain()
+ *    GetTitleGain(rg)
  *
  *  will return the recommended dB level change for all samples analyzed
  *  SINCE THE LAST TIME you called GetTitleGain() OR InitGainAnalysis().
  *
- *    GetAlbumGain()
+ *    GetAlbumGain(rg)
  *
  *  will return the recommended dB level change for all samples analyzed
  *  since InitGainAnalysis() was called and finalized with GetTitleGain().
+ *  Titles analysed with different states can be combined into one album
+ *  with AccumulateAlbumGain() and GetAccumulatedGain().
  *
  *  Pseudo-code to process an album:
  *
@@ -63,13 +67,15 @@
  *    unsigned int  num_songs;
  *    unsigned int  i;
  *
- *    InitGainAnalysis ( 44100 );
+ *    replaygain_t  rg;
+ *
+ *    InitGainAnalysis ( &rg, 44100 );
  *    for ( i = 1; i <= num_songs; i++ ) {
  *        while ( ( num_samples = getSongSamples ( song[i], left_samples, right_samples ) ) > 0 )
- *            AnalyzeSamples ( left_samples, right_samples, num_samples, 2 );
- *        fprintf ("Recommended dB change for song %2d: %+6.2f dB\n", i, GetTitleGain() );
+ *            AnalyzeSamples ( &rg, left_samples, right_samples, num_samples, 2 );
+ *        fprintf ("Recommended dB change for song %2d: %+6.2f dB\n", i, GetTitleGain(&rg) );
  *    }
- *    fprintf ("Recommended dB change for whole album: %+6.2f dB\n", GetAlbumGain() );
+ *    fprintf ("Recommended dB change for whole album: %+6.2f dB\n", GetAlbumGain(&rg) );
  */
 
 /*
@@ -96,7 +102,6 @@
 
 typedef unsigned short  Uint16_t;
 typedef signed short    Int16_t;
-typedef unsigned int    Uint32_t;
 typedef signed int      Int32_t;
 
 #define YULE_ORDER         10
@@ -107,30 +112,9 @@ typedef signed int      Int32_t;
 #define STEPS_per_dB      100.          /* Table entries per dB */
 #define MAX_dB            120.          /* Table entries for 0...MAX_dB (normal max. values are 70...80 dB) */
 
-#define MAX_ORDER               (BUTTER_ORDER > YULE_ORDER ? BUTTER_ORDER : YULE_ORDER)
-#define MAX_SAMPLES_PER_WINDOW  (size_t) (MAX_SAMP_FREQ * RMS_WINDOW_TIME + 1)        /* max. Samples per Time slice */
+#define MAX_ORDER               GAIN_ANALYSIS_MAX_ORDER
 #define PINK_REF                64.82 /* 298640883795 */                          /* calibration value */
 
-Float_t          linprebuf [MAX_ORDER * 2];
-Float_t*         linpre;                                          /* left input samples, with pre-buffer */
-Float_t          lstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t*         lstep;                                           /* left "first step" (i.e. post first filter) samples */
-Float_t          loutbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t*         lout;                                            /* left "out" (i.e. post second filter) samples */
-Float_t          rinprebuf [MAX_ORDER * 2];
-Float_t*         rinpre;                                          /* right input samples ... */
-Float_t          rstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t*         rstep;
-Float_t          routbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t*         rout;
-unsigned int              sampleWindow;                           /* number of samples required to reach number of milliseconds required for RMS window */
-unsigned long    totsamp;
-double           lsum;
-double           rsum;
-int              freqindex;
-int              first;
-static Uint32_t  A [(size_t)(STEPS_per_dB * MAX_dB)];
-static Uint32_t  B [(size_t)(STEPS_per_dB * MAX_dB)];
 
 /* for each filter:
    [0] 48 kHz, [1] 44.1 kHz, [2] 32 kHz, [3] 24 kHz, [4] 22050 Hz, [5] 16 kHz, [6] 12 kHz, [7] is 11025 Hz, [8] 8 kHz */
@@ -211,52 +195,52 @@ filter ( const Float_t* input, Float_t* output, size_t nSamples, const Float_t*
 /* returns a INIT_GAIN_ANALYSIS_OK if successful, INIT_GAIN_ANALYSIS_ERROR if not */
 
 int
-ResetSampleFrequency ( long samplefreq ) {
+ResetSampleFrequency ( replaygain_t* rg, long samplefreq ) {
     int  i;
 
     /* zero out initial values */
     for ( i = 0; i < MAX_ORDER; i++ )
-        linprebuf[i] = lstepbuf[i] = loutbuf[i] = rinprebuf[i] = rstepbuf[i] = routbuf[i] = 0.;
+        rg->linprebuf[i] = rg->lstepbuf[i] = rg->loutbuf[i] = rg->rinprebuf[i] = rg->rstepbuf[i] = rg->routbuf[i] = 0.;
 
     switch ( (int)(samplefreq) ) {
-        case 48000: freqindex = 0; break;
-        case 44100: freqindex = 1; break;
-        case 32000: freqindex = 2; break;
-        case 24000: freqindex = 3; break;
-        case 22050: freqindex = 4; break;
-        case 16000: freqindex = 5; break;
-        case 12000: freqindex = 6; break;
-        case 11025: freqindex = 7; break;
-        case  8000: freqindex = 8; break;
+        case 48000: rg->freqindex = 0; break;
+        case 44100: rg->freqindex = 1; break;
+        case 32000: rg->freqindex = 2; break;
+        case 24000: rg->freqindex = 3; break;
+        case 22050: rg->freqindex = 4; break;
+        case 16000: rg->freqindex = 5; break;
+        case 12000: rg->freqindex = 6; break;
+        case 11025: rg->freqindex = 7; break;
+        case  8000: rg->freqindex = 8; break;
         default:    return INIT_GAIN_ANALYSIS_ERROR;
     }
 
-    sampleWindow = (int) ceil (samplefreq * RMS_WINDOW_TIME);
+    rg->sampleWindow = (int) ceil (samplefreq * RMS_WINDOW_TIME);
 
-    lsum         = 0.;
-    rsum         = 0.;
-    totsamp      = 0;
+    rg->lsum         = 0.;
+    rg->rsum         = 0.;
+    rg->totsamp      = 0;
 
-    memset ( A, 0, sizeof(A) );
+    memset ( rg->A, 0, sizeof(rg->A) );
 
 	return INIT_GAIN_ANALYSIS_OK;
 }
 
 int
-InitGainAnalysis ( long samplefreq )
+InitGainAnalysis ( replaygain_t* rg, long samplefreq )
 {
-	if (ResetSampleFrequency(samplefreq) != INIT_GAIN_ANALYSIS_OK) {
+	if (ResetSampleFrequency(rg, samplefreq) != INIT_GAIN_ANALYSIS_OK) {
 		return INIT_GAIN_ANALYSIS_ERROR;
 	}
 
-    linpre       = linprebuf + MAX_ORDER;
-    rinpre       = rinprebuf + MAX_ORDER;
-    lstep        = lstepbuf  + MAX_ORDER;
-    rstep        = rstepbuf  + MAX_ORDER;
-    lout         = loutbuf   + MAX_ORDER;
-    rout         = routbuf   + MAX_ORDER;
+    rg->linpre       = rg->linprebuf + MAX_ORDER;
+    rg->rinpre       = rg->rinprebuf + MAX_ORDER;
+    rg->lstep        = rg->lstepbuf  + MAX_ORDER;
+    rg->rstep        = rg->rstepbuf  + MAX_ORDER;
+    rg->lout         = rg->loutbuf   + MAX_ORDER;
+    rg->rout         = rg->routbuf   + MAX_ORDER;
 
-    memset ( B, 0, sizeof(B) );
+    memset ( rg->B, 0, sizeof(rg->B) );
 
     return INIT_GAIN_ANALYSIS_OK;
 }
@@ -264,7 +248,7 @@ InitGainAnalysis ( long samplefreq )
 /* returns GAIN_ANALYSIS_OK if successful, GAIN_ANALYSIS_ERROR if not */
 
 int
-AnalyzeSamples ( const Float_t* left_samples, const Float_t* right_samples, size_t num_samples, int num_channels )
+AnalyzeSamples ( replaygain_t* rg, const Float_t* left_samples, const Float_t* right_samples, size_t num_samples, int num_channels )
 {
     const Float_t*  curleft;
     const Float_t*  curright;
@@ -286,19 +270,19 @@ AnalyzeSamples ( const Float_t* left_samples, const Float_t* right_samples, size
     }
 
     if ( num_samples < MAX_ORDER ) {
-        memcpy ( linprebuf + MAX_ORDER, left_samples , num_samples * sizeof(Float_t) );
-        memcpy ( rinprebuf + MAX_ORDER, right_samples, num_samples * sizeof(Float_t) );
+        memcpy ( rg->linprebuf + MAX_ORDER, left_samples , num_samples * sizeof(Float_t) );
+        memcpy ( rg->rinprebuf + MAX_ORDER, right_samples, num_samples * sizeof(Float_t) );
     }
     else {
-        memcpy ( linprebuf + MAX_ORDER, left_samples,  MAX_ORDER   * sizeof(Float_t) );
-        memcpy ( rinprebuf + MAX_ORDER, right_samples, MAX_ORDER   * sizeof(Float_t) );
+        memcpy ( rg->linprebuf + MAX_ORDER, left_samples,  MAX_ORDER   * sizeof(Float_t) );
+        memcpy ( rg->rinprebuf + MAX_ORDER, right_samples, MAX_ORDER   * sizeof(Float_t) );
     }
 
     while ( batchsamples > 0 ) {
-        cursamples = batchsamples > sampleWindow-totsamp  ?  sampleWindow - totsamp  :  batchsamples;
+        cursamples = batchsamples > rg->sampleWindow-rg->totsamp  ?  rg->sampleWindow - rg->totsamp  :  batchsamples;
         if ( cursamplepos < MAX_ORDER ) {
-            curleft  = linpre+cursamplepos;
-            curright = rinpre+cursamplepos;
+            curleft  = rg->linpre+cursamplepos;
+            curright = rg->rinpre+cursamplepos;
             if (cursamples > MAX_ORDER - cursamplepos )
                 cursamples = MAX_ORDER - cursamplepos;
         }
@@ -307,45 +291,45 @@ AnalyzeSamples ( const Float_t* left_samples, const Float_t* right_samples, size
             curright = right_samples + cursamplepos;
         }
 
-        filter ( curleft , lstep + totsamp, cursamples, AYule[freqindex], BYule[freqindex], YULE_ORDER );
-        filter ( curright, rstep + totsamp, cursamples, AYule[freqindex], BYule[freqindex], YULE_ORDER );
+        filter ( curleft , rg->lstep + rg->totsamp, cursamples, AYule[rg->freqindex], BYule[rg->freqindex], YULE_ORDER );
+        filter ( curright, rg->rstep + rg->totsamp, cursamples, AYule[rg->freqindex], BYule[rg->freqindex], YULE_ORDER );
 
-        filter ( lstep + totsamp, lout + totsamp, cursamples, AButter[freqindex], BButter[freqindex], BUTTER_ORDER );
-        filter ( rstep + totsamp, rout + totsamp, cursamples, AButter[freqindex], BButter[freqindex], BUTTER_ORDER );
+        filter ( rg->lstep + rg->totsamp, rg->lout + rg->totsamp, cursamples, AButter[rg->freqindex], BButter[rg->freqindex], BUTTER_ORDER );
+        filter ( rg->rstep + rg->totsamp, rg->rout + rg->totsamp, cursamples, AButter[rg->freqindex], BButter[rg->freqindex], BUTTER_ORDER );
 
         for ( i = 0; i < cursamples; i++ ) {             /* Get the squared values */
-            lsum += lout [totsamp+i] * lout [totsamp+i];
-            rsum += rout [totsamp+i] * rout [totsamp+i];
+            rg->lsum += rg->lout [rg->totsamp+i] * rg->lout [rg->totsamp+i];
+            rg->rsum += rg->rout [rg->totsamp+i] * rg->rout [rg->totsamp+i];
         }
 
         batchsamples -= cursamples;
         cursamplepos += cursamples;
-        totsamp      += cursamples;
-        if ( totsamp == sampleWindow ) {  /* Get the Root Mean Square (RMS) for this set of samples */
-            double  val  = STEPS_per_dB * 10. * log10 ( (lsum+rsum) / totsamp * 0.5 + 1.e-37 );
+        rg->totsamp      += cursamples;
+        if ( rg->totsamp == rg->sampleWindow ) {  /* Get the Root Mean Square (RMS) for this set of samples */
+            double  val  = STEPS_per_dB * 10. * log10 ( (rg->lsum+rg->rsum) / rg->totsamp * 0.5 + 1.e-37 );
             int     ival = (int) val;
             if ( ival <                     0 ) ival = 0;
-            if ( ival >= sizeof(A)/sizeof(*A) ) ival = sizeof(A)/sizeof(*A) - 1;
-            A [ival]++;
-            lsum = rsum = 0.;
-            memmove ( loutbuf , loutbuf  + totsamp, MAX_ORDER * sizeof(Float_t) );
-            memmove ( routbuf , routbuf  + totsamp, MAX_ORDER * sizeof(Float_t) );
-            memmove ( lstepbuf, lstepbuf + totsamp, MAX_ORDER * sizeof(Float_t) );
-            memmove ( rstepbuf, rstepbuf + totsamp, MAX_ORDER * sizeof(Float_t) );
-            totsamp = 0;
+            if ( ival >= sizeof(rg->A)/sizeof(*rg->A) ) ival = sizeof(rg->A)/sizeof(*rg->A) - 1;
+            rg->A [ival]++;
+            rg->lsum = rg->rsum = 0.;
+            memmove ( rg->loutbuf , rg->loutbuf  + rg->totsamp, MAX_ORDER * sizeof(Float_t) );
+            memmove ( rg->routbuf , rg->routbuf  + rg->totsamp, MAX_ORDER * sizeof(Float_t) );
+            memmove ( rg->lstepbuf, rg->lstepbuf + rg->totsamp, MAX_ORDER * sizeof(Float_t) );
+            memmove ( rg->rstepbuf, rg->rstepbuf + rg->totsamp, MAX_ORDER * sizeof(Float_t) );
+            rg->totsamp = 0;
         }
-        if ( totsamp > sampleWindow )   /* somehow I really screwed up: Error in programming! Contact author about totsamp > sampleWindow */
+        if ( rg->totsamp > rg->sampleWindow )   /* somehow I really screwed up: Error in programming! Contact author about rg->totsamp > rg->sampleWindow */
             return GAIN_ANALYSIS_ERROR;
     }
     if ( num_samples < MAX_ORDER ) {
-        memmove ( linprebuf,                           linprebuf + num_samples, (MAX_ORDER-num_samples) * sizeof(Float_t) );
-        memmove ( rinprebuf,                           rinprebuf + num_samples, (MAX_ORDER-num_samples) * sizeof(Float_t) );
-        memcpy  ( linprebuf + MAX_ORDER - num_samples, left_samples,          num_samples             * sizeof(Float_t) );
-        memcpy  ( rinprebuf + MAX_ORDER - num_samples, right_samples,         num_samples             * sizeof(Float_t) );
+        memmove ( rg->linprebuf,                           rg->linprebuf + num_samples, (MAX_ORDER-num_samples) * sizeof(Float_t) );
+        memmove ( rg->rinprebuf,                           rg->rinprebuf + num_samples, (MAX_ORDER-num_samples) * sizeof(Float_t) );
+        memcpy  ( rg->linprebuf + MAX_ORDER - num_samples, left_samples,          num_samples             * sizeof(Float_t) );
+        memcpy  ( rg->rinprebuf + MAX_ORDER - num_samples, right_samples,         num_samples             * sizeof(Float_t) );
     }
     else {
-        memcpy  ( linprebuf, left_samples  + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t) );
-        memcpy  ( rinprebuf, right_samples + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t) );
+        memcpy  ( rg->linprebuf, left_samples  + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t) );
+        memcpy  ( rg->rinprebuf, right_samples + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t) );
     }
 
     return GAIN_ANALYSIS_OK;
@@ -353,7 +337,7 @@ AnalyzeSamples ( const Float_t* left_samples, const Float_t* right_samples, size
 
 
 static Float_t
-analyzeResult ( Uint32_t* Array, size_t len )
+analyzeResult ( const Uint32_t* Array, size_t len )
 {
     Uint32_t  elems;
     Int32_t   upper;
@@ -376,31 +360,50 @@ analyzeResult ( Uint32_t* Array, size_t len )
 
 
 Float_t
-GetTitleGain ( void )
+GetTitleGain ( replaygain_t* rg )
 {
     Float_t  retval;
     int    i;
 
-    retval = analyzeResult ( A, sizeof(A)/sizeof(*A) );
+    retval = analyzeResult ( rg->A, sizeof(rg->A)/sizeof(*rg->A) );
 
-    for ( i = 0; i < sizeof(A)/sizeof(*A); i++ ) {
-        B[i] += A[i];
-        A[i]  = 0;
+    for ( i = 0; i < sizeof(rg->A)/sizeof(*rg->A); i++ ) {
+        rg->B[i] += rg->A[i];
+        rg->A[i]  = 0;
     }
 
     for ( i = 0; i < MAX_ORDER; i++ )
-        linprebuf[i] = lstepbuf[i] = loutbuf[i] = rinprebuf[i] = rstepbuf[i] = routbuf[i] = 0.f;
+        rg->linprebuf[i] = rg->lstepbuf[i] = rg->loutbuf[i] = rg->rinprebuf[i] = rg->rstepbuf[i] = rg->routbuf[i] = 0.f;
 
-    totsamp = 0;
-    lsum    = rsum = 0.;
+    rg->totsamp = 0;
+    rg->lsum    = rg->rsum = 0.;
     return retval;
 }
 
 
 Float_t
-GetAlbumGain ( void )
+GetAlbumGain ( const replaygain_t* rg )
+{
+    return analyzeResult ( rg->B, sizeof(rg->B)/sizeof(*rg->B) );
+}
+
+/* Add the titles analysed since InitGainAnalysis() to a separate album
+   histogram, so that albums can be collected across several states */
+
+void
+AccumulateAlbumGain ( Uint32_t* histogram, const replaygain_t* rg )
+{
+    size_t  i;
+
+    for ( i = 0; i < GAIN_ANALYSIS_TABLE_SIZE; i++ )
+        histogram[i] += rg->B[i];
+}
+
+
+Float_t
+GetAccumulatedGain ( const Uint32_t* histogram )
 {
-    return analyzeResult ( B, sizeof(B)/sizeof(*B) );
+    return analyzeResult ( histogram, GAIN_ANALYSIS_TABLE_SIZE );
 }
 
 /* end of gain_analysis.c */
@@ -42,12 +42,44 @@ extern "C" {
 #endif
 
 typedef float   Float_t;         /* Type used for filtering */
+typedef unsigned int    Uint32_t;
 
-int     InitGainAnalysis ( long samplefreq );
-int     AnalyzeSamples   ( const Float_t* left_samples, const Float_t* right_samples, size_t num_samples, int num_channels );
-int		ResetSampleFrequency ( long samplefreq );
-Float_t   GetTitleGain     ( void );
-Float_t   GetAlbumGain     ( void );
+#define GAIN_ANALYSIS_MAX_ORDER     10      /* the longest filter, YULE_ORDER */
+#define GAIN_ANALYSIS_MAX_WINDOW    2401    /* samples per 50 ms RMS window at 48 kHz, plus one */
+#define GAIN_ANALYSIS_TABLE_SIZE    12000   /* 100 table entries per dB, 0...120 dB */
+
+/* All analysis state, so that several streams can be analysed at once, for
+   example one per thread. The input pointers point into the buffers of the
+   same structure, so it must not be copied after InitGainAnalysis(). */
+typedef struct replaygain_data {
+    Float_t          linprebuf [GAIN_ANALYSIS_MAX_ORDER * 2];
+    Float_t*         linpre;                                          /* left input samples, with pre-buffer */
+    Float_t          lstepbuf  [GAIN_ANALYSIS_MAX_WINDOW + GAIN_ANALYSIS_MAX_ORDER];
+    Float_t*         lstep;                                           /* left "first step" (i.e. post first filter) samples */
+    Float_t          loutbuf   [GAIN_ANALYSIS_MAX_WINDOW + GAIN_ANALYSIS_MAX_ORDER];
+    Float_t*         lout;                                            /* left "out" (i.e. post second filter) samples */
+    Float_t          rinprebuf [GAIN_ANALYSIS_MAX_ORDER * 2];
+    Float_t*         rinpre;                                          /* right input samples ... */
+    Float_t          rstepbuf  [GAIN_ANALYSIS_MAX_WINDOW + GAIN_ANALYSIS_MAX_ORDER];
+    Float_t*         rstep;
+    Float_t          routbuf   [GAIN_ANALYSIS_MAX_WINDOW + GAIN_ANALYSIS_MAX_ORDER];
+    Float_t*         rout;
+    unsigned int     sampleWindow;                                    /* number of samples required to reach number of milliseconds required for RMS window */
+    unsigned long    totsamp;
+    double           lsum;
+    double           rsum;
+    int              freqindex;
+    Uint32_t         A [GAIN_ANALYSIS_TABLE_SIZE];                    /* histogram of the current title */
+    Uint32_t         B [GAIN_ANALYSIS_TABLE_SIZE];                    /* histogram of the titles since InitGainAnalysis() */
+} replaygain_t;
+
+int     InitGainAnalysis ( replaygain_t* rg, long samplefreq );
+int     AnalyzeSamples   ( replaygain_t* rg, const Float_t* left_samples, const Float_t* right_samples, size_t num_samples, int num_channels );
+int		ResetSampleFrequency ( replaygain_t* rg, long samplefreq );
+Float_t   GetTitleGain     ( replaygain_t* rg );
+Float_t   GetAlbumGain     ( const replaygain_t* rg );
+void      AccumulateAlbumGain ( Uint32_t* histogram, const replaygain_t* rg );
+Float_t   GetAccumulatedGain  ( const Uint32_t* histogram );
 
 #ifdef __cplusplus
 }